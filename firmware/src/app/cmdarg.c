@@ -0,0 +1,91 @@
+/**
+ * @author Neo Xu (neo.xu1990@gmail.com)
+ * @license The MIT License (MIT)
+ * 
+ * Copyright (c) 2019 Neo Xu
+ * 
+ * @brief helpers to convert ush command arguments to numbers.
+ * All of them return 0 on success and -1 if string is not a valid number.
+*/
+#include "cmdarg.h"
+#include "string.h"
+#include "ush.h"
+
+/**
+ * @brief get an unsigned integer, decimal or hex(0x).
+*/
+int32_t cmdarg_uint(const char *str, uint32_t *value){
+  ush_num_def numtype;
+  uint32_t num;
+  if(str == 0 || value == 0) return -1;
+  if(ush_str2num(str, strlen(str), &numtype, &num) != ush_error_ok)
+    return -1;
+  if(numtype == ush_num_float)
+    return -1;
+  if(numtype == ush_num_int32 && (int32_t)num < 0)
+    return -1;
+  *value = num;
+  return 0;
+}
+
+/**
+ * @brief get a signed integer.
+*/
+int32_t cmdarg_int(const char *str, int32_t *value){
+  ush_num_def numtype;
+  uint32_t num;
+  if(str == 0 || value == 0) return -1;
+  if(ush_str2num(str, strlen(str), &numtype, &num) != ush_error_ok)
+    return -1;
+  if(numtype == ush_num_float)
+    return -1;
+  *value = (int32_t)num;
+  return 0;
+}
+
+/**
+ * @brief get a float, integer input is converted.
+*/
+int32_t cmdarg_float(const char *str, float *value){
+  ush_num_def numtype;
+  float num;
+  if(str == 0 || value == 0) return -1;
+  if(ush_str2num(str, strlen(str), &numtype, &num) != ush_error_ok)
+    return -1;
+  if(numtype == ush_num_int32)
+    num = *(int32_t*)&num;
+  else if(numtype == ush_num_uint32)
+    num = *(uint32_t*)&num;
+  *value = num;
+  return 0;
+}
+
+/**
+ * @brief get a voltage in V as nV, parsed from decimal digits so all 9
+ * fractional digits are kept, more digits are rounded. e.g. 1.2345678905
+ * @return 0 if ok, -1 if not a positive decimal number.
+*/
+int32_t cmdarg_volt_nv(const char *str, uint64_t *nv){
+  uint64_t integer = 0, frac = 0;
+  uint32_t digits = 0;
+  if(str == 0 || nv == 0 || *str == 0) return -1;
+  for(; *str >= '0' && *str <= '9'; str++){
+    integer = integer*10 + (*str - '0');
+    if(integer > 1000) return -1;   /* DAC output is far below */
+  }
+  if(*str == '.'){
+    for(str++; *str >= '0' && *str <= '9'; str++){
+      if(digits < 9){
+        frac = frac*10 + (*str - '0');
+        digits++;
+      }
+      else if(digits++ == 9 && *str >= '5')
+        frac++;   /* round on the 10th digit */
+    }
+  }
+  if(*str != 0) return -1;
+  for(; digits < 9; digits++)
+    frac *= 10;
+  *nv = integer*1000000000ull + frac;
+  return 0;
+}
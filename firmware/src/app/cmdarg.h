@@ -0,0 +1,18 @@
+/**
+ * @author Neo Xu (neo.xu1990@gmail.com)
+ * @license The MIT License (MIT)
+ * 
+ * Copyright (c) 2019 Neo Xu
+ * 
+ * @brief helpers to convert ush command arguments to numbers.
+*/
+#ifndef _CMDARG_H_
+#define _CMDARG_H_
+#include "stdint.h"
+
+int32_t cmdarg_uint(const char *str, uint32_t *value);
+int32_t cmdarg_int(const char *str, int32_t *value);
+int32_t cmdarg_float(const char *str, float *value);
+int32_t cmdarg_volt_nv(const char *str, uint64_t *nv);
+
+#endif
@@ -0,0 +1,231 @@
+/**
+ * @author Neo Xu (neo.xu1990@gmail.com)
+ * @license The MIT License (MIT)
+ * 
+ * Copyright (c) 2019 Neo Xu
+ * 
+ * @brief direct digital synthesis of sine/triangle/square wave.
+ * A 32bit phase accumulator is stepped from sample clock interrupt. Shape is
+ * in Q24 and scaled to DAC code with integer math, M0 has no FPU.
+*/
+#include "dds.h"
+#include "ad5791.h"
+#include "timer.h"
+#include "cmdarg.h"
+#include "string.h"
+#include "printf.h"
+#include "ush.h"
+
+#if VOLTREF_USE_DDS
+#define DDS_Q24         (1UL<<24)   //full scale of shape.
+#define DDS_QUARTER     256         //table entries per quarter wave.
+
+/**
+ * Quarter-wave sine table in Q24, built by compiler: sin(x) with Taylor series
+ * up to x^13 for x in [0, pi/2], error is below 1LSB of Q24.
+*/
+#define DDS_PI          3.14159265358979323846
+#define DDS_X(i)        ((i)*(DDS_PI/2/DDS_QUARTER))
+#define DDS_SIN(x)      ((x)*(1-(x)*(x)/6*(1-(x)*(x)/20*(1-(x)*(x)/42*(1-(x)*(x)/72*\
+                        (1-(x)*(x)/110*(1-(x)*(x)/156)))))))
+#define DDS_ENTRY(i)    (uint32_t)(DDS_SIN(DDS_X(i))*DDS_Q24 + 0.5)
+#define DDS_ROW8(i)     DDS_ENTRY(i), DDS_ENTRY(i+1), DDS_ENTRY(i+2), DDS_ENTRY(i+3),\
+                        DDS_ENTRY(i+4), DDS_ENTRY(i+5), DDS_ENTRY(i+6), DDS_ENTRY(i+7)
+#define DDS_ROW64(i)    DDS_ROW8(i), DDS_ROW8(i+8), DDS_ROW8(i+16), DDS_ROW8(i+24),\
+                        DDS_ROW8(i+32), DDS_ROW8(i+40), DDS_ROW8(i+48), DDS_ROW8(i+56)
+/* one more entry at pi/2 so interpolation never reads out of table. */
+static const uint32_t sine_table[DDS_QUARTER+1] = {
+  DDS_ROW64(0), DDS_ROW64(64), DDS_ROW64(128), DDS_ROW64(192), DDS_ENTRY(DDS_QUARTER)
+};
+
+static volatile uint32_t dds_phase = 0;
+static volatile uint32_t dds_tuning = 0;    //phase step per sample.
+static volatile uint32_t dds_amp = 0;       //peak amplitude in code.
+static volatile int32_t dds_offset = 0;     //offset in code.
+static volatile dds_shape_def dds_shape = dds_shape_sine;
+static uint32_t dds_period = 0;             //sample period in sample clocks.
+
+/**
+ * @brief position inside the quarter wave, 8bit table index and 14bit fraction.
+ * Second and fourth quarters run backward.
+*/
+static uint32_t dds_quarter_pos(uint32_t phase){
+  uint32_t pos = (phase>>8)&0x3fffff;
+  if(phase & 0x40000000)
+    pos = 0x400000 - pos;
+  return pos;
+}
+
+static int32_t dds_sine(uint32_t phase){
+  uint32_t pos = dds_quarter_pos(phase);
+  uint32_t index = pos>>14, frac = pos&0x3fff;
+  int32_t value = sine_table[index];
+  if(index < DDS_QUARTER)  //slope*frac fits 31bits
+    value += ((sine_table[index+1] - sine_table[index])*frac)>>14;
+  return (phase & 0x80000000) ? -value : value;
+}
+
+static int32_t dds_triangle(uint32_t phase){
+  int32_t value = dds_quarter_pos(phase)<<2;
+  return (phase & 0x80000000) ? -value : value;
+}
+
+/**
+ * @brief output one sample, called from sample clock interrupt.
+ * @return none.
+*/
+static void dds_sample(void){
+  uint32_t phase = dds_phase + dds_tuning;
+  int32_t shape, code;
+  dds_phase = phase;
+  switch(dds_shape){
+    case dds_shape_sine: shape = dds_sine(phase); break;
+    case dds_shape_triangle: shape = dds_triangle(phase); break;
+    default: shape = (phase & 0x80000000) ? -(int32_t)DDS_Q24 : (int32_t)DDS_Q24; break;
+  }
+  code = dds_offset + (int32_t)(((int64_t)dds_amp*shape + (DDS_Q24>>1))>>24);
+  if(code < 0) code = 0;
+  else if(code > 0xfffff) code = 0xfffff;
+  ad5791_write_data(code);
+}
+
+/**
+ * @brief sample rate really used by DDS.
+*/
+static double dds_sample_rate(void){
+  uint32_t period = dds_period;
+  if(period == 0) //not started yet, use the period sample clock will get.
+    period = (TIMER_SAMPLE_CLOCK + DDS_SAMPLE_RATE/2)/DDS_SAMPLE_RATE;
+  return (double)TIMER_SAMPLE_CLOCK/period;
+}
+
+/**
+ * @brief set output frequency.
+ * @return the real frequency after tuning word is quantized.
+*/
+double dds_set_freq(double freq){
+  double fs = dds_sample_rate();
+  if(freq < 0) freq = 0;
+  if(freq > fs/2) freq = fs/2;
+  dds_tuning = (uint32_t)(freq*4294967296.0/fs + 0.5);
+  return dds_tuning*fs/4294967296.0;
+}
+
+/**
+ * @brief set peak amplitude in V.
+ * @return the real amplitude after quantized to code.
+*/
+double dds_set_amplitude(double volt){
+  double vref = ad5791_get_vref();
+  if(volt < 0) volt = 0;
+  if(volt > vref) volt = vref;
+  dds_amp = (uint32_t)(volt/vref*0xfffff + 0.5);
+  return dds_amp*vref/0xfffff;
+}
+
+/**
+ * @brief set offset(center) voltage in V.
+ * @return the real offset after quantized to code.
+*/
+double dds_set_offset(double volt){
+  double vref = ad5791_get_vref();
+  if(volt < 0) volt = 0;
+  if(volt > vref) volt = vref;
+  dds_offset = (int32_t)(volt/vref*0xfffff + 0.5);
+  return dds_offset*vref/0xfffff;
+}
+
+void dds_set_shape(dds_shape_def shape){
+  dds_shape = shape;
+}
+
+/**
+ * @brief start DDS, phase starts from 0.
+ * @return 0 if ok.
+*/
+int32_t dds_start(void){
+  double freq = dds_tuning*dds_sample_rate()/4294967296.0;
+  dds_phase = 0;
+  dds_period = timer_sample_start(DDS_SAMPLE_RATE, dds_sample);
+  if(dds_period == 0) return -1;
+  dds_set_freq(freq); //keep frequency if sample period is not what we assumed.
+  return 0;
+}
+
+void dds_stop(void){
+  if(dds_is_running())
+    timer_sample_stop();
+}
+
+int32_t dds_is_running(void){
+  return timer_sample_owner() == dds_sample;
+}
+
+static void dds_print(void){
+  const char *shape_name[] = {"sine", "tri", "square"};
+  double vref = ad5791_get_vref();
+  USH_Print("shape: %s, %s\n", shape_name[dds_shape], dds_is_running()?"running":"stopped");
+  USH_Print("freq: %fHz, tuning word 0x%08x @ %fHz\n", dds_tuning*dds_sample_rate()/4294967296.0,
+            dds_tuning, dds_sample_rate());
+  USH_Print("amplitude: %fV(0x%05x), offset: %fV(0x%05x)\n", dds_amp*vref/0xfffff, dds_amp,
+            dds_offset*vref/0xfffff, dds_offset);
+}
+
+/**
+ * @brief ddsset sine|tri|square freq amplitude offset
+*/
+static int32_t ush_dds_set(uint32_t argc, char **argv){
+  float freq, amp, offset;
+  dds_shape_def shape;
+  if(argc < 5){
+    USH_Print("usage: ddsset sine|tri|square freq amplitude offset\n");
+    return -1;
+  }
+  if(strcmp(argv[1], "sine") == 0) shape = dds_shape_sine;
+  else if(strcmp(argv[1], "tri") == 0) shape = dds_shape_triangle;
+  else if(strcmp(argv[1], "square") == 0) shape = dds_shape_square;
+  else{
+    USH_Print("shape should be sine, tri or square\n");
+    return -1;
+  }
+  if(cmdarg_float(argv[2], &freq) != 0 || cmdarg_float(argv[3], &amp) != 0 ||
+     cmdarg_float(argv[4], &offset) != 0){
+    USH_Print("input string is not illegal\n");
+    return -1;
+  }
+  dds_set_shape(shape);
+  dds_set_freq(freq);
+  dds_set_amplitude(amp);
+  dds_set_offset(offset);
+  dds_print();
+  return 0;
+}
+USH_REGISTER(ush_dds_set, ddsset, Set DDS: ddsset sine|tri|square freq amplitude offset);
+
+static int32_t ush_dds_start(uint32_t argc, char **argv){
+  if(dds_start() != 0){
+    USH_Print("failed to start sample clock\n");
+    return -1;
+  }
+  dds_print();
+  return 0;
+}
+USH_REGISTER(ush_dds_start, ddsstart, Start DDS output);
+
+static int32_t ush_dds_stop(uint32_t argc, char **argv){
+  dds_stop();
+  return 0;
+}
+USH_REGISTER(ush_dds_stop, ddsstop, Stop DDS output);
+
+static int32_t ush_dds_stat(uint32_t argc, char **argv){
+  uint32_t late, missed;
+  dds_print();
+  if(dds_is_running()){
+    timer_sample_stat(&late, &missed);
+    USH_Print("late: %u, missed: %u\n", late, missed);
+  }
+  return 0;
+}
+USH_REGISTER(ush_dds_stat, ddsstat, Show DDS settings);
+#endif
@@ -0,0 +1,30 @@
+/**
+ * @author Neo Xu (neo.xu1990@gmail.com)
+ * @license The MIT License (MIT)
+ * 
+ * Copyright (c) 2019 Neo Xu
+ * 
+ * @brief direct digital synthesis of sine/triangle/square wave.
+*/
+#ifndef _DDS_H_
+#define _DDS_H_
+#include "stdint.h"
+#include "voltref_conf.h"
+
+#define DDS_SAMPLE_RATE 20000   //Hz, sample clock used by DDS.
+
+typedef enum{
+  dds_shape_sine = 0,
+  dds_shape_triangle,
+  dds_shape_square,
+}dds_shape_def;
+
+double dds_set_freq(double freq);
+double dds_set_amplitude(double volt);
+double dds_set_offset(double volt);
+void dds_set_shape(dds_shape_def shape);
+int32_t dds_start(void);
+void dds_stop(void);
+int32_t dds_is_running(void);
+
+#endif
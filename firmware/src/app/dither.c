@@ -0,0 +1,163 @@
+/**
+ * @author Neo Xu (neo.xu1990@gmail.com)
+ * @license The MIT License (MIT)
+ * 
+ * Copyright (c) 2019 Neo Xu
+ * 
+ * @brief sub-LSB output by dithering between two adjacent codes.
+ * Setpoint is turned into code N plus a 16bit fraction, a first order
+ * sigma-delta modulator on sample clock outputs N+1 with duty cycle equal to
+ * the fraction. Quantization noise is pushed up to around the sample rate, an
+ * output filter well below it leaves the average.
+*/
+#include "dither.h"
+#include "ad5791.h"
+#include "timer.h"
+#include "cmdarg.h"
+#include "string.h"
+#include "printf.h"
+#include "ush.h"
+
+#if VOLTREF_USE_DITHER
+#define DITHER_ONE  (1U<<DITHER_FRAC_BITS)
+
+static volatile uint32_t dither_code = 0;     //code N.
+static volatile uint32_t dither_frac = 0;     //fraction to add, 0 to DITHER_ONE-1.
+static uint32_t dither_acc = 0;               //modulator integrator.
+static uint32_t dither_last = 0xffffffff;     //code on DAC, frame is only sent on change.
+static volatile uint32_t dither_samples = 0;
+static volatile uint32_t dither_toggles = 0;  //frames sent.
+static uint64_t dither_nv = 0;                //setpoint.
+static uint32_t dither_period = 0;            //sample period in sample clocks.
+
+/**
+ * @brief one modulator step, called from sample clock interrupt.
+ * The carry out of the fraction accumulator is the 1bit output.
+ * @return none.
+*/
+static void dither_sample(void){
+  uint32_t acc = dither_acc + dither_frac;
+  uint32_t code = dither_code + (acc>>DITHER_FRAC_BITS);
+  dither_acc = acc&(DITHER_ONE-1);
+  if(code != dither_last){
+    ad5791_write_data(code);
+    dither_last = code;
+    dither_toggles++;
+  }
+  dither_samples++;
+}
+
+/**
+ * @brief set output of channel 0 in nV. It's written at once as the nearest
+ * lower code, and the fraction takes effect when dither runs.
+ * @return the code with 16bit fraction that dither averages to.
+*/
+uint64_t dither_set_nv(uint64_t nv){
+  ad5791_dev_def *dev = ad5791_get_dev(0);
+  uint64_t c16 = ad5791_dev_nv2code_q16(dev, nv);
+  uint32_t code = (uint32_t)(c16>>16), frac = (uint32_t)c16&0xffff;
+  uint32_t primask;
+  if(code == 0xfffff) frac = 0;  //nothing above full scale
+  primask = __get_PRIMASK();
+  __disable_irq();
+  dither_code = code;
+  dither_frac = frac;
+  dither_nv = nv;
+  __set_PRIMASK(primask);
+  if(!dither_is_running()){
+    ad5791_write_data(code);
+    dither_last = code;
+  }
+  return ((uint64_t)code<<16)|frac;
+}
+
+/**
+ * @brief start modulator on sample clock.
+ * @return the real sample period in sample clocks, 0 if rate is not supported.
+*/
+uint32_t dither_start(uint32_t rate_hz){
+  dither_acc = 0;
+  dither_samples = 0;
+  dither_toggles = 0;
+  dither_last = 0xffffffff;
+  dither_period = timer_sample_start(rate_hz, dither_sample);
+  return dither_period;
+}
+
+/**
+ * @brief stop modulator, output stays at code N.
+ * @return none.
+*/
+void dither_stop(void){
+  if(!dither_is_running()) return;
+  timer_sample_stop();
+  ad5791_write_data(dither_code);
+}
+
+int32_t dither_is_running(void){
+  return timer_sample_owner() == dither_sample;
+}
+
+/**
+ * @brief print a nV value as V with all 9 digits.
+ * @return none.
+*/
+static void dither_print_nv(const char *name, uint64_t nv){
+  USH_Print("%s%u.%09uV\n", name, (uint32_t)(nv/1000000000), (uint32_t)(nv%1000000000));
+}
+
+static void dither_print(void){
+  ad5791_dev_def *dev = ad5791_get_dev(0);
+  uint32_t lsb_pv = (uint32_t)((dev->lsb_q29*1000)>>29);
+  uint32_t samples = dither_samples, toggles = dither_toggles;
+  USH_Print("%s\n", dither_is_running() ? "running" : "stopped");
+  dither_print_nv("setpoint: ", dither_nv);
+  USH_Print("code: 0x%05x + %u/%u\n", dither_code, dither_frac, DITHER_ONE);
+  USH_Print("resolution: %d bits, %upV per step(LSB %unV)\n", 20 + DITHER_FRAC_BITS,
+            lsb_pv/DITHER_ONE, lsb_pv/1000);
+  if(dither_period){
+    float rate = (float)TIMER_SAMPLE_CLOCK/dither_period;
+    USH_Print("sample rate: %fHz\n", rate);
+    if(samples)
+      USH_Print("toggle rate: %fHz\n", rate*toggles/samples);
+  }
+}
+
+/**
+ * @brief dither volt [rate]
+*/
+static int32_t ush_dither(uint32_t argc, char **argv){
+  uint64_t nv;
+  uint32_t rate = DITHER_RATE;
+  if(argc < 2 || cmdarg_volt_nv(argv[1], &nv) != 0 ||
+     (argc >= 3 && cmdarg_uint(argv[2], &rate) != 0)){
+    USH_Print("usage: dither volt [rate]\n");
+    return -1;
+  }
+  dither_set_nv(nv);
+  if(!dither_is_running() && dither_start(rate) == 0){
+    USH_Print("rate should be 1 to %dHz\n", TIMER_SAMPLE_RATE_MAX);
+    return -1;
+  }
+  dither_print();
+  return 0;
+}
+USH_REGISTER(ush_dither, dither, Dither output below 1 LSB: dither volt [rate]);
+
+static int32_t ush_dither_stop(uint32_t argc, char **argv){
+  dither_stop();
+  return 0;
+}
+USH_REGISTER(ush_dither_stop, dithoff, Stop dither);
+
+static int32_t ush_dither_stat(uint32_t argc, char **argv){
+  uint32_t late, missed;
+  dither_print();
+  if(dither_is_running()){
+    timer_sample_stat(&late, &missed);
+    USH_Print("late: %u, missed: %u\n", late, missed);
+  }
+  return 0;
+}
+USH_REGISTER(ush_dither_stat, dithstat, Show dither resolution and toggle rate);
+#endif
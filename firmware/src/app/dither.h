@@ -0,0 +1,22 @@
+/**
+ * @author Neo Xu (neo.xu1990@gmail.com)
+ * @license The MIT License (MIT)
+ * 
+ * Copyright (c) 2019 Neo Xu
+ * 
+ * @brief sub-LSB output by dithering between two adjacent codes.
+*/
+#ifndef _DITHER_H_
+#define _DITHER_H_
+#include "stdint.h"
+#include "voltref_conf.h"
+
+#define DITHER_RATE       50000 //Hz, default modulator rate.
+#define DITHER_FRAC_BITS  16    //resolution of duty cycle below 1 LSB, matches Q16 code.
+
+uint64_t dither_set_nv(uint64_t nv);
+uint32_t dither_start(uint32_t rate_hz);
+void dither_stop(void);
+int32_t dither_is_running(void);
+
+#endif
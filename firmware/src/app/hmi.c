@@ -420,8 +420,9 @@ static void menu_navigate(int8_t encoder, uint8_t key){
     //parameter could have changed, save it.
     if(menu_level == MENU_LEVEL_SHOW_VALUE || menu_level == MENU_LEVEL_ADJ_VALUE){
       struct _parameter parameter;
+      parameter_load(&parameter);   //keep host link settings.
       parameter.signature = VALID_SIGNATURE;
-      parameter.hw_info = HW_INFO(disp_contrast, hw_version, sw_version);
+      parameter.hw_info = HW_INFO(disp_contrast, hw_version, sw_version)|(parameter.hw_info&0xff);
       parameter.power_up_count = power_up_count;
       parameter.refer_voltage = volt_vref-10; //store the voltage error.
       parameter_save(&parameter);
@@ -0,0 +1,96 @@
+/**
+ * @author Neo Xu (neo.xu1990@gmail.com)
+ * @license The MIT License (MIT)
+ * 
+ * Copyright (c) 2019 Neo Xu
+ * 
+ * @brief preload-then-latch mode for sample engines.
+ * Codes written from sample clock interrupt are only preloaded, the output
+ * changes on the next sample clock update event:
+ * soft:  the interrupt(top priority) sends a software LDAC frame first.
+ * timer: DMA pulls LDAC low right on the update event, interrupt puts it back.
+ * LDAC is only held while an engine owns sample clock, it's released when the
+ * engine stops so setpoints from shell, HMI and remote reach output again.
+*/
+#include "voltref_conf.h"
+#include "ad5791.h"
+#include "timer.h"
+#include "string.h"
+#include "printf.h"
+#include "ush.h"
+
+#if VOLTREF_USE_LATCH
+typedef enum{
+  latch_mode_off = 0,
+  latch_mode_soft,
+  latch_mode_timer,
+}latch_mode_def;
+
+static latch_mode_def latch_mode = latch_mode_off;
+
+/**
+ * @brief called by sample clock when it starts and stops. Releasing LDAC
+ * also outputs the last preloaded code.
+ * @return none.
+*/
+static void latch_hold(uint32_t hold){
+  ad5791_ldac_hold(hold);
+}
+
+/**
+ * @brief latch off|soft|timer
+*/
+static int32_t ush_latch(uint32_t argc, char **argv){
+  latch_mode_def mode;
+  if(argc < 2) return 0;
+  if(strcmp(argv[1], "off") == 0) mode = latch_mode_off;
+  else if(strcmp(argv[1], "soft") == 0) mode = latch_mode_soft;
+  else if(strcmp(argv[1], "timer") == 0) mode = latch_mode_timer;
+  else{
+    USH_Print("mode should be off, soft or timer\n");
+    return -1;
+  }
+  if(ad5791_ldac_hold(mode != latch_mode_off && timer_sample_owner() != 0) != 0){
+    USH_Print("LDAC is tied low on this board, build with AD5791_USE_LDAC\n");
+    return -1;
+  }
+  ad5791_ldac_dma(mode == latch_mode_timer);
+  if(mode == latch_mode_soft)
+    timer_sample_set_latch(ad5791_latch, latch_hold, 0);
+  else if(mode == latch_mode_timer)
+    timer_sample_set_latch(ad5791_ldac_rearm, latch_hold, 1);
+  else
+    timer_sample_set_latch(0, 0, 0);
+  latch_mode = mode;
+  if(mode != latch_mode_off)
+    USH_Print("output of sample engines now only changes on sample clock\n");
+  return 0;
+}
+USH_REGISTER(ush_latch, latch, Latch samples on sample clock: latch off|soft|timer);
+
+/**
+ * @brief report how much latch time moves from sample to sample.
+*/
+static int32_t ush_latch_stat(uint32_t argc, char **argv){
+  const char *mode_name[] = {"off", "soft", "timer"};
+  uint32_t min, max, clocks;
+  USH_Print("latch mode: %s\n", mode_name[latch_mode]);
+  if(latch_mode == latch_mode_off) return 0;
+  clocks = timer_sample_latch_stat(&min, &max);
+  if(clocks == 0){
+    USH_Print("no sample latched yet\n");
+    return 0;
+  }
+  /* timer clock is 64MHz, 15.625ns */
+  if(latch_mode == latch_mode_soft){
+    USH_Print("update event to latch: %u~%uns\n", min*clocks*125/8, max*clocks*125/8);
+    USH_Print("latch jitter: %uns\n", (max-min+1)*clocks*125/8);
+  }
+  else{
+    USH_Print("latched by DMA on update event, jitter: %uns\n", clocks*125/8);
+    USH_Print("LDAC low time: %u~%uns\n", min*clocks*125/8, max*clocks*125/8);
+  }
+  return 0;
+}
+USH_REGISTER(ush_latch_stat, latchstat, Show measured latch jitter);
+#endif
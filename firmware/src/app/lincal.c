@@ -0,0 +1,191 @@
+/**
+ * @author Neo Xu (neo.xu1990@gmail.com)
+ * @license The MIT License (MIT)
+ * 
+ * Copyright (c) 2019 Neo Xu
+ * 
+ * @brief AD5791 linearity(INL) correction table stored in flash.
+ * Error is measured at AD5791_INL_POINTS codes equally spaced(0, 0x8000 ...
+ * 0xf8000, full scale), then driver interpolates between them.
+*/
+#include "lincal.h"
+#include "ad5791.h"
+#include "cmdarg.h"
+#include "stm32f0xx_flash.h"
+#include "string.h"
+#include "printf.h"
+#include "ush.h"
+
+#define LOG_TAG              "lincal"
+#define LOG_LVL              LOG_LVL_INFO
+#include <ulog.h>
+
+#if VOLTREF_USE_LINCAL
+#define LINCAL_PAGE_ADDR  0x08007800  //the page before parameter page, IROM ends here.
+#define LINCAL_SIGNATURE  0x4c494e31  //"LIN1"
+
+struct _lincal{
+  uint32_t signature;
+  int16_t err[AD5791_DEV_NUM][AD5791_INL_POINTS]; //error in 1/256 LSB
+};
+
+/**
+ * Working copy, driver reads it directly.
+*/
+static struct _lincal lincal;
+
+/**
+ * @brief hand table of channel to driver, or turn correction off if it's all zero.
+ * @return none.
+*/
+static void lincal_apply(uint32_t ch){
+  ad5791_dev_def *dev = ad5791_get_dev(ch);
+  const int16_t *table = 0;
+  for(uint32_t i=0; i<AD5791_INL_POINTS; i++){
+    if(lincal.err[ch][i] != 0){
+      table = lincal.err[ch];
+      break;
+    }
+  }
+  ad5791_dev_set_inl(dev, table);
+}
+
+/**
+ * @brief load table from flash, must be called after ad5791_init.
+ * @return none.
+*/
+void lincal_init(void){
+  const struct _lincal *pflash = (const struct _lincal *)LINCAL_PAGE_ADDR;
+  if(pflash->signature == LINCAL_SIGNATURE){
+    memcpy(&lincal, pflash, sizeof(lincal));
+    LOG_I("linearity table loaded");
+  }
+  else
+    memset(&lincal, 0, sizeof(lincal));
+  for(uint32_t ch=0; ch<AD5791_DEV_NUM; ch++)
+    lincal_apply(ch);
+}
+
+/**
+ * @brief set error of one breakpoint, it takes effect on next setpoint.
+ * @return 0 if ok, -1 if channel or index is wrong.
+*/
+int32_t lincal_set_point(uint32_t ch, uint32_t index, int32_t err_q8){
+  if(ch >= AD5791_DEV_NUM || index >= AD5791_INL_POINTS)
+    return -1;
+  if(err_q8 > 32767) err_q8 = 32767;
+  if(err_q8 < -32768) err_q8 = -32768;
+  lincal.err[ch][index] = (int16_t)err_q8;
+  lincal_apply(ch);
+  return 0;
+}
+
+/**
+ * @brief clear table of one channel, no correction is applied.
+ * @return none.
+*/
+void lincal_clear(uint32_t ch){
+  if(ch >= AD5791_DEV_NUM) return;
+  memset(lincal.err[ch], 0, sizeof(lincal.err[ch]));
+  lincal_apply(ch);
+}
+
+/**
+ * @brief write table to flash. It's seldom saved, so page is simply erased
+ * every time.
+ * @return none.
+*/
+void lincal_save(void){
+  uint32_t *psrc = (uint32_t*)&lincal, dst = LINCAL_PAGE_ADDR;
+  lincal.signature = LINCAL_SIGNATURE;
+  FLASH_Unlock();
+  FLASH_ErasePage(LINCAL_PAGE_ADDR);
+  for(uint32_t i=0; i<(sizeof(lincal)+3)/4; i++){
+    FLASH_ProgramWord(dst, *psrc++);
+    dst += 4;
+  }
+  FLASH_Lock();
+  LOG_I("linearity table saved");
+}
+
+/**
+ * @brief nV per 1/256 LSB is vref/0xfffff/256.
+ * @return error in 1/256 LSB.
+*/
+static int32_t lincal_uv2q8(const ad5791_dev_def *dev, float uv){
+  float q8 = uv*1000.0f*256*0xfffff/dev->vref_nv;
+  return (int32_t)(q8 < 0 ? q8 - 0.5f : q8 + 0.5f);
+}
+
+/**
+ * @brief get channel from optional argument.
+ * @return channel, or -1 if it's wrong.
+*/
+static int32_t lincal_arg_ch(uint32_t argc, char **argv, uint32_t index){
+  uint32_t ch = 0;
+  if(argc > index && (cmdarg_uint(argv[index], &ch) != 0 || ch >= AD5791_DEV_NUM)){
+    USH_Print("channel should be 0 to %d\n", AD5791_DEV_NUM-1);
+    return -1;
+  }
+  return ch;
+}
+
+/**
+ * @brief set measured error at a breakpoint.
+*/
+static int32_t ush_inl_set(uint32_t argc, char **argv){
+  uint32_t index;
+  float uv;
+  int32_t ch;
+  if(argc < 3 || cmdarg_uint(argv[1], &index) != 0 || cmdarg_float(argv[2], &uv) != 0 ||
+     index >= AD5791_INL_POINTS){
+    USH_Print("usage: inlset index(0 to %d) error_uV [channel]\n", AD5791_INL_POINTS-1);
+    return -1;
+  }
+  ch = lincal_arg_ch(argc, argv, 3);
+  if(ch < 0) return -1;
+  lincal_set_point(ch, index, lincal_uv2q8(ad5791_get_dev(ch), uv));
+  return 0;
+}
+USH_REGISTER(ush_inl_set, inlset, Set INL error in uV at breakpoint: inlset index error_uV [channel]);
+
+/**
+ * @brief print the table of a channel.
+*/
+static int32_t ush_inl_show(uint32_t argc, char **argv){
+  ad5791_dev_def *dev;
+  int32_t ch = lincal_arg_ch(argc, argv, 1);
+  if(ch < 0) return -1;
+  dev = ad5791_get_dev(ch);
+  USH_Print("DAC%d correction %s\n", ch, dev->inl ? "on" : "off");
+  for(uint32_t i=0; i<AD5791_INL_POINTS; i++){
+    int32_t q8 = lincal.err[ch][i];
+    USH_Print("%2d code 0x%05x: %d/256 LSB, %fuV\n", i,
+              i == AD5791_INL_POINTS-1 ? 0xfffff : i<<AD5791_INL_SHIFT,
+              q8, q8*(dev->vref_nv*1e-3f/0xfffff/256));
+  }
+  return 0;
+}
+USH_REGISTER(ush_inl_show, inlshow, Show INL correction table: inlshow [channel]);
+
+/**
+ * @brief clear table of a channel.
+*/
+static int32_t ush_inl_clear(uint32_t argc, char **argv){
+  int32_t ch = lincal_arg_ch(argc, argv, 1);
+  if(ch < 0) return -1;
+  lincal_clear(ch);
+  return 0;
+}
+USH_REGISTER(ush_inl_clear, inlclear, Clear INL correction table: inlclear [channel]);
+
+/**
+ * @brief save tables to flash.
+*/
+static int32_t ush_inl_save(uint32_t argc, char **argv){
+  lincal_save();
+  USH_Print("saved\n");
+  return 0;
+}
+USH_REGISTER(ush_inl_save, inlsave, Save INL correction tables to flash);
+#endif
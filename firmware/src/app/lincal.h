@@ -0,0 +1,19 @@
+/**
+ * @author Neo Xu (neo.xu1990@gmail.com)
+ * @license The MIT License (MIT)
+ * 
+ * Copyright (c) 2019 Neo Xu
+ * 
+ * @brief AD5791 linearity(INL) correction table stored in flash.
+*/
+#ifndef _LINCAL_H_
+#define _LINCAL_H_
+#include "stdint.h"
+#include "voltref_conf.h"
+
+void lincal_init(void);
+int32_t lincal_set_point(uint32_t ch, uint32_t index, int32_t err_q8);
+void lincal_clear(uint32_t ch);
+void lincal_save(void);
+
+#endif
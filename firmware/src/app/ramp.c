@@ -0,0 +1,197 @@
+/**
+ * @author Neo Xu (neo.xu1990@gmail.com)
+ * @license The MIT License (MIT)
+ * 
+ * Copyright (c) 2019 Neo Xu
+ * 
+ * @brief slew-rate limited ramp between setpoints.
+ * Channel 0 is moved from current code to target by intermediate writes on
+ * sample clock, so caller returns at once. A Q32 phase runs from 0 to 1 and
+ * profile maps it to the fraction of the step.
+*/
+#include "ramp.h"
+#include "ad5791.h"
+#include "timer.h"
+#include "cmdarg.h"
+#include "string.h"
+#include "printf.h"
+#include "ush.h"
+
+#if VOLTREF_USE_RAMP
+static uint32_t ramp_slew = 0;                //uV/s, 0: step at once.
+static ramp_profile_def ramp_profile = ramp_profile_linear;
+static uint32_t ramp_start_code;
+static int32_t ramp_delta;                    //target - start, in code.
+static uint32_t ramp_target;
+static volatile uint32_t ramp_phase;          //Q32 progress.
+static uint32_t ramp_inc;                     //phase step per sample.
+static volatile uint8_t ramp_done = 0;        //target reached, cleared by poll.
+static uint32_t ramp_last;                    //code on DAC.
+
+/**
+ * @brief profile in Q16, t is Q16 in [0, 1).
+ * S-curve is 3t^2-2t^3, arranged so it fits in 32bit.
+*/
+static uint32_t ramp_shape(uint32_t t){
+  uint32_t t2;
+  if(ramp_profile == ramp_profile_linear)
+    return t;
+  t2 = (t*t)>>16;
+  return (t2*(((3<<16) - 2*t)>>2))>>14;
+}
+
+/**
+ * @brief one ramp step, called from sample clock interrupt.
+ * @return none.
+*/
+static void ramp_sample(void){
+  uint32_t phase = ramp_phase + ramp_inc;
+  uint32_t code;
+  if(phase < ramp_phase){ //wrapped, ramp is over.
+    ad5791_write_data(ramp_target);
+    timer_sample_stop();
+    ramp_done = 1;
+    return;
+  }
+  ramp_phase = phase;
+  code = ramp_start_code + (int32_t)(((int64_t)ramp_delta*ramp_shape(phase>>16))>>16);
+  if(code != ramp_last){
+    ad5791_write_data(code);
+    ramp_last = code;
+  }
+}
+
+/**
+ * @brief set slew rate and profile used by next ramp.
+ * @param uv_per_s: limit of output slope, 0 to step at once.
+ * @return none.
+*/
+void ramp_set_slew(uint32_t uv_per_s, ramp_profile_def profile){
+  ramp_slew = uv_per_s;
+  ramp_profile = profile;
+}
+
+/**
+ * @brief move channel 0 to code. Ramp starts from where output is now, so a
+ * new target during a ramp just bends it. Output steps at once if slew isn't
+ * limited or another engine owns sample clock.
+ * @return none.
+*/
+void ramp_to_code(uint32_t target){
+  ad5791_dev_def *dev = ad5791_get_dev(0);
+  uint64_t dnv, nv, steps;
+  uint32_t primask;
+  timer_sample_func owner = timer_sample_owner();
+  target &= 0xfffff;
+  if(ramp_slew == 0 || (owner != 0 && owner != ramp_sample)){
+    ad5791_dev_update(dev, target);
+    return;
+  }
+  primask = __get_PRIMASK();
+  __disable_irq();  /* it may be ramping now, take over from the code on DAC */
+  ramp_start_code = dev->code;
+  ramp_last = dev->code;
+  ramp_target = target;
+  ramp_delta = (int32_t)target - (int32_t)ramp_start_code;
+  nv = ad5791_dev_code2nv(dev, target);
+  dnv = ad5791_dev_code2nv(dev, ramp_start_code);
+  dnv = dnv > nv ? dnv - nv : nv - dnv;
+  /* samples = dV/slew*rate, S-curve peaks at 1.5x average slope. */
+  steps = dnv*RAMP_RATE/1000/ramp_slew;
+  if(ramp_profile == ramp_profile_scurve)
+    steps = steps*3/2;
+  if(steps == 0) steps = 1;
+  ramp_inc = steps >= (1ull<<32) ? 1 : (uint32_t)((1ull<<32)/steps);
+  if(ramp_inc == 0) ramp_inc = 0xffffffff;
+  ramp_phase = 0;
+  ramp_done = 0;
+  __set_PRIMASK(primask);
+  if(ramp_delta == 0){
+    ramp_stop();
+    ramp_done = 1;
+  }
+  else if(owner == 0 && timer_sample_start(RAMP_RATE, ramp_sample) == 0){
+    ad5791_write_data(target);
+    ramp_done = 1;
+  }
+}
+
+/**
+ * @brief move channel 0 to nv, see ramp_to_code.
+ * @return the real output in nV when target is reached.
+*/
+uint64_t ramp_to_nv(uint64_t nv){
+  ad5791_dev_def *dev = ad5791_get_dev(0);
+  uint32_t target = ad5791_dev_nv2code(dev, nv);
+  ramp_to_code(target);
+  return ad5791_dev_code2nv(dev, target);
+}
+
+/**
+ * @brief stop where output is now.
+ * @return none.
+*/
+void ramp_stop(void){
+  if(ramp_is_running())
+    timer_sample_stop();
+}
+
+int32_t ramp_is_running(void){
+  return timer_sample_owner() == ramp_sample;
+}
+
+/**
+ * @brief check if target is reached since last call, call it from main loop.
+ * @return 1 once when target is reached, else 0.
+*/
+int32_t ramp_poll(void){
+  if(ramp_done == 0) return 0;
+  ramp_done = 0;
+  return 1;
+}
+
+/**
+ * @brief ramp V/s [lin|s], or ramp off
+*/
+static int32_t ush_ramp(uint32_t argc, char **argv){
+  float slew;
+  ramp_profile_def profile = ramp_profile_linear;
+  if(argc < 2){
+    USH_Print("usage: ramp V/s [lin|s], ramp off\n");
+    return -1;
+  }
+  if(strcmp(argv[1], "off") == 0){
+    ramp_stop();
+    ramp_set_slew(0, ramp_profile);
+    return 0;
+  }
+  if(cmdarg_float(argv[1], &slew) != 0 || slew < 1e-6f || slew > 4000.0f){
+    USH_Print("slew should be 0.000001 to 4000V/s\n");
+    return -1;
+  }
+  if(argc >= 3){
+    if(strcmp(argv[2], "lin") == 0) profile = ramp_profile_linear;
+    else if(strcmp(argv[2], "s") == 0) profile = ramp_profile_scurve;
+    else{
+      USH_Print("profile should be lin or s\n");
+      return -1;
+    }
+  }
+  ramp_set_slew((uint32_t)(slew*1e6f + 0.5f), profile);
+  return 0;
+}
+USH_REGISTER(ush_ramp, ramp, Limit setpoint slew rate: ramp V/s [lin|s] or ramp off);
+
+static int32_t ush_ramp_stat(uint32_t argc, char **argv){
+  USH_Print("slew: ");
+  if(ramp_slew)
+    USH_Print("%uuV/s, %s\n", ramp_slew, ramp_profile == ramp_profile_linear ? "linear" : "s-curve");
+  else
+    USH_Print("off\n");
+  if(ramp_is_running())
+    USH_Print("ramping 0x%05x -> 0x%05x, %u%%\n", ramp_start_code, ramp_target,
+              (uint32_t)(((uint64_t)ramp_phase*100)>>32));
+  return 0;
+}
+USH_REGISTER(ush_ramp_stat, rampstat, Show ramp settings and progress);
+#endif
@@ -0,0 +1,28 @@
+/**
+ * @author Neo Xu (neo.xu1990@gmail.com)
+ * @license The MIT License (MIT)
+ * 
+ * Copyright (c) 2019 Neo Xu
+ * 
+ * @brief slew-rate limited ramp between setpoints.
+*/
+#ifndef _RAMP_H_
+#define _RAMP_H_
+#include "stdint.h"
+#include "voltref_conf.h"
+
+#define RAMP_RATE 10000   //Hz, intermediate codes are written at this rate.
+
+typedef enum{
+  ramp_profile_linear = 0,  /**< constant slew rate. */
+  ramp_profile_scurve,      /**< smoothstep, slope peaks at the given rate in the middle. */
+}ramp_profile_def;
+
+void ramp_set_slew(uint32_t uv_per_s, ramp_profile_def profile);
+void ramp_to_code(uint32_t target);
+uint64_t ramp_to_nv(uint64_t nv);
+void ramp_stop(void);
+int32_t ramp_is_running(void);
+int32_t ramp_poll(void);
+
+#endif
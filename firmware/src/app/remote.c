@@ -0,0 +1,409 @@
+/**
+ * @author Neo Xu (neo.xu1990@gmail.com)
+ * @license The MIT License (MIT)
+ * 
+ * Copyright (c) 2019 Neo Xu
+ * 
+ * @brief binary command protocol on UART1, shares the port with shell.
+ * Bytes from 0x7d(sframe start) to the end of frame go to frame decoder, the
+ * rest go to shell. No float math or printf on this path.
+ * Decoded commands are queued, remote_poll runs them in order. A set waits
+ * for driver's frame done callback before it's replied, with the time of it,
+ * a channel 0 set waits for its ramp to reach target.
+*/
+#include "remote.h"
+#include "serial_frame.h"
+#include "ad5791.h"
+#include "adt7420.h"
+#include "timer.h"
+#include "ramp.h"
+#include "stream.h"
+#include "wavepack.h"
+#include "uart.h"
+#include "string.h"
+
+#if VOLTREF_USE_REMOTE
+typedef struct{
+  uint8_t op;
+  uint8_t ch;
+  uint16_t seq;
+  uint32_t code;    //code to set, converted from nV when queued.
+}remote_cmd_def;
+
+static sframe_def remote_frame;
+static uint8_t frame_buff[REMOTE_FRAME_MAX];
+static remote_cmd_def queue[REMOTE_QUEUE_SIZE];
+static uint32_t queue_rd = 0, queue_wr = 0;   //free running, index is masked.
+static volatile uint8_t latch_wait = 0;       //a set frame is on the way.
+static volatile uint8_t latch_done = 0;
+static volatile uint32_t latch_ms;            //time when frame was out.
+static uint8_t ramp_wait = 0;                 //a channel 0 set is ramping.
+#if VOLTREF_USE_STREAM
+static uint16_t stream_seq = 0;               //seq of last stream data.
+#endif
+
+void voltref_ramp_code(uint32_t code);
+
+/**
+ * CRC16-CCITT with 4bit table, 32 bytes of flash.
+*/
+static const uint16_t crc_table[16] = {
+  0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50a5, 0x60c6, 0x70e7,
+  0x8108, 0x9129, 0xa14a, 0xb16b, 0xc18c, 0xd1ad, 0xe1ce, 0xf1ef,
+};
+
+uint16_t remote_crc16(const uint8_t *pdata, uint32_t len){
+  uint16_t crc = 0xffff;
+  while(len--){
+    crc = (crc<<4) ^ crc_table[(crc>>12) ^ (*pdata>>4)];
+    crc = (crc<<4) ^ crc_table[(crc>>12) ^ (*pdata&0xf)];
+    pdata++;
+  }
+  return crc;
+}
+
+static uint32_t get_u32(const uint8_t *p){
+  return p[0]|(p[1]<<8)|(p[2]<<16)|((uint32_t)p[3]<<24);
+}
+
+static void put_u32(uint8_t *p, uint32_t v){
+  p[0] = v;
+  p[1] = v>>8;
+  p[2] = v>>16;
+  p[3] = v>>24;
+}
+
+/**
+ * @brief send reply frame, crc is appended here.
+ * @return none.
+*/
+static void remote_reply(const remote_cmd_def *cmd, remote_status_def status, uint32_t code,
+                         uint64_t value, uint32_t ms){
+  uint8_t reply[REMOTE_REPLY_LEN];
+  uint16_t crc;
+  reply[0] = cmd->op|REMOTE_OP_REPLY;
+  reply[1] = status;
+  reply[2] = cmd->seq;
+  reply[3] = cmd->seq>>8;
+  reply[4] = cmd->ch;
+  reply[5] = ad5791_safe_state();
+  put_u32(&reply[6], code);
+  put_u32(&reply[10], (uint32_t)value);
+  put_u32(&reply[14], (uint32_t)(value>>32));
+  put_u32(&reply[18], ms);
+  crc = remote_crc16(reply, REMOTE_REPLY_LEN-2);
+  reply[22] = crc;
+  reply[23] = crc>>8;
+  sframe_encode(uart_char, reply, REMOTE_REPLY_LEN);
+}
+
+static void remote_reply_error(const remote_cmd_def *cmd, remote_status_def status){
+  remote_reply(cmd, status, 0, 0, timer_ms_get());
+}
+
+/**
+ * @brief reply with the latest setpoint of a channel.
+ * @return none.
+*/
+static void remote_reply_state(const remote_cmd_def *cmd, remote_status_def status, uint32_t ms){
+  ad5791_dev_def *dev = ad5791_get_dev(cmd->ch);
+  uint32_t code = ad5791_dev_setpoint(dev);
+  remote_reply(cmd, status, code, ad5791_dev_code2nv(dev, code), ms);
+}
+
+/**
+ * @brief driver callback, a frame is out. The first one after a set is
+ * started is that set, frames go out in order.
+*/
+static void remote_frame_done(void){
+  if(latch_wait){
+    latch_wait = 0;
+    latch_ms = timer_ms_get();
+    latch_done = 1;
+  }
+}
+
+#if VOLTREF_USE_STREAM
+/**
+ * @brief codes for stream go to ring at once, they are not queued. Nothing
+ * is replied, overrun shows up in stream events.
+*/
+static void remote_stream_data(const remote_cmd_def *cmd, const uint8_t *pdata, uint32_t len){
+  if(len == 0 || len%3 != 0){
+    remote_reply_error(cmd, remote_err_len);
+    return;
+  }
+  stream_seq = cmd->seq;
+  for(; len; len -= 3, pdata += 3)
+    stream_push(pdata[0]|(pdata[1]<<8)|((uint32_t)pdata[2]<<16));
+}
+
+/**
+ * @brief start or stop stream at once, ring would fill before a queued start.
+ * Reply value is the real sample period in 64MHz clocks.
+*/
+static void remote_stream_ctrl(const remote_cmd_def *cmd, const uint8_t *pdata, uint32_t len){
+  uint32_t period = 0;
+  if(len != (cmd->op == REMOTE_OP_STREAM_START ? 4 : 0)){
+    remote_reply_error(cmd, remote_err_len);
+    return;
+  }
+  if(cmd->op == REMOTE_OP_STREAM_STOP)
+    stream_stop();
+  else{
+    period = stream_start(get_u32(pdata));
+    if(period == 0){
+      remote_reply_error(cmd, remote_err_arg);
+      return;
+    }
+  }
+  remote_reply(cmd, remote_ok, 0, period, timer_ms_get());
+}
+
+/**
+ * @brief tell host about stream watermarks.
+ * @return none.
+*/
+static void remote_stream_event(void){
+  stream_evt_def evt = stream_poll();
+  stream_stat_def stat;
+  remote_cmd_def cmd;
+  if(evt == stream_evt_none) return;
+  stream_get_stat(&stat);
+  cmd.op = REMOTE_OP_STREAM_EVENT;
+  cmd.seq = stream_seq;
+  cmd.ch = evt;
+  remote_reply(&cmd, remote_ok, stat.level, stat.underrun|((uint64_t)stat.overrun<<32), timer_ms_get());
+}
+#endif
+
+#if VOLTREF_USE_WAVEPACK
+/**
+ * @brief packed wave commands run at once, upload doesn't wait for queue.
+*/
+static void remote_wave(const remote_cmd_def *cmd, const uint8_t *pdata, uint32_t len){
+  uint32_t offset, period;
+  int32_t samples;
+  if(cmd->op == REMOTE_OP_WAVE_LOAD){
+    if(len < 3){
+      remote_reply_error(cmd, remote_err_len);
+      return;
+    }
+    offset = pdata[0]|(pdata[1]<<8);
+    switch(wavepack_load(offset, &pdata[2], len-2)){
+      case 0: remote_reply(cmd, remote_ok, offset+len-2, 0, timer_ms_get()); break;
+      case -1: remote_reply_error(cmd, remote_err_arg); break;
+      default: remote_reply_error(cmd, remote_err_busy); break;
+    }
+    return;
+  }
+  if(cmd->op == REMOTE_OP_WAVE_STOP){
+    if(len != 0){
+      remote_reply_error(cmd, remote_err_len);
+      return;
+    }
+    wavepack_stop();
+    remote_reply(cmd, remote_ok, 0, 0, timer_ms_get());
+    return;
+  }
+  if(len != 9){
+    remote_reply_error(cmd, remote_err_len);
+    return;
+  }
+  if(pdata[8] > 1){
+    remote_reply_error(cmd, remote_err_arg);
+    return;
+  }
+  samples = wavepack_verify(pdata[0]|(pdata[1]<<8), pdata[2]|(pdata[3]<<8));
+  if(samples < 0){
+    remote_reply_error(cmd, remote_err_image);
+    return;
+  }
+  period = wavepack_start(get_u32(&pdata[4]), pdata[8] ? wave_mode_loop : wave_mode_oneshot);
+  remote_reply(cmd, period ? remote_ok : remote_err_arg, period, samples, timer_ms_get());
+}
+#endif
+
+/**
+ * @brief a frame is decoded, check it and put it in queue.
+*/
+static void remote_process(uint8_t *pdata, uint32_t len){
+  static const uint8_t arg_len[] = {0, 1+4, 1+8, 1, 0}; //arguments of each opcode.
+  remote_cmd_def cmd;
+  ad5791_dev_def *dev = 0;
+  uint64_t nv;
+  memset(&cmd, 0, sizeof(cmd));
+  if(len >= 3){
+    cmd.op = pdata[0];
+    cmd.seq = pdata[1]|(pdata[2]<<8);
+  }
+  if(len < 5 || remote_crc16(pdata, len-2) != (pdata[len-2]|(pdata[len-1]<<8))){
+    remote_reply_error(&cmd, remote_err_crc);
+    return;
+  }
+  len -= 5;
+#if VOLTREF_USE_STREAM
+  if(cmd.op == REMOTE_OP_STREAM_DATA){
+    remote_stream_data(&cmd, &pdata[3], len);
+    return;
+  }
+  if(cmd.op == REMOTE_OP_STREAM_START || cmd.op == REMOTE_OP_STREAM_STOP){
+    remote_stream_ctrl(&cmd, &pdata[3], len);
+    return;
+  }
+#endif
+#if VOLTREF_USE_WAVEPACK
+  if(cmd.op >= REMOTE_OP_WAVE_LOAD && cmd.op <= REMOTE_OP_WAVE_STOP){
+    remote_wave(&cmd, &pdata[3], len);
+    return;
+  }
+#endif
+  if(cmd.op == 0 || cmd.op >= sizeof(arg_len)){
+    remote_reply_error(&cmd, remote_err_opcode);
+    return;
+  }
+  if(len != arg_len[cmd.op]){
+    remote_reply_error(&cmd, remote_err_len);
+    return;
+  }
+  if(len){
+    cmd.ch = pdata[3];
+    dev = ad5791_get_dev(cmd.ch);
+    if(dev == 0){
+      remote_reply_error(&cmd, remote_err_arg);
+      return;
+    }
+  }
+  if(cmd.op == REMOTE_OP_SET_CODE){
+    cmd.code = get_u32(&pdata[4]);
+    if(cmd.code > 0xfffff){
+      remote_reply_error(&cmd, remote_err_arg);
+      return;
+    }
+  }
+  else if(cmd.op == REMOTE_OP_SET_NV){
+    nv = get_u32(&pdata[4])|((uint64_t)get_u32(&pdata[8])<<32);
+    cmd.code = ad5791_dev_nv2code(dev, nv);
+  }
+  if(queue_wr - queue_rd >= REMOTE_QUEUE_SIZE){
+    remote_reply_error(&cmd, remote_err_full);
+    return;
+  }
+  queue[queue_wr%REMOTE_QUEUE_SIZE] = cmd;
+  queue_wr++;
+}
+
+void remote_init(void){
+  sframe_init(&remote_frame, frame_buff, REMOTE_FRAME_MAX, remote_process);
+  ad5791_set_callback(remote_frame_done);
+}
+
+/**
+ * @brief route one byte from UART1. A frame starts with 0x7d('}') and ends
+ * with 0x7c('|'), stray stop marks are dropped so neither reaches shell.
+ * @return 1 if byte is taken by protocol, 0 if it's for shell.
+*/
+int32_t remote_input(uint8_t ch){
+  if(remote_frame.state == sframe_state_start){
+    if(ch == SFRAME_STOP) return 1;
+    if(ch != SFRAME_START) return 0;
+  }
+  sframe_decode(&remote_frame, &ch, 1);
+  return 1;
+}
+
+/**
+ * @brief start a set. Channel 0 goes through ramp like a shell set, it's done
+ * when ramp is over and the last frame is out. Other channels are sent
+ * directly, not through write coalescing, so the done callback is the moment
+ * output changed.
+ * @return 0 if it's on the way, else status to reply at once.
+*/
+static remote_status_def remote_set(const remote_cmd_def *cmd){
+  ad5791_dev_def *dev = ad5791_get_dev(cmd->ch);
+  uint32_t primask;
+  if(cmd->ch == 0){
+#if VOLTREF_USE_RAMP
+    if(timer_sample_owner() != 0 && !ramp_is_running())
+      return remote_err_busy;
+#else
+    if(timer_sample_owner() != 0)
+      return remote_err_busy;
+#endif
+    voltref_ramp_code(cmd->code);
+    if(ad5791_safe_state() == ad5791_safe_clear)
+      return remote_err_safe;
+    ramp_wait = 1;
+    return remote_ok;
+  }
+  if(ad5791_safe_state() == ad5791_safe_clear){
+    ad5791_dev_write_data(dev, cmd->code);  //no frame, kept for restore.
+    return remote_err_safe;
+  }
+  primask = __get_PRIMASK();
+  __disable_irq();  /* no other frame between arming and this one */
+  ad5791_flush();   /* frame still on the bus would be taken as this one */
+  latch_done = 0;
+  latch_wait = 1;
+  ad5791_dev_write_data(dev, cmd->code);
+  __set_PRIMASK(primask);
+  return remote_ok;
+}
+
+/**
+ * @brief check if channel 0 set is done, ramp is over and no setpoint is
+ * waiting for min interval.
+ * @return 1 if done, the last frame is out then.
+*/
+static int32_t remote_ramp_done(void){
+#if VOLTREF_USE_RAMP
+  if(ramp_is_running())
+    return 0;
+#endif
+  if(ad5791_get_dev(0)->pending&AD5791_PENDING)
+    return 0;
+  ad5791_flush();
+#if VOLTREF_USE_RAMP
+  ramp_poll();  //told in reply, not on shell.
+#endif
+  return 1;
+}
+
+/**
+ * @brief run queued commands in order, called from main loop. A set blocks
+ * the queue until its frame is out.
+ * @return none.
+*/
+void remote_poll(void){
+  remote_cmd_def *cmd;
+  remote_status_def status;
+#if VOLTREF_USE_STREAM
+  remote_stream_event();
+#endif
+  while(queue_rd != queue_wr){
+    cmd = &queue[queue_rd%REMOTE_QUEUE_SIZE];
+    if(cmd->op == REMOTE_OP_SET_CODE || cmd->op == REMOTE_OP_SET_NV){
+      if(latch_wait) return;  //frame is still on the bus.
+      if(ramp_wait){
+        if(!remote_ramp_done()) return;
+        ramp_wait = 0;
+        remote_reply_state(cmd, ad5791_ldac_held() ? remote_preloaded : remote_ok, timer_ms_get());
+      }
+      else if(latch_done){
+        latch_done = 0;
+        remote_reply_state(cmd, ad5791_ldac_held() ? remote_preloaded : remote_ok, latch_ms);
+      }
+      else{
+        status = remote_set(cmd);
+        if(status == remote_ok) continue;  //reply when it's latched.
+        remote_reply_state(cmd, status, timer_ms_get());
+      }
+    }
+    else if(cmd->op == REMOTE_OP_READ_STATE)
+      remote_reply_state(cmd, remote_ok, timer_ms_get());
+    else  //REMOTE_OP_READ_TEMP
+      remote_reply(cmd, remote_ok, 0, (int64_t)(adt7420_get_latest()*1000), timer_ms_get());
+    queue_rd++;
+  }
+}
+#endif
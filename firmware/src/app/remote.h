@@ -0,0 +1,85 @@
+/**
+ * @author Neo Xu (neo.xu1990@gmail.com)
+ * @license The MIT License (MIT)
+ * 
+ * Copyright (c) 2019 Neo Xu
+ * 
+ * @brief binary command protocol on UART1, shares the port with shell.
+ *
+ * Frames are sframe(0x7d len payload 0x7c), payload ends with CRC16-CCITT
+ * (poly 0x1021, init 0xffff) of the bytes before it, little endian.
+ * Request: opcode(1) seq(2) args crc(2)
+ *   REMOTE_OP_SET_CODE   ch(1) code(4)
+ *   REMOTE_OP_SET_NV     ch(1) nv(8)
+ *   REMOTE_OP_READ_STATE ch(1)
+ *   REMOTE_OP_READ_TEMP  none
+ *   REMOTE_OP_STREAM_START rate_hz(4)
+ *   REMOTE_OP_STREAM_STOP  none
+ *   REMOTE_OP_STREAM_DATA  code(3) * 1 to REMOTE_STREAM_CODES, not replied
+ *   REMOTE_OP_WAVE_LOAD  offset(2) image(1 to REMOTE_WAVE_BLOCK), see wavepack.h
+ *   REMOTE_OP_WAVE_PLAY  len(2) crc(2) rate_hz(4) mode(1), mode 0 once, 1 loop
+ *   REMOTE_OP_WAVE_STOP  none
+ * Reply is always REMOTE_REPLY_LEN bytes:
+ *   opcode|0x80(1) status(1) seq(2) ch(1) safe(1) code(4) value(8) time(4) crc(2)
+ * value is output in nV, or temperature in 1/1000 C for READ_TEMP. WAVE_LOAD
+ * replies next offset in code, a block that isn't acked can be sent again.
+ * WAVE_PLAY checks CRC16 of the whole image, replies sample period in 64MHz
+ * clocks in code and samples in image in value. WAVE_* get opcode error if
+ * firmware is built without VOLTREF_USE_WAVEPACK. time is
+ * device time in ms when the frame was latched(set), the ramp reached
+ * target(channel 0 set) or the command ran(read).
+ * All numbers are little endian.
+ * REMOTE_OP_STREAM_EVENT is sent by device on stream watermarks, seq is the
+ * last STREAM_DATA seq, ch is stream_evt_def, code is ring level and value
+ * is underrun count | overrun count<<32. STREAM_* get opcode error if
+ * firmware is built without VOLTREF_USE_STREAM.
+ *
+ * Commands are queued and run in order, so host may keep up to
+ * REMOTE_QUEUE_SIZE of them in flight. A set is replied only after its frame
+ * is out on the bus and so in DAC output, unless LDAC is held by a latch mode.
+ * Channel 0 moves with the shell's slew limit(ramp command), its set is
+ * replied when the ramp reaches target.
+*/
+#ifndef _REMOTE_H_
+#define _REMOTE_H_
+#include "stdint.h"
+#include "voltref_conf.h"
+
+#define REMOTE_OP_SET_CODE    0x01
+#define REMOTE_OP_SET_NV      0x02
+#define REMOTE_OP_READ_STATE  0x03
+#define REMOTE_OP_READ_TEMP   0x04
+#define REMOTE_OP_STREAM_START  0x05
+#define REMOTE_OP_STREAM_STOP   0x06
+#define REMOTE_OP_STREAM_DATA   0x07
+#define REMOTE_OP_STREAM_EVENT  0x08
+#define REMOTE_OP_WAVE_LOAD   0x09
+#define REMOTE_OP_WAVE_PLAY   0x0a
+#define REMOTE_OP_WAVE_STOP   0x0b
+#define REMOTE_OP_REPLY       0x80
+
+#define REMOTE_REPLY_LEN      24
+#define REMOTE_QUEUE_SIZE     8
+#define REMOTE_FRAME_MAX      64  //opcode, seq, 19 stream codes and crc.
+#define REMOTE_STREAM_CODES   ((REMOTE_FRAME_MAX-5)/3)
+#define REMOTE_WAVE_BLOCK     (REMOTE_FRAME_MAX-7)
+
+typedef enum{
+  remote_ok = 0,
+  remote_err_crc,       /**< CRC is wrong, opcode and seq in reply may be wrong too. */
+  remote_err_len,       /**< length doesn't match opcode. */
+  remote_err_opcode,    /**< unknown opcode. */
+  remote_err_arg,       /**< channel or value out of range. */
+  remote_err_full,      /**< queue is full, command is dropped. */
+  remote_err_busy,      /**< a sample engine owns channel 0. */
+  remote_err_safe,      /**< output is in safe state, setpoint is only kept in shadow. */
+  remote_preloaded,     /**< code is in DAC register, waiting for LDAC. */
+  remote_err_image,     /**< wave image CRC or a token is wrong. */
+}remote_status_def;
+
+void remote_init(void);
+int32_t remote_input(uint8_t ch);
+void remote_poll(void);
+uint16_t remote_crc16(const uint8_t *pdata, uint32_t len);
+
+#endif
@@ -0,0 +1,205 @@
+/**
+ * @author Neo Xu (neo.xu1990@gmail.com)
+ * @license The MIT License (MIT)
+ * 
+ * Copyright (c) 2019 Neo Xu
+ * 
+ * @brief safe state of output: clear code, ground clamp or tristate.
+ * It's entered from fault input interrupt, shell, or when ADT7420 reads over
+ * the limit, and stays until it's restored from shell. Setpoints written in
+ * between are kept in driver shadow, restoring takes a single frame.
+*/
+#include "safe.h"
+#include "exti.h"
+#include "adt7420.h"
+#include "timer.h"
+#include "cmdarg.h"
+#include "string.h"
+#include "printf.h"
+#include "ush.h"
+
+#if VOLTREF_USE_SAFE
+#define SAFE_INPUT_LINE   1   //PA1
+#define SAFE_INPUT_PIN    GPIO_Pin_1
+
+static ad5791_safe_def safe_mode = ad5791_safe_clear;
+static volatile safe_src_def safe_src = safe_src_none;
+static volatile uint8_t safe_report = 0;  //tripped, not reported yet.
+static float safe_temp = SAFE_TEMP_DEFAULT;
+static float board_temp;
+static uint32_t trip_count = 0;
+static uint32_t trip_cycles, trip_cycles_max; //time to safe state, in cycles.
+
+/**
+ * @brief enter safe state, first source is recorded.
+ * @param start: cycle count when the event was seen.
+ * @return none.
+*/
+static void safe_enter(safe_src_def source, uint32_t start){
+  if(ad5791_safe_state() != ad5791_safe_off) return;
+  ad5791_safe_enter(safe_mode);
+  trip_cycles = timer_cycle_elapsed(start);
+  if(trip_cycles > trip_cycles_max)
+    trip_cycles_max = trip_cycles;
+  safe_src = source;
+  trip_count++;
+  safe_report = 1;
+}
+
+void safe_trip(safe_src_def source){
+  safe_enter(source, timer_cycle_get());
+}
+
+#if SAFE_USE_INPUT
+static void safe_input_irq(void){
+  safe_enter(safe_src_input, exti_entry_cycle());
+}
+
+static int32_t safe_input_active(void){
+  return (GPIOA->IDR & SAFE_INPUT_PIN) == 0;
+}
+#else
+static int32_t safe_input_active(void){
+  return 0;
+}
+#endif
+
+/**
+ * @brief called from ADT7420 driver on every reading.
+*/
+static void safe_temp_check(float temp){
+  board_temp = temp;
+  if(temp > safe_temp)
+    safe_trip(safe_src_temp);
+}
+
+void safe_init(void){
+#if SAFE_USE_INPUT
+  exti_enable(SAFE_INPUT_LINE, 0, safe_input_irq);
+  if(safe_input_active())
+    safe_trip(safe_src_input);
+#endif
+  adt7420_set_callback(safe_temp_check);
+}
+
+/**
+ * @brief back to normal output if the fault is gone.
+ * @return 0 if ok, -1 if fault input is still low or board is still hot.
+*/
+int32_t safe_restore(void){
+  if(safe_input_active() || board_temp > safe_temp)
+    return -1;
+  ad5791_safe_exit();
+  safe_src = safe_src_none;
+  return 0;
+}
+
+/**
+ * @brief set the state used on next trip.
+ * @return none.
+*/
+void safe_set_mode(ad5791_safe_def mode){
+  if(mode != ad5791_safe_off)
+    safe_mode = mode;
+}
+
+void safe_set_temp(float temp){
+  safe_temp = temp;
+}
+
+/**
+ * @brief report a trip from main loop, logging is too slow for interrupt.
+ * @return 1 once after a trip, else 0.
+*/
+int32_t safe_poll(void){
+  if(safe_report == 0) return 0;
+  safe_report = 0;
+  return 1;
+}
+
+/**
+ * @brief get state from argument.
+ * @return state, or ad5791_safe_off if it's wrong.
+*/
+static ad5791_safe_def safe_arg_mode(const char *str){
+  if(strcmp(str, "clear") == 0) return ad5791_safe_clear;
+  if(strcmp(str, "gnd") == 0) return ad5791_safe_ground;
+  if(strcmp(str, "tri") == 0) return ad5791_safe_tristate;
+  return ad5791_safe_off;
+}
+
+/**
+ * @brief safe [clear|gnd|tri], state given is also used on later trips.
+*/
+static int32_t ush_safe(uint32_t argc, char **argv){
+  if(argc > 1){
+    ad5791_safe_def mode = safe_arg_mode(argv[1]);
+    if(mode == ad5791_safe_off){
+      USH_Print("usage: safe [clear|gnd|tri]\n");
+      return -1;
+    }
+    safe_set_mode(mode);
+  }
+  safe_trip(safe_src_shell);
+  return 0;
+}
+USH_REGISTER(ush_safe, safe, Enter safe state: safe [clear|gnd|tri]);
+
+static int32_t ush_safe_off(uint32_t argc, char **argv){
+  if(safe_restore() != 0){
+    USH_Print("fault is still there, input %s, temperature %fC\n",
+              safe_input_active() ? "low" : "high", board_temp);
+    return -1;
+  }
+  return 0;
+}
+USH_REGISTER(ush_safe_off, safeoff, Restore output from safe state);
+
+/**
+ * @brief safeclr volt [ch]
+*/
+static int32_t ush_safe_clr(uint32_t argc, char **argv){
+  uint64_t nv;
+  uint32_t ch = 0;
+  ad5791_dev_def *dev;
+  if(argc < 2 || cmdarg_volt_nv(argv[1], &nv) != 0){
+    USH_Print("usage: safeclr volt [ch]\n");
+    return -1;
+  }
+  if(argc > 2 && (cmdarg_uint(argv[2], &ch) != 0 || ch >= AD5791_DEV_NUM)){
+    USH_Print("channel should be 0 to %d\n", AD5791_DEV_NUM-1);
+    return -1;
+  }
+  dev = ad5791_get_dev(ch);
+  ad5791_dev_set_clrcode(dev, ad5791_dev_nv2code(dev, nv));
+  USH_Print("DAC%d clear code: 0x%05x\n", ch, dev->clrcode);
+  return 0;
+}
+USH_REGISTER(ush_safe_clr, safeclr, Set output of clear safe state: safeclr volt [ch]);
+
+static int32_t ush_safe_temp(uint32_t argc, char **argv){
+  float temp;
+  if(argc < 2 || cmdarg_float(argv[1], &temp) != 0){
+    USH_Print("usage: safetemp degree_C\n");
+    return -1;
+  }
+  safe_set_temp(temp);
+  return 0;
+}
+USH_REGISTER(ush_safe_temp, safetemp, Set over-temperature limit: safetemp degree_C);
+
+static int32_t ush_safe_stat(uint32_t argc, char **argv){
+  const char *mode_name[] = {"off", "clear", "gnd", "tri"};
+  const char *src_name[] = {"none", "input", "shell", "temperature"};
+  USH_Print("state: %s, trip mode: %s, source: %s, trips: %u\n", mode_name[ad5791_safe_state()],
+            mode_name[safe_mode], src_name[safe_src], trip_count);
+  USH_Print("time to safe(cycles): last %u, max %u, %uns max\n", trip_cycles, trip_cycles_max,
+            timer_cycle2ns(trip_cycles_max));
+  USH_Print("input: %s, temperature %fC, limit %fC\n",
+            SAFE_USE_INPUT ? (safe_input_active() ? "low" : "high") : "none", board_temp, safe_temp);
+  for(uint32_t i=0; i<AD5791_DEV_NUM; i++)
+    USH_Print("DAC%d clear code 0x%05x\n", i, ad5791_get_dev(i)->clrcode);
+  return 0;
+}
+USH_REGISTER(ush_safe_stat, safestat, Show safe state);
+#endif
@@ -0,0 +1,39 @@
+/**
+ * @author Neo Xu (neo.xu1990@gmail.com)
+ * @license The MIT License (MIT)
+ * 
+ * Copyright (c) 2019 Neo Xu
+ * 
+ * @brief safe state of output: clear code, ground clamp or tristate.
+*/
+#ifndef _SAFE_H_
+#define _SAFE_H_
+#include "stdint.h"
+#include "voltref_conf.h"
+#include "ad5791.h"
+
+/**
+ * Fault input, active low on PA1 with EXTI. PA1 is LDAC when it's wired, so
+ * the input is only there on boards without LDAC.
+*/
+#ifndef SAFE_USE_INPUT
+#define SAFE_USE_INPUT (!AD5791_USE_LDAC)
+#endif
+
+#define SAFE_TEMP_DEFAULT 70  //over-temperature limit in C.
+
+typedef enum{
+  safe_src_none = 0,
+  safe_src_input,   /**< fault input went low. */
+  safe_src_shell,   /**< safe command. */
+  safe_src_temp,    /**< board is too hot. */
+}safe_src_def;
+
+void safe_init(void);
+void safe_trip(safe_src_def source);
+int32_t safe_restore(void);
+void safe_set_mode(ad5791_safe_def mode);
+void safe_set_temp(float temp);
+int32_t safe_poll(void);
+
+#endif
@@ -0,0 +1,235 @@
+/**
+ * @author Neo Xu (neo.xu1990@gmail.com)
+ * @license The MIT License (MIT)
+ * 
+ * Copyright (c) 2019 Neo Xu
+ * 
+ * @brief setpoint queue, codes are applied at an absolute timer tick.
+ * Host sends setpoints ahead of time, UART latency doesn't reach output. The
+ * queue is a binary min-heap on tick, insert and pop are O(log n). Entries of
+ * the same tick keep the order they are added. An entry for channel 0 that's
+ * due while a sample engine owns it is dropped and counted as busy, like remote
+ * and SCPI setpoints are refused then.
+*/
+#include "sched.h"
+#include "ad5791.h"
+#include "timer.h"
+#include "cmdarg.h"
+#include "string.h"
+#include "printf.h"
+#include "ush.h"
+
+#if VOLTREF_USE_SCHED
+typedef struct{
+  uint32_t tick;    //tick to apply.
+  uint32_t code;
+  uint16_t order;   //add order, to break ties of same tick.
+  uint8_t ch;
+}sched_entry_def;
+
+static sched_entry_def heap[SCHED_QUEUE_SIZE];
+static volatile uint32_t heap_len = 0;
+static uint16_t add_order = 0;
+static sched_stat_def sched_stat;
+
+/**
+ * @brief compare with wrap around, ticks and orders are close to each other.
+ * @return 1 if a should be applied before b.
+*/
+static int32_t sched_before(const sched_entry_def *a, const sched_entry_def *b){
+  if(a->tick != b->tick)
+    return (int32_t)(a->tick - b->tick) < 0;
+  return (int16_t)(a->order - b->order) < 0;
+}
+
+static void sched_swap(uint32_t i, uint32_t j){
+  sched_entry_def tmp = heap[i];
+  heap[i] = heap[j];
+  heap[j] = tmp;
+}
+
+/**
+ * @brief remove root and move last entry down to its place.
+ * @return none.
+*/
+static void sched_pop(void){
+  uint32_t i = 0, child;
+  heap[0] = heap[--heap_len];
+  while((child = 2*i + 1) < heap_len){
+    if(child + 1 < heap_len && sched_before(&heap[child+1], &heap[child]))
+      child++;
+    if(!sched_before(&heap[child], &heap[i]))
+      break;
+    sched_swap(i, child);
+    i = child;
+  }
+}
+
+/**
+ * @brief apply every entry that's due, called from timer interrupt each tick.
+ * @return none.
+*/
+static void sched_tick(void){
+  uint32_t now = timer_tick_get(), late;
+  while(heap_len && (int32_t)(heap[0].tick - now) <= 0){
+    late = now - heap[0].tick;
+    if(late){
+      sched_stat.late++;
+      if(late > sched_stat.late_max)
+        sched_stat.late_max = late;
+    }
+    if(heap[0].ch == 0 && timer_sample_owner() != 0)
+      sched_stat.busy++;  //it and the engine would overwrite each other.
+    else{
+      ad5791_dev_write_data(ad5791_get_dev(heap[0].ch), heap[0].code);
+      sched_stat.applied++;
+    }
+    sched_pop();
+  }
+}
+
+/**
+ * @brief must be called after timer_init.
+ * @return none.
+*/
+void sched_init(void){
+  timer_register(sched_tick, timer_tick_ms());  //every tick.
+}
+
+/**
+ * @brief add a code to be written at tick. An entry whose tick has passed is
+ * applied on next tick and counted as late.
+ * @return 0 if ok, -1 if queue is full or channel is wrong.
+*/
+int32_t sched_add(uint32_t tick, uint32_t ch, uint32_t code){
+  uint32_t i, parent;
+  if(ch >= AD5791_DEV_NUM) return -1;
+  NVIC_DisableIRQ(TIM16_IRQn);
+  if(heap_len >= SCHED_QUEUE_SIZE){
+    NVIC_EnableIRQ(TIM16_IRQn);
+    sched_stat.full++;
+    return -1;
+  }
+  i = heap_len++;
+  heap[i].tick = tick;
+  heap[i].code = code&0xfffff;
+  heap[i].order = add_order++;
+  heap[i].ch = ch;
+  while(i){
+    parent = (i - 1)/2;
+    if(!sched_before(&heap[i], &heap[parent]))
+      break;
+    sched_swap(i, parent);
+    i = parent;
+  }
+  if(heap_len > sched_stat.peak)
+    sched_stat.peak = heap_len;
+  NVIC_EnableIRQ(TIM16_IRQn);
+  return 0;
+}
+
+/**
+ * @brief drop all pending entries and clear statistics.
+ * @return none.
+*/
+void sched_flush(void){
+  NVIC_DisableIRQ(TIM16_IRQn);
+  heap_len = 0;
+  memset(&sched_stat, 0, sizeof(sched_stat));
+  NVIC_EnableIRQ(TIM16_IRQn);
+}
+
+void sched_get_stat(sched_stat_def *stat){
+  NVIC_DisableIRQ(TIM16_IRQn);
+  *stat = sched_stat;
+  stat->depth = heap_len;
+  NVIC_EnableIRQ(TIM16_IRQn);
+}
+
+/**
+ * @brief get tick from argument, "+n" is n ticks from now.
+ * @return 0 if ok.
+*/
+static int32_t sched_arg_tick(const char *str, uint32_t *tick){
+  uint32_t now = timer_tick_get();
+  if(str[0] == '+'){
+    if(cmdarg_uint(str+1, tick) != 0) return -1;
+    *tick += now;
+    return 0;
+  }
+  return cmdarg_uint(str, tick);
+}
+
+/**
+ * @brief get channel from optional argument.
+ * @return channel, or -1 if it's wrong.
+*/
+static int32_t sched_arg_ch(uint32_t argc, char **argv, uint32_t index){
+  uint32_t ch = 0;
+  if(argc > index && (cmdarg_uint(argv[index], &ch) != 0 || ch >= AD5791_DEV_NUM)){
+    USH_Print("channel should be 0 to %d\n", AD5791_DEV_NUM-1);
+    return -1;
+  }
+  return ch;
+}
+
+/**
+ * @brief qset tick|+ticks volt [ch]
+ * Voltage is converted to code now, with calibration of the time it's queued.
+*/
+static int32_t ush_sched_volt(uint32_t argc, char **argv){
+  uint32_t tick;
+  uint64_t nv;
+  int32_t ch;
+  if(argc < 3 || sched_arg_tick(argv[1], &tick) != 0 || cmdarg_volt_nv(argv[2], &nv) != 0){
+    USH_Print("usage: qset tick|+ticks volt [ch]\n");
+    return -1;
+  }
+  ch = sched_arg_ch(argc, argv, 3);
+  if(ch < 0) return -1;
+  if(sched_add(tick, ch, ad5791_dev_nv2code(ad5791_get_dev(ch), nv)) != 0){
+    USH_Print("queue is full\n");
+    return -1;
+  }
+  return 0;
+}
+USH_REGISTER(ush_sched_volt, qset, Queue voltage at tick: qset tick|+ticks volt [ch]);
+
+/**
+ * @brief qcode tick|+ticks code [ch]
+*/
+static int32_t ush_sched_code(uint32_t argc, char **argv){
+  uint32_t tick, code;
+  int32_t ch;
+  if(argc < 3 || sched_arg_tick(argv[1], &tick) != 0 || cmdarg_uint(argv[2], &code) != 0 ||
+     code > 0xfffff){
+    USH_Print("usage: qcode tick|+ticks code [ch]\n");
+    return -1;
+  }
+  ch = sched_arg_ch(argc, argv, 3);
+  if(ch < 0) return -1;
+  if(sched_add(tick, ch, code) != 0){
+    USH_Print("queue is full\n");
+    return -1;
+  }
+  return 0;
+}
+USH_REGISTER(ush_sched_code, qcode, Queue code at tick: qcode tick|+ticks code [ch]);
+
+static int32_t ush_sched_flush(uint32_t argc, char **argv){
+  sched_flush();
+  return 0;
+}
+USH_REGISTER(ush_sched_flush, qflush, Drop queued setpoints and clear statistics);
+
+static int32_t ush_sched_stat(uint32_t argc, char **argv){
+  sched_stat_def stat;
+  sched_get_stat(&stat);
+  USH_Print("tick: %u, %dms per tick\n", timer_tick_get(), timer_tick_ms());
+  USH_Print("depth: %u/%d, peak: %u\n", stat.depth, SCHED_QUEUE_SIZE, stat.peak);
+  USH_Print("applied: %u, late: %u(max %u ticks), full: %u, busy: %u\n", stat.applied,
+            stat.late, stat.late_max, stat.full, stat.busy);
+  return 0;
+}
+USH_REGISTER(ush_sched_stat, qstat, Show setpoint queue status and current tick);
+#endif
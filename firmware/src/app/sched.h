@@ -0,0 +1,31 @@
+/**
+ * @author Neo Xu (neo.xu1990@gmail.com)
+ * @license The MIT License (MIT)
+ * 
+ * Copyright (c) 2019 Neo Xu
+ * 
+ * @brief setpoint queue, codes are applied at an absolute timer tick.
+*/
+#ifndef _SCHED_H_
+#define _SCHED_H_
+#include "stdint.h"
+#include "voltref_conf.h"
+
+#define SCHED_QUEUE_SIZE 32
+
+typedef struct{
+  uint32_t depth;     /**< entries waiting now. */
+  uint32_t peak;      /**< highest depth since last flush. */
+  uint32_t applied;   /**< entries written to DAC. */
+  uint32_t late;      /**< entries applied after their tick. */
+  uint32_t late_max;  /**< worst lateness in ticks. */
+  uint32_t full;      /**< entries refused because queue was full. */
+  uint32_t busy;      /**< channel 0 entries dropped, a sample engine owned it. */
+}sched_stat_def;
+
+void sched_init(void);
+int32_t sched_add(uint32_t tick, uint32_t ch, uint32_t code);
+void sched_flush(void);
+void sched_get_stat(sched_stat_def *stat);
+
+#endif
@@ -0,0 +1,771 @@
+/**
+ * @author Neo Xu (neo.xu1990@gmail.com)
+ * @license The MIT License (MIT)
+ * 
+ * Copyright (c) 2019 Neo Xu
+ * 
+ * @brief SCPI subset on UART1.
+ * Keywords are in const tables with FNV-1a hash of short and long form, so a
+ * header is hashed once while it's parsed and looked up by number, no string
+ * compare. Hashes are built by compiler and checked against keyword names on
+ * init, SCPI is turned off if one is wrong.
+ * *WAI and *OPC? don't block main loop, the rest of the line is kept and run
+ * from scpi_poll when ramp is done.
+*/
+#include "scpi.h"
+#include "ad5791.h"
+#include "adt7420.h"
+#include "parameter.h"
+#include "ramp.h"
+#include "safe.h"
+#include "timer.h"
+#include "cmdarg.h"
+#include "string.h"
+#include "printf.h"
+
+#define LOG_TAG              "scpi"
+#define LOG_LVL              LOG_LVL_INFO
+#include <ulog.h>
+
+#if VOLTREF_USE_SCPI
+#define SCPI_FNV_BASIS  2166136261u
+#define SCPI_FNV(h, c)  (((h)^(uint8_t)(c))*16777619u)
+
+/**
+ * FNV-1a of up to 11 characters as a constant expression, keyword tables are
+ * hashed by compiler: SCPI_HASH('L','E','V')
+*/
+#define SCPI_H1(a)                      SCPI_FNV(SCPI_FNV_BASIS, a)
+#define SCPI_H2(a,b)                    SCPI_FNV(SCPI_H1(a), b)
+#define SCPI_H3(a,b,c)                  SCPI_FNV(SCPI_H2(a,b), c)
+#define SCPI_H4(a,b,c,d)                SCPI_FNV(SCPI_H3(a,b,c), d)
+#define SCPI_H5(a,b,c,d,e)              SCPI_FNV(SCPI_H4(a,b,c,d), e)
+#define SCPI_H6(a,b,c,d,e,f)            SCPI_FNV(SCPI_H5(a,b,c,d,e), f)
+#define SCPI_H7(a,b,c,d,e,f,g)          SCPI_FNV(SCPI_H6(a,b,c,d,e,f), g)
+#define SCPI_H8(a,b,c,d,e,f,g,h)        SCPI_FNV(SCPI_H7(a,b,c,d,e,f,g), h)
+#define SCPI_H9(a,b,c,d,e,f,g,h,i)      SCPI_FNV(SCPI_H8(a,b,c,d,e,f,g,h), i)
+#define SCPI_H10(a,b,c,d,e,f,g,h,i,j)   SCPI_FNV(SCPI_H9(a,b,c,d,e,f,g,h,i), j)
+#define SCPI_H11(a,b,c,d,e,f,g,h,i,j,k) SCPI_FNV(SCPI_H10(a,b,c,d,e,f,g,h,i,j), k)
+#define SCPI_HN(a,b,c,d,e,f,g,h,i,j,k,n,...)  SCPI_H##n
+#define SCPI_HASH(...)  SCPI_HN(__VA_ARGS__,11,10,9,8,7,6,5,4,3,2,1,0)(__VA_ARGS__)
+
+#define SCPI_UID_ADDR   0x1ffff7ac  //96bit unique ID, first word is the serial.
+
+#define SCPI_ERR_SYNTAX     -102
+#define SCPI_ERR_NOT_ALLOWED -108
+#define SCPI_ERR_MISSING    -109
+#define SCPI_ERR_HEADER     -113
+#define SCPI_ERR_SUFFIX     -114
+#define SCPI_ERR_EXEC       -200
+#define SCPI_ERR_CONFLICT   -221
+#define SCPI_ERR_RANGE      -222
+#define SCPI_ERR_TOO_MUCH   -223
+#define SCPI_ERR_ILLEGAL    -224
+#define SCPI_ERR_OVERFLOW   -350
+#define SCPI_ERR_INTERRUPTED -410
+
+#define SCPI_WAIT           1   //command waits for ramp, not an error.
+
+#define SCPI_ROUTE_UNKNOWN  0   //first word is not complete.
+#define SCPI_ROUTE_SHELL    1
+#define SCPI_ROUTE_SCPI     2
+
+uint64_t voltref_set_nv(ad5791_dev_def *dev, uint64_t nv);
+float voltref_set_code(ad5791_dev_def *dev, uint32_t code);
+
+typedef struct{
+  uint32_t ch;      //channel from numeric suffix, SOURce1 is channel 0.
+  char *arg;        //parameter, 0 if there is none.
+}scpi_cmd_def;
+
+typedef int32_t (*scpi_func)(scpi_cmd_def *cmd);
+
+typedef struct _scpi_node{
+  uint32_t hash_short;              //hash of upper case part of name.
+  uint32_t hash_long;               //hash of whole name in upper case.
+  const char *name;                 //upper case part is short form.
+  const struct _scpi_node *child;   //keywords after ':', 0 if none.
+  scpi_func set;
+  scpi_func query;
+}scpi_node_def;
+
+static int32_t scpi_volt_set(scpi_cmd_def *cmd);
+static int32_t scpi_volt_query(scpi_cmd_def *cmd);
+static int32_t scpi_code_set(scpi_cmd_def *cmd);
+static int32_t scpi_code_query(scpi_cmd_def *cmd);
+static int32_t scpi_meas_volt(scpi_cmd_def *cmd);
+static int32_t scpi_meas_temp(scpi_cmd_def *cmd);
+static int32_t scpi_outp_set(scpi_cmd_def *cmd);
+static int32_t scpi_outp_query(scpi_cmd_def *cmd);
+static int32_t scpi_err_next(scpi_cmd_def *cmd);
+static int32_t scpi_version(scpi_cmd_def *cmd);
+static int32_t scpi_idn(scpi_cmd_def *cmd);
+static int32_t scpi_rst(scpi_cmd_def *cmd);
+static int32_t scpi_cls(scpi_cmd_def *cmd);
+static int32_t scpi_opc_set(scpi_cmd_def *cmd);
+static int32_t scpi_opc_query(scpi_cmd_def *cmd);
+static int32_t scpi_wai(scpi_cmd_def *cmd);
+static int32_t scpi_tst(scpi_cmd_def *cmd);
+
+/**
+ * Keyword tables, each ends with a zero entry. Hashes are of short form and
+ * whole name in upper case, scpi_init checks them against name.
+*/
+static const scpi_node_def scpi_volt_node[] = {
+  {SCPI_HASH('L','E','V'), SCPI_HASH('L','E','V','E','L'),
+   "LEVel", 0, scpi_volt_set, scpi_volt_query},
+  {SCPI_HASH('C','O','D','E'), SCPI_HASH('C','O','D','E'),
+   "CODE", 0, scpi_code_set, scpi_code_query},
+  {0},
+};
+
+static const scpi_node_def scpi_source_node[] = {
+  {SCPI_HASH('V','O','L','T'), SCPI_HASH('V','O','L','T','A','G','E'),
+   "VOLTage", scpi_volt_node, scpi_volt_set, scpi_volt_query},
+  {0},
+};
+
+static const scpi_node_def scpi_meas_node[] = {
+  {SCPI_HASH('V','O','L','T'), SCPI_HASH('V','O','L','T','A','G','E'),
+   "VOLTage", 0, 0, scpi_meas_volt},
+  {SCPI_HASH('T','E','M','P'), SCPI_HASH('T','E','M','P','E','R','A','T','U','R','E'),
+   "TEMPerature", 0, 0, scpi_meas_temp},
+  {0},
+};
+
+static const scpi_node_def scpi_outp_node[] = {
+  {SCPI_HASH('S','T','A','T'), SCPI_HASH('S','T','A','T','E'),
+   "STATe", 0, scpi_outp_set, scpi_outp_query},
+  {0},
+};
+
+static const scpi_node_def scpi_err_node[] = {
+  {SCPI_HASH('N','E','X','T'), SCPI_HASH('N','E','X','T'),
+   "NEXT", 0, 0, scpi_err_next},
+  {0},
+};
+
+static const scpi_node_def scpi_syst_node[] = {
+  {SCPI_HASH('E','R','R'), SCPI_HASH('E','R','R','O','R'),
+   "ERRor", scpi_err_node, 0, scpi_err_next},
+  {SCPI_HASH('V','E','R','S'), SCPI_HASH('V','E','R','S','I','O','N'),
+   "VERSion", 0, 0, scpi_version},
+  {0},
+};
+
+static const scpi_node_def scpi_root[] = {
+  {SCPI_HASH('S','O','U','R'), SCPI_HASH('S','O','U','R','C','E'),
+   "SOURce", scpi_source_node, 0, 0},
+  {SCPI_HASH('V','O','L','T'), SCPI_HASH('V','O','L','T','A','G','E'),
+   "VOLTage", scpi_volt_node, scpi_volt_set, scpi_volt_query},
+  {SCPI_HASH('M','E','A','S'), SCPI_HASH('M','E','A','S','U','R','E'),
+   "MEASure", scpi_meas_node, 0, 0},
+  {SCPI_HASH('O','U','T','P'), SCPI_HASH('O','U','T','P','U','T'),
+   "OUTPut", scpi_outp_node, scpi_outp_set, scpi_outp_query},
+  {SCPI_HASH('S','Y','S','T'), SCPI_HASH('S','Y','S','T','E','M'),
+   "SYSTem", scpi_syst_node, 0, 0},
+  {0},
+};
+
+static const scpi_node_def scpi_common[] = {
+  {SCPI_HASH('*','I','D','N'), SCPI_HASH('*','I','D','N'),
+   "*IDN", 0, 0, scpi_idn},
+  {SCPI_HASH('*','R','S','T'), SCPI_HASH('*','R','S','T'),
+   "*RST", 0, scpi_rst, 0},
+  {SCPI_HASH('*','C','L','S'), SCPI_HASH('*','C','L','S'),
+   "*CLS", 0, scpi_cls, 0},
+  {SCPI_HASH('*','O','P','C'), SCPI_HASH('*','O','P','C'),
+   "*OPC", 0, scpi_opc_set, scpi_opc_query},
+  {SCPI_HASH('*','W','A','I'), SCPI_HASH('*','W','A','I'),
+   "*WAI", 0, scpi_wai, 0},
+  {SCPI_HASH('*','T','S','T'), SCPI_HASH('*','T','S','T'),
+   "*TST", 0, 0, scpi_tst},
+  {0},
+};
+
+static const struct{
+  int16_t code;
+  const char *msg;
+}scpi_err_msg[] = {
+  {0, "No error"},
+  {SCPI_ERR_SYNTAX, "Syntax error"},
+  {SCPI_ERR_NOT_ALLOWED, "Parameter not allowed"},
+  {SCPI_ERR_MISSING, "Missing parameter"},
+  {SCPI_ERR_HEADER, "Undefined header"},
+  {SCPI_ERR_SUFFIX, "Header suffix out of range"},
+  {SCPI_ERR_EXEC, "Execution error"},
+  {SCPI_ERR_CONFLICT, "Settings conflict"},
+  {SCPI_ERR_RANGE, "Data out of range"},
+  {SCPI_ERR_TOO_MUCH, "Too much data"},
+  {SCPI_ERR_ILLEGAL, "Illegal parameter value"},
+  {SCPI_ERR_OVERFLOW, "Queue overflow"},
+  {SCPI_ERR_INTERRUPTED, "Query INTERRUPTED"},
+};
+
+static char line[SCPI_LINE_MAX+1];
+static uint32_t line_len = 0;
+static uint8_t line_route = SCPI_ROUTE_UNKNOWN;
+static uint8_t line_overflow = 0;
+static uint8_t skip_lf = 0;       //last SCPI line ended with '\r', '\n' may follow.
+static uint8_t scpi_active = 0;   //last line was SCPI.
+static uint8_t replied = 0;       //a reply of this line is printed.
+static const scpi_node_def *base = scpi_root;  //where relative headers start.
+static uint32_t base_ch = 0;
+static int16_t err_queue[SCPI_ERROR_QUEUE];
+static uint32_t err_rd = 0, err_wr = 0;
+static uint8_t scpi_off = 0;        //keyword table is wrong, all lines go to shell.
+static uint8_t wait_on = 0;         //*WAI or *OPC? waits for ramp.
+static uint8_t wait_reply = 0;      //it's *OPC?, "1" is replied when done.
+static char wait_rest[SCPI_LINE_MAX+1]; //commands after it in the line.
+
+static char scpi_upper(char c){
+  return (c >= 'a' && c <= 'z') ? c - 'a' + 'A' : c;
+}
+
+static int32_t scpi_is_alpha(char c){
+  c = scpi_upper(c);
+  return c >= 'A' && c <= 'Z';
+}
+
+static int32_t scpi_is_digit(char c){
+  return c >= '0' && c <= '9';
+}
+
+static uint32_t scpi_hash(const char *s, uint32_t len, uint32_t short_form){
+  uint32_t hash = SCPI_FNV_BASIS;
+  for(; len && *s; s++, len--){
+    if(short_form && !(*s == '*' || (*s >= 'A' && *s <= 'Z'))) break;
+    hash = SCPI_FNV(hash, scpi_upper(*s));
+  }
+  return hash;
+}
+
+/**
+ * @brief check table hashes against names, a typo in table would make a
+ * keyword unreachable without any other sign.
+ * @return number of wrong entries.
+*/
+static uint32_t scpi_check_table(const scpi_node_def *table){
+  uint32_t wrong = 0;
+  for(; table->name; table++){
+    if(table->hash_short != scpi_hash(table->name, SCPI_LINE_MAX, 1) ||
+       table->hash_long != scpi_hash(table->name, SCPI_LINE_MAX, 0)){
+      LOG_E("hash of %s is wrong", table->name);
+      wrong++;
+    }
+    if(table->child)
+      wrong += scpi_check_table(table->child);
+  }
+  return wrong;
+}
+
+/**
+ * @brief check keyword tables, SCPI is turned off if they are wrong.
+ * @return 0 if ok, -1 if SCPI is off.
+*/
+int32_t scpi_init(void){
+  if(scpi_check_table(scpi_root) + scpi_check_table(scpi_common)){
+    scpi_off = 1;
+    return -1;
+  }
+  return 0;
+}
+
+static const scpi_node_def *scpi_find(const scpi_node_def *table, uint32_t hash){
+  for(; table->name; table++){
+    if(table->hash_short == hash || table->hash_long == hash)
+      return table;
+  }
+  return 0;
+}
+
+static void scpi_error(int32_t code){
+  if(err_wr - err_rd >= SCPI_ERROR_QUEUE){
+    err_queue[(err_wr-1)%SCPI_ERROR_QUEUE] = SCPI_ERR_OVERFLOW;
+    return;
+  }
+  err_queue[err_wr%SCPI_ERROR_QUEUE] = code;
+  err_wr++;
+}
+
+/**
+ * @brief start a reply, replies in one line are separated by ';'.
+ * @return none.
+*/
+static void scpi_reply(void){
+  if(replied)
+    printf(";");
+  replied = 1;
+}
+
+static void scpi_reply_nv(uint64_t nv){
+  scpi_reply();
+  printf("%u.%09u", (uint32_t)(nv/1000000000), (uint32_t)(nv%1000000000));
+}
+
+/**
+ * @brief parse voltage to nV: [+|-]digits[.digits][E[+|-]digits][V|MV|UV|NV]
+ * @return 0 if ok, else SCPI error.
+*/
+static int32_t scpi_arg_nv(const char *s, int64_t *nv){
+  int64_t mant = 0;
+  int32_t exp = 9, neg = 0, digits = 0, e = 0, e_neg = 0;
+  char u0, u1;
+  if(s == 0) return SCPI_ERR_MISSING;
+  if(*s == '+' || *s == '-')
+    neg = *s++ == '-';
+  for(; scpi_is_digit(*s); s++, digits++){
+    if(mant < 100000000000000ll) mant = mant*10 + *s - '0';
+    else exp++;
+  }
+  if(*s == '.'){
+    for(s++; scpi_is_digit(*s); s++, digits++){
+      if(mant < 100000000000000ll){
+        mant = mant*10 + *s - '0';
+        exp--;
+      }
+    }
+  }
+  if(digits == 0) return SCPI_ERR_ILLEGAL;
+  if(*s == 'e' || *s == 'E'){
+    s++;
+    if(*s == '+' || *s == '-')
+      e_neg = *s++ == '-';
+    if(!scpi_is_digit(*s)) return SCPI_ERR_ILLEGAL;
+    for(; scpi_is_digit(*s); s++){
+      e = e*10 + *s - '0';
+      if(e > 30) return SCPI_ERR_RANGE;
+    }
+    exp += e_neg ? -e : e;
+  }
+  while(*s == ' ') s++;
+  u0 = scpi_upper(s[0]);
+  u1 = u0 ? scpi_upper(s[1]) : 0;
+  if(u0 != 0 && !(u0 == 'V' && u1 == 0)){
+    if(u1 != 'V' || s[2] != 0 || !(u0 == 'M' || u0 == 'U' || u0 == 'N'))
+      return SCPI_ERR_ILLEGAL;
+    exp -= u0 == 'M' ? 3 : u0 == 'U' ? 6 : 9;
+  }
+  for(; exp > 0; exp--){
+    if(mant > 100000000000000000ll) return SCPI_ERR_RANGE;
+    mant *= 10;
+  }
+  for(; exp < 0; exp++)
+    mant = exp == -1 ? (mant + 5)/10 : mant/10;
+  *nv = neg ? -mant : mant;
+  return 0;
+}
+
+/**
+ * @brief parse ON|OFF|1|0.
+ * @return 0 if ok, else SCPI error.
+*/
+static int32_t scpi_arg_bool(const char *s, uint32_t *value){
+  char buff[4];
+  uint32_t i;
+  if(s == 0) return SCPI_ERR_MISSING;
+  for(i=0; i<3 && s[i]; i++)
+    buff[i] = scpi_upper(s[i]);
+  buff[i] = 0;
+  if(s[i] != 0) return SCPI_ERR_ILLEGAL;
+  if(strcmp(buff, "ON") == 0 || strcmp(buff, "1") == 0) *value = 1;
+  else if(strcmp(buff, "OFF") == 0 || strcmp(buff, "0") == 0) *value = 0;
+  else return SCPI_ERR_ILLEGAL;
+  return 0;
+}
+
+/**
+ * @brief a sample engine owns channel 0, setpoint would fight with it.
+*/
+static int32_t scpi_ch_busy(uint32_t ch){
+#if VOLTREF_USE_RAMP
+  return ch == 0 && timer_sample_owner() != 0 && !ramp_is_running();
+#else
+  return ch == 0 && timer_sample_owner() != 0;
+#endif
+}
+
+static int32_t scpi_volt_set(scpi_cmd_def *cmd){
+  ad5791_dev_def *dev = ad5791_get_dev(cmd->ch);
+  int64_t nv;
+  int32_t err = scpi_arg_nv(cmd->arg, &nv);
+  if(err) return err;
+  if(nv < 0 || (uint64_t)nv > dev->vref_nv) return SCPI_ERR_RANGE;
+  if(scpi_ch_busy(cmd->ch)) return SCPI_ERR_CONFLICT;
+  voltref_set_nv(dev, nv);
+  return 0;
+}
+
+static int32_t scpi_volt_query(scpi_cmd_def *cmd){
+  ad5791_dev_def *dev = ad5791_get_dev(cmd->ch);
+  scpi_reply_nv(ad5791_dev_code2nv(dev, ad5791_dev_setpoint(dev)));
+  return 0;
+}
+
+static int32_t scpi_code_set(scpi_cmd_def *cmd){
+  uint32_t code;
+  if(cmd->arg == 0) return SCPI_ERR_MISSING;
+  if(cmdarg_uint(cmd->arg, &code) != 0) return SCPI_ERR_ILLEGAL;
+  if(code > 0xfffff) return SCPI_ERR_RANGE;
+  if(scpi_ch_busy(cmd->ch)) return SCPI_ERR_CONFLICT;
+  voltref_set_code(ad5791_get_dev(cmd->ch), code);
+  return 0;
+}
+
+static int32_t scpi_code_query(scpi_cmd_def *cmd){
+  scpi_reply();
+  printf("%u", ad5791_dev_setpoint(ad5791_get_dev(cmd->ch)));
+  return 0;
+}
+
+static int32_t scpi_meas_volt(scpi_cmd_def *cmd){
+  ad5791_dev_def *dev = ad5791_get_dev(cmd->ch);
+  scpi_reply_nv(ad5791_dev_code2nv(dev, dev->code));
+  return 0;
+}
+
+static int32_t scpi_meas_temp(scpi_cmd_def *cmd){
+  float temp = adt7420_get_latest();
+  int32_t mc = (int32_t)(temp*1000 + (temp < 0 ? -0.5f : 0.5f));
+  scpi_reply();
+  printf("%s%d.%03d", mc < 0 ? "-" : "", (mc < 0 ? -mc : mc)/1000, (mc < 0 ? -mc : mc)%1000);
+  return 0;
+}
+
+static int32_t scpi_outp_set(scpi_cmd_def *cmd){
+  uint32_t on;
+  int32_t err = scpi_arg_bool(cmd->arg, &on);
+  if(err) return err;
+#if VOLTREF_USE_SAFE
+  if(!on)
+    safe_trip(safe_src_shell);
+  else if(ad5791_safe_state() != ad5791_safe_off && safe_restore() != 0)
+    return SCPI_ERR_EXEC;   //fault is still there.
+#else
+  if(!on)
+    ad5791_safe_enter(ad5791_safe_clear);
+  else
+    ad5791_safe_exit();
+#endif
+  return 0;
+}
+
+static int32_t scpi_outp_query(scpi_cmd_def *cmd){
+  scpi_reply();
+  printf("%d", ad5791_safe_state() == ad5791_safe_off);
+  return 0;
+}
+
+static int32_t scpi_err_next(scpi_cmd_def *cmd){
+  int32_t code = 0;
+  const char *msg = "";
+  if(err_rd != err_wr)
+    code = err_queue[err_rd++%SCPI_ERROR_QUEUE];
+  for(uint32_t i=0; i<sizeof(scpi_err_msg)/sizeof(scpi_err_msg[0]); i++){
+    if(scpi_err_msg[i].code == code)
+      msg = scpi_err_msg[i].msg;
+  }
+  scpi_reply();
+  printf("%d,\"%s\"", code, msg);
+  return 0;
+}
+
+static int32_t scpi_version(scpi_cmd_def *cmd){
+  scpi_reply();
+  printf("1999.0");
+  return 0;
+}
+
+static int32_t scpi_idn(scpi_cmd_def *cmd){
+  struct _parameter parameter;
+  parameter_load(&parameter);
+  scpi_reply();
+  printf("NEO XU,AD5791 VOLTAGE SOURCE,%08X,%02X.%02X", *(const uint32_t *)SCPI_UID_ADDR,
+         (parameter.hw_info>>16)&0xff, (parameter.hw_info>>8)&0xff);
+  return 0;
+}
+
+/**
+ * @brief stop sample engines and set all channels to 0V.
+*/
+static int32_t scpi_rst(scpi_cmd_def *cmd){
+  if(timer_sample_owner() != 0)
+    timer_sample_stop();
+  for(uint32_t ch=0; ch<AD5791_DEV_NUM; ch++)
+    voltref_set_nv(ad5791_get_dev(ch), 0);
+  return 0;
+}
+
+static int32_t scpi_cls(scpi_cmd_def *cmd){
+  err_rd = err_wr;
+  return 0;
+}
+
+static int32_t scpi_opc_set(scpi_cmd_def *cmd){
+  return 0; //no status registers, nothing to set.
+}
+
+/**
+ * @brief wait for ramp and frames in flight. Wave engines run until stopped,
+ * they are not pending operations. A ramp can take hours, so it's not waited
+ * here, scpi_poll runs the rest of the line when it's done.
+ * @return 0 if done, SCPI_WAIT if ramp is running.
+*/
+static int32_t scpi_wai(scpi_cmd_def *cmd){
+#if VOLTREF_USE_RAMP
+  if(ramp_is_running()){
+    wait_on = 1;
+    wait_reply = 0;
+    return SCPI_WAIT;
+  }
+#endif
+  ad5791_flush();
+  return 0;
+}
+
+static int32_t scpi_opc_query(scpi_cmd_def *cmd){
+  if(scpi_wai(cmd) == SCPI_WAIT){
+    wait_reply = 1;
+    return SCPI_WAIT;
+  }
+  scpi_reply();
+  printf("1");
+  return 0;
+}
+
+static int32_t scpi_tst(scpi_cmd_def *cmd){
+  scpi_reply();
+  printf("0");
+  return 0;
+}
+
+/**
+ * @brief run one command of a line, header is hashed while it's parsed.
+ * @return 0 if ok, else SCPI error.
+*/
+static int32_t scpi_command(char *s){
+  const scpi_node_def *table = base, *node = 0;
+  scpi_cmd_def cmd;
+  scpi_func func;
+  uint32_t hash, suffix, query, len;
+  char *start;
+  cmd.ch = base_ch;
+  cmd.arg = 0;
+  while(*s == ' ' || *s == '\t') s++;
+  if(*s == 0) return 0;   //nothing between ';'.
+  if(*s == '*')
+    table = scpi_common;
+  else if(*s == ':'){
+    table = scpi_root;
+    cmd.ch = 0;
+    s++;
+  }
+  while(1){
+    hash = SCPI_FNV_BASIS;
+    start = s;
+    if(*s == '*')
+      hash = SCPI_FNV(hash, *s++);
+    for(; scpi_is_alpha(*s); s++)
+      hash = SCPI_FNV(hash, scpi_upper(*s));
+    if(s == start) return SCPI_ERR_SYNTAX;
+    node = scpi_find(table, hash);
+    if(node == 0) return SCPI_ERR_HEADER;
+    if(scpi_is_digit(*s)){
+      for(suffix=0; scpi_is_digit(*s) && suffix < 100; s++)
+        suffix = suffix*10 + *s - '0';
+      if(suffix == 0 || suffix > AD5791_DEV_NUM) return SCPI_ERR_SUFFIX;
+      cmd.ch = suffix - 1;
+    }
+    if(*s != ':') break;
+    if(node->child == 0) return SCPI_ERR_HEADER;
+    table = node->child;
+    s++;
+  }
+  query = *s == '?';
+  if(query) s++;
+  if(*s != 0 && *s != ' ' && *s != '\t') return SCPI_ERR_SYNTAX;
+  while(*s == ' ' || *s == '\t') s++;
+  for(len = strlen(s); len && (s[len-1] == ' ' || s[len-1] == '\t'); len--)
+    s[len-1] = 0;
+  if(*s) cmd.arg = s;
+  func = query ? node->query : node->set;
+  if(func == 0) return SCPI_ERR_HEADER;
+  if(query && cmd.arg) return SCPI_ERR_NOT_ALLOWED;
+  if(table != scpi_common){
+    base = table;
+    base_ch = cmd.ch;
+  }
+  return func(&cmd);
+}
+
+/**
+ * @brief run commands from s to end of line, they are separated by ';'. It
+ * stops at a command that waits, the rest is kept in wait_rest.
+ * @return none.
+*/
+static void scpi_run(char *s){
+  char *next;
+  int32_t err;
+  while(s){
+    next = strchr(s, ';');
+    if(next) *next++ = 0;
+    err = scpi_command(s);
+    if(err == SCPI_WAIT){
+      if(next)
+        memmove(wait_rest, next, strlen(next) + 1); //next may be in wait_rest.
+      else
+        wait_rest[0] = 0;
+      return;
+    }
+    if(err) scpi_error(err);
+    s = next;
+  }
+  if(replied)
+    printf("\n");
+}
+
+/**
+ * @brief run a line. A command starting with ':' or a new line goes back to
+ * root. A line while *WAI or *OPC? waits drops the rest of the waiting line.
+ * @return none.
+*/
+static void scpi_execute(char *s){
+  if(wait_on){
+    wait_on = 0;
+    if(replied)
+      printf("\n");
+    scpi_error(SCPI_ERR_INTERRUPTED);
+  }
+  base = scpi_root;
+  base_ch = 0;
+  replied = 0;
+  scpi_run(s);
+}
+
+/**
+ * @brief finish *WAI or *OPC? when ramp is done, called from main loop.
+ * @return none.
+*/
+void scpi_poll(void){
+#if VOLTREF_USE_RAMP
+  if(!wait_on || ramp_is_running()) return;
+#else
+  if(!wait_on) return;
+#endif
+  wait_on = 0;
+  ad5791_flush();
+  if(wait_reply){
+    scpi_reply();
+    printf("1");
+  }
+  scpi_run(wait_rest);
+}
+
+/**
+ * @brief check if a word matches name in long or short form.
+*/
+static int32_t scpi_match(const char *name, const char *s, uint32_t len){
+  uint32_t i;
+  for(i=0; i<len && name[i]; i++){
+    if(scpi_upper(name[i]) != scpi_upper(s[i])) return 0;
+  }
+  if(i < len) return 0;
+  return name[i] == 0 || (name[i] >= 'a' && name[i] <= 'z' && (i == 0 || !(name[i-1] >= 'a' && name[i-1] <= 'z')));
+}
+
+/**
+ * @brief decide where a line goes from its first bytes.
+ * @return SCPI_ROUTE_xx, SCPI_ROUTE_UNKNOWN if more bytes are needed.
+*/
+static uint32_t scpi_classify(const char *s, uint32_t len){
+  char c = s[len-1];
+  const scpi_node_def *root;
+  if(len == 1 && (c == '*' || c == ':'))
+    return SCPI_ROUTE_SCPI;
+  if(scpi_is_alpha(c)){
+    for(root = scpi_root; root->name; root++){
+      uint32_t i;
+      for(i=0; i<len && root->name[i] && scpi_upper(root->name[i]) == scpi_upper(s[i]); i++);
+      if(i == len) return SCPI_ROUTE_UNKNOWN;
+    }
+    return SCPI_ROUTE_SHELL;
+  }
+  if(len == 1 || !(c == ':' || c == ' ' || c == '?' || c == ';' || c == '\r' || c == '\n' || scpi_is_digit(c)))
+    return SCPI_ROUTE_SHELL;
+  for(root = scpi_root; root->name; root++){
+    if(scpi_match(root->name, s, len-1))
+      return SCPI_ROUTE_SCPI;
+  }
+  return SCPI_ROUTE_SHELL;
+}
+
+/**
+ * @brief take text from UART, it has at most one line end and only as the
+ * last byte. First word of a line is held until it's clear whether the line
+ * is SCPI, lines that aren't go to shell.
+ * @return none.
+*/
+void scpi_input(const char *pdata, uint32_t len, scpi_shell_func shell){
+  uint32_t i = 0;
+  char end;
+  if(len == 0) return;
+  if(scpi_off){
+    shell(pdata, len);
+    return;
+  }
+  end = pdata[len-1];
+  if(skip_lf && line_len == 0 && pdata[0] == '\n'){
+    skip_lf = 0;
+    pdata++;
+    if(--len == 0) return;
+  }
+  skip_lf = 0;
+  if(line_route == SCPI_ROUTE_UNKNOWN){
+    while(i < len && line_route == SCPI_ROUTE_UNKNOWN){
+      line[line_len++] = pdata[i++];
+      line_route = scpi_classify(line, line_len);
+    }
+    if(line_route == SCPI_ROUTE_SHELL){
+      scpi_active = 0;
+      shell(line, line_len);
+    }
+    else if(line_route == SCPI_ROUTE_UNKNOWN)
+      return;
+  }
+  if(line_route == SCPI_ROUTE_SHELL){
+    if(i < len)
+      shell(&pdata[i], len - i);
+  }
+  else{
+    for(; i<len; i++){
+      if(line_len < SCPI_LINE_MAX) line[line_len++] = pdata[i];
+      else line_overflow = 1;
+    }
+  }
+  if(end != '\n' && end != '\r') return;
+  if(line_route == SCPI_ROUTE_SCPI){
+    scpi_active = 1;
+    skip_lf = end == '\r';
+    if(line_overflow){
+      line[0] = 0;
+      scpi_execute(line);   //it's still a new line for a waiting command.
+      scpi_error(SCPI_ERR_TOO_MUCH);
+    }
+    else{
+      line[line_len-1] = 0;
+      scpi_execute(line);
+    }
+  }
+  line_route = SCPI_ROUTE_UNKNOWN;
+  line_len = 0;
+  line_overflow = 0;
+}
+
+/**
+ * @brief check if host speaks SCPI, shell notices would break its replies.
+ * @return 1 if last line was SCPI.
+*/
+int32_t scpi_is_active(void){
+  return scpi_active;
+}
+#endif
@@ -0,0 +1,39 @@
+/**
+ * @author Neo Xu (neo.xu1990@gmail.com)
+ * @license The MIT License (MIT)
+ * 
+ * Copyright (c) 2019 Neo Xu
+ * 
+ * @brief SCPI subset on UART1, shares the port with shell.
+ *
+ * A line goes to SCPI if it starts with '*' or ':', or its first word is a
+ * root keyword below, long or short form. Other lines go to shell.
+ *   [SOURce[n]:]VOLTage[:LEVel] <volt>[V|MV|UV|NV]   VOLTage?   n is channel+1
+ *   [SOURce[n]:]VOLTage:CODE <code>                  VOLTage:CODE?
+ *   MEASure[n]:VOLTage?                              output now, it may be ramping
+ *   MEASure:TEMPerature?
+ *   OUTPut[:STATe] ON|OFF|1|0                        OUTPut?, OFF is safe state
+ *   SYSTem:ERRor[:NEXT]?   SYSTem:VERSion?
+ *   *IDN?  *RST  *CLS  *OPC  *OPC?  *WAI  *TST?
+ * Commands are chained with ';', replies of one line are joined with ';'.
+ * *WAI and *OPC? wait for a running ramp without blocking, commands after
+ * them in the line run when it's done. A new SCPI line before that drops
+ * them and queues error -410.
+ * Voltage is replied as volts with 9 decimals, temperature with 3.
+*/
+#ifndef _SCPI_H_
+#define _SCPI_H_
+#include "stdint.h"
+#include "voltref_conf.h"
+
+#define SCPI_LINE_MAX     80
+#define SCPI_ERROR_QUEUE  4
+
+typedef void (*scpi_shell_func)(const char *pdata, uint32_t len);
+
+int32_t scpi_init(void);
+void scpi_input(const char *pdata, uint32_t len, scpi_shell_func shell);
+void scpi_poll(void);
+int32_t scpi_is_active(void);
+
+#endif
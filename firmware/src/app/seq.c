@@ -0,0 +1,340 @@
+/**
+ * @author Neo Xu (neo.xu1990@gmail.com)
+ * @license The MIT License (MIT)
+ * 
+ * Copyright (c) 2019 Neo Xu
+ * 
+ * @brief list mode sequencer, steps through (code, dwell) entries.
+ * Entries are packed as dwell(12bit)|code(20bit) in the wave buffer, the
+ * sequence stops if wave takes the buffer back. Steps
+ * come from sample clock or an EXTI trigger on PA0. With LDAC wired, the
+ * next code is preloaded and a trigger only pulses LDAC, so trigger to
+ * output latency is interrupt entry plus a few cycles. Bit-bang SDO readback
+ * reads PA0, trigger stepping is left out then and only timer stepping is there.
+*/
+#include "seq.h"
+#include "wave.h"
+#include "ad5791.h"
+#include "timer.h"
+#include "exti.h"
+#include "cmdarg.h"
+#include "string.h"
+#include "printf.h"
+#include "ush.h"
+
+#if VOLTREF_USE_SEQ
+#define SEQ_TRIG_LINE     0   //PA0
+
+#if AD5791_USE_SDO && AD5791_TRANSPORT == AD5791_TRANSPORT_BITBANG
+#define SEQ_USE_TRIGGER   0   //PA0 is AD5791 SDO.
+#else
+#define SEQ_USE_TRIGGER   1
+#endif
+
+#define SEQ_ENTRY(code, dwell)  (((uint32_t)(dwell)<<20)|((code)&0xfffff))
+#define SEQ_CODE(entry)         ((entry)&0xfffff)
+#define SEQ_DWELL(entry)        ((entry)>>20)
+
+static uint32_t *seq_table = 0;
+static uint32_t seq_len = 0;
+static volatile uint32_t seq_pos = 0;       //next entry.
+static volatile uint32_t seq_dwell = 0;     //ticks left on current entry.
+static volatile uint32_t seq_steps = 0;     //entries output since start.
+static uint8_t seq_loop = 0;
+static seq_step_def seq_step = seq_step_timer;
+static volatile uint8_t seq_trig_on = 0;
+static volatile uint8_t seq_done = 0;
+static uint32_t seq_period = 0;             //tick period in sample clocks.
+#if SEQ_USE_TRIGGER
+static uint32_t lat_min, lat_max, lat_last; //trigger handler entry to latch done, in cycles.
+#endif
+
+/**
+ * @brief index of entry after pos, wraps in loop mode.
+ * @return index, seq_len if sequence is over.
+*/
+static uint32_t seq_next(uint32_t pos){
+  if(++pos >= seq_len)
+    pos = seq_loop ? 0 : seq_len;
+  return pos;
+}
+
+/**
+ * @brief timer tick, called from sample clock interrupt.
+ * @return none.
+*/
+static void seq_tick(void){
+  uint32_t entry;
+  if(seq_dwell && --seq_dwell) return;
+  if(seq_pos >= seq_len || !wave_buffer_owned(&seq_table)){
+    timer_sample_stop();
+    seq_done = 1;
+    return;
+  }
+  entry = seq_table[seq_pos];
+  ad5791_write_data(SEQ_CODE(entry));
+  seq_dwell = SEQ_DWELL(entry) ? SEQ_DWELL(entry) : 1;
+  seq_pos = seq_next(seq_pos);
+  seq_steps++;
+}
+
+/**
+ * @brief stop trigger input and release LDAC.
+ * @return none.
+*/
+static void seq_trig_off(void){
+#if SEQ_USE_TRIGGER
+  exti_disable(SEQ_TRIG_LINE);
+#endif
+  if(seq_trig_on){
+    seq_trig_on = 0;
+    ad5791_ldac_hold(0);
+  }
+}
+
+/**
+ * @brief trigger edge, latch current entry then prepare the next one.
+ * The code is already in DAC when LDAC is wired, else the frame is sent here.
+*/
+#if SEQ_USE_TRIGGER
+static void seq_trigger(void){
+  uint32_t cycles;
+  if(!seq_trig_on) return;
+#if AD5791_USE_LDAC
+  ad5791_ldac_pulse();
+#else
+  ad5791_write_data(SEQ_CODE(seq_table[seq_pos]));
+  ad5791_flush();   //output updates when frame ends.
+#endif
+  cycles = timer_cycle_elapsed(exti_entry_cycle());
+  lat_last = cycles;
+  if(cycles < lat_min) lat_min = cycles;
+  if(cycles > lat_max) lat_max = cycles;
+  seq_steps++;
+  seq_pos = seq_next(seq_pos);
+  if(seq_pos >= seq_len || !wave_buffer_owned(&seq_table)){
+    seq_trig_off();
+    seq_done = 1;
+    return;
+  }
+#if AD5791_USE_LDAC
+  ad5791_write_data(SEQ_CODE(seq_table[seq_pos]));  //preload, LDAC is high.
+#endif
+}
+#endif
+
+/**
+ * @brief write one entry, table length grows to cover index. It takes the
+ * shared wave buffer, wave data is dropped.
+ * @return 0 if ok, -1 if index is out of table.
+*/
+int32_t seq_write(uint32_t index, uint32_t code, uint32_t dwell){
+  if(index >= WAVE_BUFF_SIZE) return -1;
+  if(seq_table == 0 || !wave_buffer_owned(&seq_table)){
+    seq_table = wave_buffer_take(&seq_table);
+    seq_len = 0;
+  }
+  if(dwell > SEQ_DWELL_MAX) dwell = SEQ_DWELL_MAX;
+  seq_table[index] = SEQ_ENTRY(code, dwell);
+  if(index >= seq_len)
+    seq_len = index + 1;
+  return 0;
+}
+
+/**
+ * @brief stop and empty the table.
+ * @return none.
+*/
+void seq_clear(void){
+  seq_stop();
+  seq_len = 0;
+}
+
+/**
+ * @brief start from first entry.
+ * @param tick_hz: dwell tick rate in timer mode.
+ * @param loop: restart from first entry at the end.
+ * @return 0 if ok, -1 if table is empty, sample clock is busy or trigger is
+ * not built in.
+*/
+int32_t seq_start(seq_step_def step, uint32_t tick_hz, uint32_t loop){
+  if(seq_len == 0 || !wave_buffer_owned(&seq_table)) return -1;
+  seq_stop();
+  seq_loop = loop != 0;
+  seq_step = step;
+  seq_pos = 0;
+  seq_dwell = 0;
+  seq_steps = 0;
+  seq_done = 0;
+  if(step == seq_step_timer){
+    seq_period = timer_sample_start(tick_hz, seq_tick);
+    return seq_period ? 0 : -1;
+  }
+#if SEQ_USE_TRIGGER
+  if(timer_sample_owner() != 0) return -1;  //an engine is writing DAC.
+  lat_min = 0xffffffff;
+  lat_max = 0;
+  lat_last = 0;
+  if(ad5791_ldac_hold(1) == 0)
+    ad5791_write_data(SEQ_CODE(seq_table[0]));  //preload first entry.
+  seq_trig_on = 1;
+  exti_enable(SEQ_TRIG_LINE, 1, seq_trigger);
+  return 0;
+#else
+  return -1;
+#endif
+}
+
+/**
+ * @brief stop, output holds the last entry.
+ * @return none.
+*/
+void seq_stop(void){
+  if(seq_is_running() && seq_step == seq_step_timer)
+    timer_sample_stop();
+  seq_trig_off();
+}
+
+int32_t seq_is_running(void){
+  return timer_sample_owner() == seq_tick || seq_trig_on;
+}
+
+/**
+ * @brief check if a sequence is finished since last call.
+ * @return 1 once when it's done, else 0.
+*/
+int32_t seq_poll(void){
+  if(seq_done == 0) return 0;
+  seq_done = 0;
+  return 1;
+}
+
+/**
+ * @brief load entries: seqset index code[:dwell] [code[:dwell] ...]
+ * Many entries fit in one line, so a table loads in a few round trips.
+*/
+static int32_t ush_seq_set(uint32_t argc, char **argv){
+  uint32_t index, code, dwell;
+  char *sep;
+  if(argc < 3 || cmdarg_uint(argv[1], &index) != 0){
+    USH_Print("usage: seqset index code[:dwell] ...\n");
+    return -1;
+  }
+  for(uint32_t i=2; i<argc; i++){
+    dwell = 1;
+    sep = strchr(argv[i], ':');
+    if(sep){
+      *sep++ = 0;
+      if(cmdarg_uint(sep, &dwell) != 0 || dwell > SEQ_DWELL_MAX){
+        USH_Print("dwell %s should be 0 to %d\n", sep, SEQ_DWELL_MAX);
+        return -1;
+      }
+    }
+    if(cmdarg_uint(argv[i], &code) != 0 || code > 0xfffff){
+      USH_Print("code %s is not valid\n", argv[i]);
+      return -1;
+    }
+    if(seq_write(index++, code, dwell) != 0){
+      USH_Print("table is full(%d entries)\n", WAVE_BUFF_SIZE);
+      return -1;
+    }
+  }
+  USH_Print("sequence length: %d\n", seq_len);
+  return 0;
+}
+USH_REGISTER(ush_seq_set, seqset, Load sequence: seqset index code[:dwell] ...);
+
+/**
+ * @brief generate a staircase: seqgen index count start step [dwell]
+*/
+static int32_t ush_seq_gen(uint32_t argc, char **argv){
+  uint32_t index, count, dwell = 1;
+  int32_t start, step;
+  if(argc < 5 || cmdarg_uint(argv[1], &index) != 0 || cmdarg_uint(argv[2], &count) != 0 ||
+     cmdarg_int(argv[3], &start) != 0 || cmdarg_int(argv[4], &step) != 0 ||
+     (argc >= 6 && cmdarg_uint(argv[5], &dwell) != 0)){
+    USH_Print("usage: seqgen index count start step [dwell]\n");
+    return -1;
+  }
+  for(uint32_t i=0; i<count; i++){
+    int32_t code = start + step*(int32_t)i;
+    if(code < 0) code = 0;
+    if(code > 0xfffff) code = 0xfffff;
+    if(seq_write(index + i, code, dwell) != 0){
+      USH_Print("table is full(%d entries)\n", WAVE_BUFF_SIZE);
+      return -1;
+    }
+  }
+  USH_Print("sequence length: %d\n", seq_len);
+  return 0;
+}
+USH_REGISTER(ush_seq_gen, seqgen, Generate staircase: seqgen index count start step [dwell]);
+
+static int32_t ush_seq_clear(uint32_t argc, char **argv){
+  seq_clear();
+  return 0;
+}
+USH_REGISTER(ush_seq_clear, seqclr, Stop and clear sequence);
+
+/**
+ * @brief seqstart timer tick_hz [loop] | seqstart trig [loop]
+*/
+static int32_t ush_seq_start(uint32_t argc, char **argv){
+  uint32_t tick_hz = 0, loop = 0, arg = 2;
+  seq_step_def step;
+  if(argc < 2) goto usage;
+  if(strcmp(argv[1], "timer") == 0){
+    step = seq_step_timer;
+    if(argc < 3 || cmdarg_uint(argv[2], &tick_hz) != 0) goto usage;
+    arg = 3;
+  }
+#if SEQ_USE_TRIGGER
+  else if(strcmp(argv[1], "trig") == 0)
+    step = seq_step_trigger;
+#endif
+  else
+    goto usage;
+  if(argc > arg){
+    if(strcmp(argv[arg], "loop") != 0) goto usage;
+    loop = 1;
+  }
+  if(seq_start(step, tick_hz, loop) != 0){
+    USH_Print("sequence is empty, tick rate is not 1 to %dHz or sample clock is busy\n",
+              TIMER_SAMPLE_RATE_MAX);
+    return -1;
+  }
+  return 0;
+usage:
+  USH_Print("usage: seqstart timer tick_hz [loop] | seqstart trig [loop]\n");
+  return -1;
+}
+USH_REGISTER(ush_seq_start, seqstart, Start sequence: seqstart timer tick_hz [loop] | trig [loop]);
+
+static int32_t ush_seq_stop(uint32_t argc, char **argv){
+  seq_stop();
+  return 0;
+}
+USH_REGISTER(ush_seq_stop, seqstop, Stop sequence);
+
+static int32_t ush_seq_stat(uint32_t argc, char **argv){
+  uint32_t late, missed;
+  USH_Print("%s, %s step, length %d, next %d, steps %u\n", seq_is_running() ? "running" : "stopped",
+            seq_step == seq_step_timer ? "timer" : "trigger", seq_len, seq_pos, seq_steps);
+  if(seq_step == seq_step_timer){
+    if(seq_period)
+      USH_Print("tick: %fHz\n", (float)TIMER_SAMPLE_CLOCK/seq_period);
+    timer_sample_stat(&late, &missed);
+    USH_Print("late: %u, missed: %u\n", late, missed);
+  }
+#if SEQ_USE_TRIGGER
+  else if(lat_max){
+    //interrupt entry before the handler can't be measured here, it's not included.
+    USH_Print("handler entry to latch(cycles): min %u, max %u, last %u\n",
+              lat_min, lat_max, lat_last);
+    USH_Print("handler entry to latch(ns): %u to %u\n", timer_cycle2ns(lat_min), timer_cycle2ns(lat_max));
+  }
+#endif
+  return 0;
+}
+USH_REGISTER(ush_seq_stat, seqstat, Show sequence status and trigger latency);
+#endif
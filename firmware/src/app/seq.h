@@ -0,0 +1,28 @@
+/**
+ * @author Neo Xu (neo.xu1990@gmail.com)
+ * @license The MIT License (MIT)
+ * 
+ * Copyright (c) 2019 Neo Xu
+ * 
+ * @brief list mode sequencer, steps through (code, dwell) entries.
+*/
+#ifndef _SEQ_H_
+#define _SEQ_H_
+#include "stdint.h"
+#include "voltref_conf.h"
+
+#define SEQ_DWELL_MAX 0xfff   //dwell is 12bit, in timer ticks.
+
+typedef enum{
+  seq_step_timer = 0,   /**< next entry after dwell ticks of sample clock. */
+  seq_step_trigger,     /**< next entry on every rising edge of trigger input. */
+}seq_step_def;
+
+int32_t seq_write(uint32_t index, uint32_t code, uint32_t dwell);
+void seq_clear(void);
+int32_t seq_start(seq_step_def step, uint32_t tick_hz, uint32_t loop);
+void seq_stop(void);
+int32_t seq_is_running(void);
+int32_t seq_poll(void);
+
+#endif
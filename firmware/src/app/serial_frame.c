@@ -42,7 +42,11 @@ int32_t sframe_decode(sframe_def *psframe, uint8_t *pinput, uint32_t len){
         break;
       case sframe_state_framelen:  //frame length
         psframe->frame_len = *pinput;
-        psframe->state = sframe_state_payload;
+        psframe->windex = 0;
+        if(psframe->frame_len == 0 || psframe->frame_len > psframe->buffsz)
+          psframe->state = sframe_state_start;  //it won't fit, drop it.
+        else
+          psframe->state = sframe_state_payload;
         break;
       case sframe_state_payload:
         if(*pinput == SFRAME_ESCAPE)
@@ -64,9 +68,10 @@ int32_t sframe_decode(sframe_def *psframe, uint8_t *pinput, uint32_t len){
         if(*pinput == SFRAME_STOP){
           if(psframe->callback)
             psframe->callback(psframe->pbuff, psframe->frame_len);
-          psframe->state = sframe_state_start;
-          psframe->windex = 0;
         }
+        //anything else means length was wrong, drop the frame.
+        psframe->state = sframe_state_start;
+        psframe->windex = 0;
         break;
       default:
       break;
@@ -0,0 +1,152 @@
+/**
+ * @author Neo Xu (neo.xu1990@gmail.com)
+ * @license The MIT License (MIT)
+ * 
+ * Copyright (c) 2019 Neo Xu
+ * 
+ * @brief stream codes from host to DAC at a fixed sample clock.
+ * Codes go into a ring in the shared wave buffer, sample clock interrupt pops
+ * one per tick. Output starts once the ring is half full and starts over that
+ * way after an underrun, so one half is played while host refills the other.
+ * Crossing the watermarks raises events, host uses them for flow control.
+*/
+#include "stream.h"
+#include "ad5791.h"
+#include "timer.h"
+#include "string.h"
+#include "printf.h"
+#include "ush.h"
+
+#if VOLTREF_USE_STREAM
+static uint32_t *ring = 0;
+static volatile uint32_t ring_rd = 0, ring_wr = 0;  //free running, index is masked.
+static volatile uint8_t primed = 0;   //prefilled, output is running.
+static volatile uint8_t evt_low = 0, evt_high = 0;
+static uint8_t above_high = 0;
+static stream_stat_def stream_stat;
+static uint32_t stream_period = 0;
+
+/**
+ * @brief output one code, called from sample clock interrupt.
+ * @return none.
+*/
+static void stream_sample(void){
+  uint32_t rd = ring_rd, level = ring_wr - rd;
+  if(!wave_buffer_owned(&ring)){ //wave took buffer back.
+    timer_sample_stop();
+    return;
+  }
+  if(!primed){
+    if(level < STREAM_PREFILL) return;
+    primed = 1;
+  }
+  if(level == 0){
+    stream_stat.underrun++;
+    primed = 0;   //output holds, wait for prefill again.
+    return;
+  }
+  ad5791_write_data(ring[rd%STREAM_RING_SIZE]);
+  ring_rd = rd + 1;
+  stream_stat.played++;
+  if(level - 1 == STREAM_LOW_MARK)
+    evt_low = 1;
+}
+
+/**
+ * @brief start output, ring is emptied.
+ * @return the real sample period in 64MHz clocks, 0 if failed.
+*/
+uint32_t stream_start(uint32_t rate_hz){
+  stream_stop();
+  ring = wave_buffer_take(&ring);
+  ring_rd = 0;
+  ring_wr = 0;
+  primed = 0;
+  evt_low = 0;
+  evt_high = 0;
+  above_high = 0;
+  memset(&stream_stat, 0, sizeof(stream_stat));
+  stream_period = timer_sample_start(rate_hz, stream_sample);
+  return stream_period;
+}
+
+/**
+ * @brief stop, output holds the last code.
+ * @return none.
+*/
+void stream_stop(void){
+  if(stream_is_running())
+    timer_sample_stop();
+}
+
+int32_t stream_is_running(void){
+  return timer_sample_owner() == stream_sample;
+}
+
+/**
+ * @brief add one code to ring, called from main loop only.
+ * @return 1 if it's added, 0 if ring is full or stream is not started.
+*/
+uint32_t stream_push(uint32_t code){
+  uint32_t wr = ring_wr, level = wr - ring_rd;
+  if(!stream_is_running() || level >= STREAM_RING_SIZE){
+    stream_stat.overrun++;
+    return 0;
+  }
+  ring[wr%STREAM_RING_SIZE] = code&0xfffff;
+  ring_wr = wr + 1;
+  level++;
+  if(level >= STREAM_HIGH_MARK && !above_high){
+    above_high = 1;
+    evt_high = 1;
+  }
+  return 1;
+}
+
+/**
+ * @brief get a watermark event, low mark wins if both happened.
+ * @return event, stream_evt_none if nothing happened.
+*/
+stream_evt_def stream_poll(void){
+  if(evt_low){
+    evt_low = 0;
+    evt_high = 0;
+    above_high = 0;
+    return stream_evt_low;
+  }
+  if(evt_high){
+    evt_high = 0;
+    return stream_evt_high;
+  }
+  return stream_evt_none;
+}
+
+void stream_get_stat(stream_stat_def *stat){
+  *stat = stream_stat;
+  stat->level = ring_wr - ring_rd;
+}
+
+static int32_t ush_stream_stat(uint32_t argc, char **argv){
+  stream_stat_def stat;
+  uint32_t late, missed;
+  stream_get_stat(&stat);
+  USH_Print("stream %s, %s\n", stream_is_running() ? "running" : "stopped",
+            primed ? "playing" : "filling");
+  if(stream_period)
+    USH_Print("rate: %fHz\n", (float)TIMER_SAMPLE_CLOCK/stream_period);
+  USH_Print("level: %u/%d, played: %u, underrun: %u, overrun: %u\n", stat.level,
+            STREAM_RING_SIZE, stat.played, stat.underrun, stat.overrun);
+  if(stream_is_running()){
+    timer_sample_stat(&late, &missed);
+    USH_Print("late: %u, missed: %u\n", late, missed);
+  }
+  return 0;
+}
+USH_REGISTER(ush_stream_stat, streamstat, Show code streaming status);
+
+static int32_t ush_stream_stop(uint32_t argc, char **argv){
+  stream_stop();
+  return 0;
+}
+USH_REGISTER(ush_stream_stop, streamstop, Stop code streaming);
+#endif
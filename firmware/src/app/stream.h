@@ -0,0 +1,40 @@
+/**
+ * @author Neo Xu (neo.xu1990@gmail.com)
+ * @license The MIT License (MIT)
+ * 
+ * Copyright (c) 2019 Neo Xu
+ * 
+ * @brief stream codes from host to DAC at a fixed sample clock.
+*/
+#ifndef _STREAM_H_
+#define _STREAM_H_
+#include "stdint.h"
+#include "voltref_conf.h"
+#include "wave.h"
+
+#define STREAM_RING_SIZE  WAVE_BUFF_SIZE        //codes, ring lives in wave buffer.
+#define STREAM_LOW_MARK   (STREAM_RING_SIZE/4)  //tell host to send more.
+#define STREAM_HIGH_MARK  (STREAM_RING_SIZE*3/4)//tell host to pause.
+#define STREAM_PREFILL    (STREAM_RING_SIZE/2)  //output starts when ring is half full.
+
+typedef enum{
+  stream_evt_none = 0,
+  stream_evt_low,   /**< level went down to low mark. */
+  stream_evt_high,  /**< level went up to high mark. */
+}stream_evt_def;
+
+typedef struct{
+  uint32_t level;     /**< codes in ring now. */
+  uint32_t played;    /**< codes output since start. */
+  uint32_t underrun;  /**< sample ticks with empty ring. */
+  uint32_t overrun;   /**< codes dropped because ring was full. */
+}stream_stat_def;
+
+uint32_t stream_start(uint32_t rate_hz);
+void stream_stop(void);
+int32_t stream_is_running(void);
+uint32_t stream_push(uint32_t code);
+stream_evt_def stream_poll(void);
+void stream_get_stat(stream_stat_def *stat);
+
+#endif
@@ -1,30 +1,158 @@
 #include "string.h"
-#include "fifo.h"
 #include "serial_frame.h"
 #include "ush.h"
 #include "ad5791.h"
 #include "uart.h"
 #include "printf.h"
 #include "hmi.h"
+#include "cmdarg.h"
+#include "lincal.h"
+#include "ramp.h"
+#include "seq.h"
+#include "sched.h"
+#include "safe.h"
+#include "remote.h"
+#include "scpi.h"
+#include "parameter.h"
+#include "timer.h"
 
-fifo_t uartrx_fifo;
 ush_def ush;
 
+#define VOLTREF_BAUD_DEFAULT  115200
+
+#ifndef VOLTREF_USE_BENCH
+#define VOLTREF_USE_BENCH     0       //rxbench, left out by default to save flash.
+#endif
+#define VOLTREF_BENCH_SPAN_MS 200     //cycle counter wraps every 262ms, longer spans aren't timed.
+
 static float curr_volt = 0; //current voltage setting.
-static void _uart_rx_callback(uint8_t ch){
-  fifo_push(&uartrx_fifo, &ch);
+
+#if VOLTREF_USE_BENCH
+/**
+ * Counters of UART input path, for rxbench.
+*/
+static struct{
+  uint32_t bytes;   //bytes routed.
+  uint32_t calls;   //ush_process_input calls.
+  uint64_t cycles;  //time spent routing, commands run included.
+  uint32_t timed;   //bytes of spans in cycles.
+  uint32_t long_spans;  //spans over VOLTREF_BENCH_SPAN_MS, not in cycles.
+  uint32_t start_ms;
+}rx_bench;
+#endif
+
+/**
+ * @brief start host link with settings in parameter.
+ * @return none.
+*/
+static void voltref_link_init(void){
+  struct _parameter parameter;
+  uint32_t baud;
+  parameter_load(&parameter);
+  baud = uart_baud_rate((parameter.hw_info&HW_INFO_BAUD_MASK) - 1);
+  uart_init(baud ? baud : VOLTREF_BAUD_DEFAULT);
+  if(parameter.hw_info&HW_INFO_AUTOBAUD)
+    uart_autobaud(1);
+}
+
+/**
+ * @brief store baudrate and autobaud setting, flash is only written if they changed.
+ * @return none.
+*/
+static void voltref_link_save(uint32_t baud, uint32_t autobaud){
+  struct _parameter parameter;
+  int32_t index = uart_baud_index(baud);
+  parameter_load(&parameter);
+  parameter.hw_info &= ~(HW_INFO_BAUD_MASK|HW_INFO_AUTOBAUD);
+  if(index >= 0)
+    parameter.hw_info |= index + 1;
+  if(autobaud)
+    parameter.hw_info |= HW_INFO_AUTOBAUD;
+  parameter_save(&parameter);
+}
+static void voltref_shell(const char *pdata, uint32_t len){
+  ush_process_input(&ush, (char*)pdata, len);
+#if VOLTREF_USE_BENCH
+  rx_bench.calls++;
+#endif
+}
+
+/**
+ * @brief hand text to SCPI, it passes lines that aren't SCPI on to shell.
+ * @return none.
+*/
+static void voltref_text(const uint8_t *pdata, uint32_t len){
+#if VOLTREF_USE_SCPI
+  scpi_input((const char*)pdata, len, voltref_shell);
+#else
+  voltref_shell((const char*)pdata, len);
+#endif
+}
+
+/**
+ * @brief status messages are held back while SCPI owns the port.
+ * @return 1 if they may be printed.
+*/
+static int32_t voltref_may_print(void){
+#if VOLTREF_USE_SCPI
+  return !scpi_is_active();
+#else
+  return 1;
+#endif
+}
+
+/**
+ * @brief route received bytes. Protocol bytes go to remote one by one, the
+ * rest is handed to SCPI or shell a line at a time, or whatever of it is in
+ * span. A frame start has no effect by itself, so text bytes before it are
+ * still handled before the frame.
+ * @return none.
+*/
+static void voltref_input(const uint8_t *pdata, uint32_t len){
+  uint32_t start = 0;
+  for(uint32_t i=0; i<len; i++){
+#if VOLTREF_USE_REMOTE
+    if(remote_input(pdata[i])){
+      if(i > start)
+        voltref_text(&pdata[start], i - start);
+      start = i + 1;
+      continue;
+    }
+#endif
+    if(pdata[i] == '\n' || pdata[i] == '\r'){
+      voltref_text(&pdata[start], i + 1 - start);
+      start = i + 1;
+    }
+  }
+  if(len > start)
+    voltref_text(&pdata[start], len - start);
 }
+
 /**
  * @brief init voltref related (sw/hw)
  * @return none.
 */
 void voltref_init(void){
-	static uint8_t fifobuff[128];
   static char line_buff[128];
-	uart_init(115200, _uart_rx_callback);
-  fifo_init(&uartrx_fifo, fifo_data_8bit, fifobuff, 128);
+  voltref_link_init();
   ush_init(&ush, line_buff, 128);
+#if VOLTREF_USE_REMOTE
+  remote_init();
+#endif
+#if VOLTREF_USE_SCPI
+  if(scpi_init() != 0)
+    USH_Print("scpi: keyword table is wrong, SCPI is off\n");
+#endif
   ad5791_init();
+#if VOLTREF_USE_LINCAL
+  lincal_init();
+#endif
+#if VOLTREF_USE_SCHED
+  sched_init();
+#endif
+#if VOLTREF_USE_SAFE
+  safe_init();
+#endif
   curr_volt = ad5791_set_volt(curr_volt);
 	ad5791_set_code(0xfffff);
 }
@@ -34,12 +162,73 @@ float voltref_get_value(void){
   return curr_volt;
 }
 
-//return current voltage settings.
+//set voltage, it ramps there if slew rate is limited. Return the target.
 float voltref_set_value(float volt){
+#if VOLTREF_USE_RAMP
+  curr_volt = ramp_to_nv(ad5791_volt2nv(volt))*1e-9f;
+#else
   curr_volt = ad5791_set_volt(volt);
+#endif
   return curr_volt;
 }
 
+/**
+ * @brief set code of a channel, display follows channel 0.
+ * @return the real voltage in V.
+*/
+float voltref_set_code(ad5791_dev_def *dev, uint32_t code){
+  float real_volt = ad5791_dev_set_code(dev, code);
+  if(dev->ch == 0){
+    curr_volt = real_volt;
+    hmi_disp_update(curr_volt);
+  }
+  return real_volt;
+}
+
+/**
+ * @brief move channel 0 to code with slew limit, display follows the target.
+ * @return none.
+*/
+void voltref_ramp_code(uint32_t code){
+  ad5791_dev_def *dev = ad5791_get_dev(0);
+#if VOLTREF_USE_RAMP
+  ramp_to_code(code);
+#else
+  ad5791_dev_update(dev, code&0xfffff);
+#endif
+  curr_volt = ad5791_dev_code2nv(dev, code&0xfffff)*1e-9f;
+  hmi_disp_update(curr_volt);
+}
+
+/**
+ * @brief set voltage of a channel in nV, channel 0 moves with slew limit.
+ * @return the real voltage in nV.
+*/
+uint64_t voltref_set_nv(ad5791_dev_def *dev, uint64_t nv){
+  uint32_t code;
+  if(dev->ch == 0){
+    code = ad5791_dev_nv2code(dev, nv);
+    voltref_ramp_code(code);
+    return ad5791_dev_code2nv(dev, code);
+  }
+  return ad5791_dev_set_nv(dev, nv);
+}
+
+/**
+ * @brief get the channel from optional argument, channel 0 if it's not given.
+ * @return the device, or 0 if channel is wrong.
+*/
+static ad5791_dev_def *ush_get_dev(uint32_t argc, char **argv, uint32_t index){
+  uint32_t ch = 0;
+  ad5791_dev_def *dev;
+  if(argc > index && cmdarg_uint(argv[index], &ch) != 0)
+    ch = AD5791_DEV_NUM;
+  dev = ad5791_get_dev(ch);
+  if(dev == 0)
+    USH_Print("channel should be 0 to %d\n", AD5791_DEV_NUM-1);
+  return dev;
+}
+
 /**
  * @brief set the volatage.
 */
@@ -47,9 +236,12 @@ static int32_t ush_set_code(uint32_t argc, char **argv){
   uint32_t code;
   float real_volt;
   ush_num_def numtype;
+  ad5791_dev_def *dev;
   if(argc < 2) return 0;
-  if(*(++argv) == 0) return 0;
-  if(ush_str2num(*argv, strlen(*argv), &numtype, &code) != ush_error_ok){
+  if(argv[1] == 0) return 0;
+  dev = ush_get_dev(argc, argv, 2);
+  if(dev == 0) return -1;
+  if(ush_str2num(argv[1], strlen(argv[1]), &numtype, &code) != ush_error_ok){
     USH_Print("input string is not illegal\n");
     return -1;
   }
@@ -58,50 +250,201 @@ static int32_t ush_set_code(uint32_t argc, char **argv){
       code = *(int32_t*)&code;
     else if(numtype == ush_num_uint32)
       code = *(uint32_t*)&code;
-    USH_Print("set DAC code to:0x%x\n", code);
-    real_volt = ad5791_set_code(code);
+    USH_Print("set DAC%d code to:0x%x\n", dev->ch, code);
+    real_volt = voltref_set_code(dev, code);
     USH_Print("Real output voltage is:%f\n", real_volt);
   }
-  curr_volt = real_volt;
-  hmi_disp_update(curr_volt);
   return 0;
 }
-USH_REGISTER(ush_set_code, setcode, Set the DAC code directly: 0 to 0xfffff);
+USH_REGISTER(ush_set_code, setcode, Set the DAC code directly: setcode 0 to 0xfffff [channel]);
 
 /**
  * @brief set the volatage.
 */
 static int32_t ush_set_volt(uint32_t argc, char **argv){
-  float volt;
-  float real_volt;
-  ush_num_def numtype;
+  uint64_t nv, real_nv;
+  ad5791_dev_def *dev;
   if(argc < 2) return 0;
-  if(*(++argv) == 0) return 0;
-  if(ush_str2num(*argv, strlen(*argv), &numtype, &volt) != ush_error_ok){
+  if(argv[1] == 0) return 0;
+  dev = ush_get_dev(argc, argv, 2);
+  if(dev == 0) return -1;
+  if(cmdarg_volt_nv(argv[1], &nv) != 0){
     USH_Print("input string is not illegal\n");
+    return -1;
   }
-  else{
-    if(numtype == ush_num_int32)
-      volt = *(int32_t*)&volt;
-    else if(numtype == ush_num_uint32)
-      volt = *(uint32_t*)&volt;
-    USH_Print("set output voltage to:%f\n", volt);
-    real_volt = ad5791_set_volt(volt);
-    USH_Print("Real output voltage is:%f\n", real_volt);
+  USH_Print("set DAC%d output voltage to:%u.%09u\n", dev->ch,
+            (uint32_t)(nv/1000000000), (uint32_t)(nv%1000000000));
+  real_nv = voltref_set_nv(dev, nv);
+  USH_Print("Real output voltage is:%u.%09u\n",
+            (uint32_t)(real_nv/1000000000), (uint32_t)(real_nv%1000000000));
+  return 0;
+}
+USH_REGISTER(ush_set_volt, setvolt, Set the output voltage in V to 1nV: setvolt volt [channel]);
+
+/**
+ * @brief set the volatage in uV, no float math.
+*/
+static int32_t ush_set_uv(uint32_t argc, char **argv){
+  uint32_t uv, real_uv;
+  ad5791_dev_def *dev;
+  if(argc < 2) return 0;
+  dev = ush_get_dev(argc, argv, 2);
+  if(dev == 0) return -1;
+  if(cmdarg_uint(argv[1], &uv) != 0){
+    USH_Print("input string is not illegal\n");
+    return -1;
   }
-  curr_volt = real_volt;
+  real_uv = ad5791_dev_set_uv(dev, uv);
+  USH_Print("DAC%d real output voltage is:%uuV, code 0x%05x\n", dev->ch, real_uv, dev->code);
+  if(dev->ch == 0){
+    curr_volt = real_uv*1e-6f;
+    hmi_disp_update(curr_volt);
+  }
+  return 0;
+}
+USH_REGISTER(ush_set_uv, setuv, Set the output voltage in uV: setuv uv [channel]);
+
+/**
+ * @brief set code of all channels, they change at the same moment.
+*/
+static int32_t ush_set_all(uint32_t argc, char **argv){
+  uint32_t code[AD5791_DEV_NUM];
+  if(argc != AD5791_DEV_NUM + 1){
+    USH_Print("usage: setall code0 .. code%d\n", AD5791_DEV_NUM-1);
+    return -1;
+  }
+  for(uint32_t i=0; i<AD5791_DEV_NUM; i++){
+    if(cmdarg_uint(argv[i+1], &code[i]) != 0 || code[i] > 0xfffff){
+      USH_Print("code should be 0 to 0xfffff\n");
+      return -1;
+    }
+  }
+  if(ad5791_write_all(code) != 0)
+    USH_Print("no LDAC, channels are updated one by one\n");
+  curr_volt = ad5791_dev_get_nv(ad5791_get_dev(0))*1e-9f;
   hmi_disp_update(curr_volt);
   return 0;
 }
-USH_REGISTER(ush_set_volt, setvolt, Set the output voltage in V);
+USH_REGISTER(ush_set_all, setall, Set code of all channels together: setall code0 [code1 ..]);
+
+/**
+ * @brief list all channels.
+*/
+static int32_t ush_dac_list(uint32_t argc, char **argv){
+  ad5791_dev_def *dev;
+#if AD5791_DAISY_CHAIN
+  USH_Print("%d channels in daisy chain\n", AD5791_DEV_NUM);
+#else
+  USH_Print("%d channels\n", AD5791_DEV_NUM);
+#endif
+  for(uint32_t i=0; (dev = ad5791_get_dev(i)) != 0; i++)
+    USH_Print("DAC%d: sync 0x%04x, code 0x%05x, vref %unV, %unV\n", dev->ch, dev->sync_pin,
+              dev->code, (uint32_t)dev->vref_nv, (uint32_t)ad5791_dev_get_nv(dev));
+  return 0;
+}
+USH_REGISTER(ush_dac_list, daclist, List all DAC channels);
 
 /**
  * @brief poll the input from usart and process it.
  * @return none.
 */
 void voltref_loop(void){
-  uint8_t ch;
-  while(fifo_pop(&uartrx_fifo, &ch) == fifo_err_ok){
-    ush_process_input(&ush, (char*)&ch, 1);
+  const uint8_t *pdata;
+  uint32_t len, baud;
+  while((len = uart_rx_span(&pdata)) != 0){
+#if VOLTREF_USE_BENCH
+    uint32_t start = timer_cycle_get(), start_ms = timer_ms_get();
+#endif
+    voltref_input(pdata, len);
+    uart_rx_consume(len);
+#if VOLTREF_USE_BENCH
+    if(timer_ms_get() - start_ms < VOLTREF_BENCH_SPAN_MS){
+      rx_bench.cycles += timer_cycle_elapsed(start);
+      rx_bench.timed += len;
+    }
+    else
+      rx_bench.long_spans++;  //a long command ran, cycle count has wrapped.
+    rx_bench.bytes += len;
+#endif
+  }
+  baud = uart_autobaud_poll();
+  if(baud){
+    voltref_link_save(baud, 1);
+    USH_Print("baud: %u detected\n", baud);
+  }
+  ad5791_poll();
+#if VOLTREF_USE_REMOTE
+  remote_poll();
+#endif
+#if VOLTREF_USE_RAMP
+  if(ramp_poll() && voltref_may_print())
+    USH_Print("ramp: target reached\n");
+#endif
+#if VOLTREF_USE_SCPI
+  scpi_poll();
+#endif
+#if VOLTREF_USE_SEQ
+  if(seq_poll() && voltref_may_print())
+    USH_Print("seq: done\n");
+#endif
+#if VOLTREF_USE_SAFE
+  if(safe_poll() && voltref_may_print())
+    USH_Print("safe: output is in safe state\n");
+#endif
+}
+
+/**
+ * @brief baud [rate|auto|fixed]
+*/
+static int32_t ush_baud(uint32_t argc, char **argv){
+  uint32_t baud;
+  if(argc < 2){
+    USH_Print("baud: %u, autobaud %s\n", uart_get_baud(), uart_autobaud_enabled() ? "on" : "off");
+    return 0;
+  }
+  if(strcmp(argv[1], "auto") == 0 || strcmp(argv[1], "fixed") == 0){
+    baud = strcmp(argv[1], "auto") == 0;
+    voltref_link_save(uart_get_baud(), baud);
+    uart_autobaud(baud);
+    return 0;
+  }
+  if(cmdarg_uint(argv[1], &baud) != 0 || uart_baud_index(baud) < 0){
+    USH_Print("baud should be one of:");
+    for(uint32_t i=0; uart_baud_rate(i); i++)
+      USH_Print(" %u", uart_baud_rate(i));
+    USH_Print("\n");
+    return -1;
+  }
+  USH_Print("switching to %u\n", baud);
+  uart_set_baud(baud);
+  voltref_link_save(baud, uart_autobaud_enabled());
+  return 0;
+}
+USH_REGISTER(ush_baud, baud, Show or set host link baudrate: baud [rate|auto|fixed]);
+
+#if VOLTREF_USE_BENCH
+/**
+ * @brief rxbench [clear]. Host sends a script of commands, then reads how
+ * fast input path could go and how fast bytes really came.
+*/
+static int32_t ush_rx_bench(uint32_t argc, char **argv){
+  uint32_t ms = timer_ms_get() - rx_bench.start_ms;
+  if(argc > 1 && strcmp(argv[1], "clear") == 0){
+    memset(&rx_bench, 0, sizeof(rx_bench));
+    rx_bench.start_ms = timer_ms_get();
+    return 0;
   }
+  USH_Print("bytes: %u, shell calls: %u, %u bytes per call\n", rx_bench.bytes, rx_bench.calls,
+            rx_bench.calls ? rx_bench.bytes/rx_bench.calls : 0);
+  if(rx_bench.cycles)
+    USH_Print("input path: %uus busy, %u bytes/s\n",
+              (uint32_t)(rx_bench.cycles*1000000/SystemCoreClock),
+              (uint32_t)((uint64_t)rx_bench.timed*SystemCoreClock/rx_bench.cycles));
+  if(rx_bench.long_spans)
+    USH_Print("%u spans over %ums are not timed\n", rx_bench.long_spans, VOLTREF_BENCH_SPAN_MS);
+  if(ms)
+    USH_Print("received: %u bytes/s over %ums\n", (uint32_t)((uint64_t)rx_bench.bytes*1000/ms), ms);
+  return 0;
 }
+USH_REGISTER(ush_rx_bench, rxbench, Show UART input path throughput: rxbench [clear]);
+#endif
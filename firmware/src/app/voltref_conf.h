@@ -0,0 +1,77 @@
+/**
+ * @author Neo Xu (neo.xu1990@gmail.com)
+ * @license The MIT License (MIT)
+ * 
+ * Copyright (c) 2019 Neo Xu
+ * 
+ * @brief engines built into the voltage source. The full set doesn't fit in
+ * the 30KB of flash below the linearity table page, so they are left out by
+ * default. Set one to 1 here or with -D in project to build it in, flash and
+ * RAM it takes in a size optimized build are noted for each.
+*/
+#ifndef _VOLTREF_CONF_H_
+#define _VOLTREF_CONF_H_
+
+#ifndef VOLTREF_USE_SCPI
+#define VOLTREF_USE_SCPI      0   //SCPI on UART1, 4.5kB flash, 200B RAM.
+#endif
+
+#ifndef VOLTREF_USE_DDS
+#define VOLTREF_USE_DDS       0   //sine/triangle/square DDS(dds*), 3.3kB flash with float math, 24B RAM.
+#endif
+
+#ifndef VOLTREF_USE_DITHER
+#define VOLTREF_USE_DITHER    0   //sub-LSB dither(dither*), 1.6kB flash, 44B RAM.
+#endif
+
+#ifndef VOLTREF_USE_LINCAL
+#define VOLTREF_USE_LINCAL    0   //linearity table(inl*), 1.3kB flash, 72B RAM. Its flash page stays reserved.
+#endif
+
+#ifndef VOLTREF_USE_RAMP
+#define VOLTREF_USE_RAMP      0   //slew rate limit(ramp*), 1.6kB flash, 32B RAM. Sets step at once without it.
+#endif
+
+#ifndef VOLTREF_USE_SCHED
+#define VOLTREF_USE_SCHED     0   //timed setpoint queue(q*), 1.5kB flash, 420B RAM.
+#endif
+
+#ifndef VOLTREF_USE_SAFE
+#define VOLTREF_USE_SAFE      0   //fault input and over-temperature trip(safe*), 2.2kB flash, 28B RAM.
+#endif
+
+#ifndef VOLTREF_USE_WAVE
+#define VOLTREF_USE_WAVE      0   //wave playback(wav*), 1.8kB flash, 1kB RAM for the shared buffer.
+#endif
+
+#ifndef VOLTREF_USE_LATCH
+#define VOLTREF_USE_LATCH     0   //preload-then-latch for sample engines(latch), 1kB flash.
+#endif
+
+#ifndef VOLTREF_USE_SEQ
+#define VOLTREF_USE_SEQ       0   //list mode sequencer(seq*), 2.7kB flash, 40B RAM.
+#endif
+
+#ifndef VOLTREF_USE_REMOTE
+#define VOLTREF_USE_REMOTE    0   //binary protocol on UART1, 1.6kB flash, 170B RAM.
+#endif
+
+#ifndef VOLTREF_USE_STREAM
+#define VOLTREF_USE_STREAM    0   //stream(stream*, remote STREAM_*), 0.8kB flash, 40B RAM.
+#endif
+
+#ifndef VOLTREF_USE_WAVEPACK
+#define VOLTREF_USE_WAVEPACK  0   //packed wave(wavp*, remote WAVE_*), 1.4kB flash, 36B RAM.
+#endif
+
+#if (VOLTREF_USE_SEQ || VOLTREF_USE_STREAM || VOLTREF_USE_WAVEPACK) && !VOLTREF_USE_WAVE
+#error "seq, stream and packed wave live in wave buffer, VOLTREF_USE_WAVE is needed"
+#endif
+#if VOLTREF_USE_STREAM && !VOLTREF_USE_REMOTE
+#error "stream is fed by remote, VOLTREF_USE_REMOTE is needed"
+#endif
+#if VOLTREF_USE_WAVEPACK && !VOLTREF_USE_REMOTE
+#error "packed wave is loaded by remote, VOLTREF_USE_REMOTE is needed"
+#endif
+
+#endif
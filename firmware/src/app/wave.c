@@ -0,0 +1,210 @@
+/**
+ * @author Neo Xu (neo.xu1990@gmail.com)
+ * @license The MIT License (MIT)
+ * 
+ * Copyright (c) 2019 Neo Xu
+ * 
+ * @brief arbitrary waveform playback from RAM buffer.
+ * Codes are clocked out to AD5791 from sample clock interrupt.
+*/
+#include "wave.h"
+#include "ad5791.h"
+#include "timer.h"
+#include "cmdarg.h"
+#include "string.h"
+#include "printf.h"
+#include "ush.h"
+
+#if VOLTREF_USE_WAVE
+static uint32_t wave_buff[WAVE_BUFF_SIZE];
+static uint32_t wave_len = 0;               //valid codes in buffer.
+static volatile uint32_t wave_pos = 0;      //next code to output.
+static volatile int32_t wave_dir = 1;       //pingpong direction.
+static volatile uint32_t wave_count = 0;    //codes output since start.
+static wave_mode_def wave_mode = wave_mode_loop;
+static uint32_t wave_period = 0;            //sample period in 64MHz clocks.
+static const void *buff_owner = wave_buff;  //buffer is shared with other engines.
+
+/**
+ * @brief output one code, called from sample clock interrupt.
+ * @return none.
+*/
+static void wave_sample(void){
+  uint32_t pos = wave_pos;
+  ad5791_write_data(wave_buff[pos]);
+  wave_count ++;
+  switch(wave_mode){
+    case wave_mode_oneshot:
+      if(++pos >= wave_len){
+        timer_sample_stop();  //output stays at last code.
+        pos = 0;
+      }
+      break;
+    case wave_mode_loop:
+      if(++pos >= wave_len)
+        pos = 0;
+      break;
+    case wave_mode_pingpong:
+      if(wave_len < 2) break;
+      if(pos == wave_len-1) wave_dir = -1;
+      else if(pos == 0) wave_dir = 1;
+      pos += wave_dir;
+      break;
+  }
+  wave_pos = pos;
+}
+
+/**
+ * @brief write one code to buffer, buffer length grows to cover index.
+ * @return 0 if ok, -1 if index is out of buffer.
+*/
+int32_t wave_write(uint32_t index, uint32_t code){
+  if(index >= WAVE_BUFF_SIZE) return -1;
+  if(buff_owner != wave_buff)
+    wave_buffer_take(wave_buff);
+  wave_buff[index] = code&0xfffff;
+  if(index >= wave_len)
+    wave_len = index + 1;
+  return 0;
+}
+
+/**
+ * @brief stop playback and empty the buffer.
+ * @return none.
+*/
+void wave_clear(void){
+  wave_stop();
+  wave_len = 0;
+}
+
+/**
+ * @brief start playback from first code.
+ * @return the real sample period in 64MHz clocks, 0 if failed.
+*/
+uint32_t wave_start(uint32_t rate_hz, wave_mode_def mode){
+  if(wave_len == 0 || buff_owner != wave_buff) return 0;
+  wave_stop();
+  wave_mode = mode;
+  wave_pos = 0;
+  wave_dir = 1;
+  wave_count = 0;
+  wave_period = timer_sample_start(rate_hz, wave_sample);
+  return wave_period;
+}
+
+/**
+ * @brief lend the buffer to another engine, wave data is dropped. Whoever
+ * took it last owns it, others should check wave_buffer_owned first.
+ * @param owner: any address that identifies the engine.
+ * @return buffer of WAVE_BUFF_SIZE words.
+*/
+uint32_t *wave_buffer_take(const void *owner){
+  wave_clear();
+  buff_owner = owner;
+  return wave_buff;
+}
+
+/**
+ * @brief check if owner still has the buffer.
+ * @return 1 if yes.
+*/
+int32_t wave_buffer_owned(const void *owner){
+  return buff_owner == owner;
+}
+
+/**
+ * @brief stop playback, output holds the last code.
+ * @return none.
+*/
+void wave_stop(void){
+  if(wave_is_running())
+    timer_sample_stop();
+}
+
+int32_t wave_is_running(void){
+  return timer_sample_owner() == wave_sample;
+}
+
+/**
+ * @brief load codes to buffer: wavset index code [code ...]
+*/
+static int32_t ush_wave_set(uint32_t argc, char **argv){
+  uint32_t index, code;
+  if(argc < 3) return 0;
+  if(cmdarg_uint(argv[1], &index) != 0){
+    USH_Print("index is not valid\n");
+    return -1;
+  }
+  for(uint32_t i=2; i<argc; i++){
+    if(cmdarg_uint(argv[i], &code) != 0 || code > 0xfffff){
+      USH_Print("code %s is not valid\n", argv[i]);
+      return -1;
+    }
+    if(wave_write(index++, code) != 0){
+      USH_Print("buffer is full(%d codes)\n", WAVE_BUFF_SIZE);
+      return -1;
+    }
+  }
+  USH_Print("wave length: %d\n", wave_len);
+  return 0;
+}
+USH_REGISTER(ush_wave_set, wavset, Load wave codes: wavset index code [code ...]);
+
+static int32_t ush_wave_clear(uint32_t argc, char **argv){
+  wave_clear();
+  return 0;
+}
+USH_REGISTER(ush_wave_clear, wavclr, Stop playback and clear wave buffer);
+
+/**
+ * @brief wavstart rate [once|loop|ping]
+*/
+static int32_t ush_wave_start(uint32_t argc, char **argv){
+  uint32_t rate;
+  wave_mode_def mode = wave_mode_loop;
+  if(argc < 2) return 0;
+  if(cmdarg_uint(argv[1], &rate) != 0){
+    USH_Print("rate is not valid\n");
+    return -1;
+  }
+  if(argc >= 3){
+    if(strcmp(argv[2], "once") == 0) mode = wave_mode_oneshot;
+    else if(strcmp(argv[2], "loop") == 0) mode = wave_mode_loop;
+    else if(strcmp(argv[2], "ping") == 0) mode = wave_mode_pingpong;
+    else{
+      USH_Print("mode should be once, loop or ping\n");
+      return -1;
+    }
+  }
+  if(wave_len == 0){
+    USH_Print("wave buffer is empty\n");
+    return -1;
+  }
+  if(wave_start(rate, mode) == 0){
+    USH_Print("rate should be 1 to %dHz\n", TIMER_SAMPLE_RATE_MAX);
+    return -1;
+  }
+  USH_Print("sample rate: %fHz\n", (float)TIMER_SAMPLE_CLOCK/wave_period);
+  return 0;
+}
+USH_REGISTER(ush_wave_start, wavstart, Start playback: wavstart rate [once|loop|ping]);
+
+static int32_t ush_wave_stop(uint32_t argc, char **argv){
+  wave_stop();
+  return 0;
+}
+USH_REGISTER(ush_wave_stop, wavstop, Stop playback);
+
+static int32_t ush_wave_stat(uint32_t argc, char **argv){
+  const char *mode_name[] = {"once", "loop", "ping"};
+  uint32_t late, missed;
+  timer_sample_stat(&late, &missed);
+  USH_Print("%s, mode %s, length %d, position %d\n", wave_is_running()?"running":"stopped",
+            mode_name[wave_mode], wave_len, wave_pos);
+  if(wave_period)
+    USH_Print("sample rate: %fHz\n", (float)TIMER_SAMPLE_CLOCK/wave_period);
+  USH_Print("samples: %u, late: %u, missed: %u\n", wave_count, late, missed);
+  return 0;
+}
+USH_REGISTER(ush_wave_stat, wavstat, Show playback status);
+#endif
@@ -0,0 +1,30 @@
+/**
+ * @author Neo Xu (neo.xu1990@gmail.com)
+ * @license The MIT License (MIT)
+ * 
+ * Copyright (c) 2019 Neo Xu
+ * 
+ * @brief arbitrary waveform playback from RAM buffer.
+*/
+#ifndef _WAVE_H_
+#define _WAVE_H_
+#include "stdint.h"
+#include "voltref_conf.h"
+
+#define WAVE_BUFF_SIZE  256   //number of 20bit codes in buffer, 1kB of RAM.
+
+typedef enum{
+  wave_mode_oneshot = 0,  /**< play buffer once, output stays at the last code. */
+  wave_mode_loop,         /**< restart from the first code. */
+  wave_mode_pingpong,     /**< play forward then backward. */
+}wave_mode_def;
+
+int32_t wave_write(uint32_t index, uint32_t code);
+void wave_clear(void);
+uint32_t wave_start(uint32_t rate_hz, wave_mode_def mode);
+void wave_stop(void);
+int32_t wave_is_running(void);
+uint32_t *wave_buffer_take(const void *owner);
+int32_t wave_buffer_owned(const void *owner);
+
+#endif
@@ -0,0 +1,241 @@
+/**
+ * @author Neo Xu (neo.xu1990@gmail.com)
+ * @license The MIT License (MIT)
+ * 
+ * Copyright (c) 2019 Neo Xu
+ * 
+ * @brief packed waveform, decoded on the fly from the shared wave buffer.
+ * Staircases and slow ramps pack to a few bytes per step, so the 1kB buffer
+ * holds thousands of samples instead of 256 codes. Host uploads the image in
+ * blocks, then it's checked against CRC of the whole image once, so sample
+ * clock interrupt decodes without any check.
+*/
+#include "wavepack.h"
+#include "remote.h"
+#include "ad5791.h"
+#include "timer.h"
+#include "cmdarg.h"
+#include "string.h"
+#include "printf.h"
+#include "ush.h"
+
+#if VOLTREF_USE_WAVEPACK
+struct _unpack{
+  uint32_t pos;     //next byte in image.
+  uint32_t code;    //code on output.
+  int32_t step;     //slope of SLOPE token.
+  uint8_t op;       //current token.
+  uint8_t run;      //samples left in current token.
+};
+
+static uint8_t *image = 0;
+static uint32_t pack_len = 0;               //verified image length, 0 if not verified.
+static uint32_t pack_samples = 0;           //samples in one pass of image.
+static struct _unpack unpack;
+static volatile uint32_t pack_count = 0;    //samples output since start.
+static wave_mode_def pack_mode = wave_mode_loop;
+static uint32_t pack_period = 0;            //sample period in 64MHz clocks.
+
+/**
+ * @brief decode one sample, image must be verified.
+ * @return 1 if code is changed, 0 if it holds, -1 at end of image.
+*/
+static int32_t wavepack_next(struct _unpack *s){
+  const uint8_t *p;
+  int32_t changed = 0;
+  if(s->run == 0){
+    if(s->pos >= pack_len) return -1;
+    p = &image[s->pos++];
+    s->op = p[0]>>6;
+    s->run = (p[0]&0x3f) + 1;
+    if(s->op == WAVEPACK_OP_SET){
+      s->code = p[1]|(p[2]<<8)|((uint32_t)p[3]<<16);
+      s->pos += 3;
+      changed = 1;
+    }
+    else if(s->op == WAVEPACK_OP_SLOPE){
+      s->step = (int16_t)(p[1]|(p[2]<<8));
+      s->pos += 2;
+    }
+  }
+  s->run--;
+  if(s->op == WAVEPACK_OP_DELTA){
+    s->code += (int8_t)image[s->pos++];
+    return 1;
+  }
+  if(s->op == WAVEPACK_OP_SLOPE){
+    s->code += s->step;
+    return 1;
+  }
+  return changed;
+}
+
+/**
+ * @brief output one sample, called from sample clock interrupt.
+ * @return none.
+*/
+static void wavepack_sample(void){
+  int32_t changed;
+  if(!wave_buffer_owned(&image)){ //buffer is taken by another engine.
+    timer_sample_stop();
+    return;
+  }
+  changed = wavepack_next(&unpack);
+  if(changed < 0){
+    if(pack_mode == wave_mode_oneshot){
+      timer_sample_stop();  //output stays at last code.
+      return;
+    }
+    unpack.pos = 0;
+    unpack.run = 0;
+    changed = wavepack_next(&unpack);
+  }
+  if(changed)
+    ad5791_write_data(unpack.code);
+  pack_count++;
+}
+
+/**
+ * @brief copy a block of image to buffer, image needs to be verified again.
+ * Blocks can come in any order and a block can be sent again.
+ * @return 0 if ok, -1 if block is out of buffer, -2 if it's playing.
+*/
+int32_t wavepack_load(uint32_t offset, const uint8_t *pdata, uint32_t len){
+  if(offset > WAVEPACK_SIZE || len > WAVEPACK_SIZE - offset)
+    return -1;
+  if(wavepack_is_running())
+    return -2;
+  if(!wave_buffer_owned(&image))
+    image = (uint8_t *)wave_buffer_take(&image);
+  memcpy(&image[offset], pdata, len);
+  pack_len = 0;
+  return 0;
+}
+
+/**
+ * @brief check CRC of image and walk through tokens, so payloads are in image
+ * and code never leaves 20bit.
+ * @return samples in image, -1 if CRC or length is wrong, -2 if a token is wrong.
+*/
+int32_t wavepack_verify(uint32_t len, uint16_t crc){
+  static const uint8_t payload[4] = {0, 3, 0, 2};
+  uint32_t pos = 0, op, count;
+  int32_t code = -1, samples = 0;
+  wavepack_stop();
+  pack_len = 0;
+  if(!wave_buffer_owned(&image) || len == 0 || len > WAVEPACK_SIZE ||
+     remote_crc16(image, len) != crc)
+    return -1;
+  while(pos < len){
+    op = image[pos]>>6;
+    count = (image[pos]&0x3f) + 1;
+    pos++;
+    if(pos + (op == WAVEPACK_OP_DELTA ? count : payload[op]) > len) return -2;
+    if(op != WAVEPACK_OP_SET && code < 0) return -2;  //no code to start from.
+    switch(op){
+      case WAVEPACK_OP_SET:
+        code = image[pos]|(image[pos+1]<<8)|(image[pos+2]<<16);
+        break;
+      case WAVEPACK_OP_DELTA:
+        for(uint32_t i=0; i<count; i++){
+          code += (int8_t)image[pos+i];
+          if(code < 0 || code > 0xfffff) return -2;
+        }
+        break;
+      case WAVEPACK_OP_SLOPE:  //linear, the end is enough.
+        code += (int16_t)(image[pos]|(image[pos+1]<<8))*(int32_t)count;
+        break;
+    }
+    if(code < 0 || code > 0xfffff) return -2;
+    pos += op == WAVEPACK_OP_DELTA ? count : payload[op];
+    samples += count;
+  }
+  pack_len = len;
+  pack_samples = samples;
+  return samples;
+}
+
+/**
+ * @brief start playback of verified image, pingpong is not supported since
+ * deltas can't be decoded backward.
+ * @return the real sample period in 64MHz clocks, 0 if failed.
+*/
+uint32_t wavepack_start(uint32_t rate_hz, wave_mode_def mode){
+  if(pack_len == 0 || !wave_buffer_owned(&image) || mode == wave_mode_pingpong)
+    return 0;
+  wavepack_stop();
+  pack_mode = mode;
+  memset(&unpack, 0, sizeof(unpack));
+  pack_count = 0;
+  pack_period = timer_sample_start(rate_hz, wavepack_sample);
+  return pack_period;
+}
+
+/**
+ * @brief stop playback, output holds the last code.
+ * @return none.
+*/
+void wavepack_stop(void){
+  if(wavepack_is_running())
+    timer_sample_stop();
+}
+
+int32_t wavepack_is_running(void){
+  return timer_sample_owner() == wavepack_sample;
+}
+
+/**
+ * @brief wavpstart rate [once|loop]
+*/
+static int32_t ush_wavepack_start(uint32_t argc, char **argv){
+  uint32_t rate;
+  wave_mode_def mode = wave_mode_loop;
+  if(argc < 2 || cmdarg_uint(argv[1], &rate) != 0){
+    USH_Print("usage: wavpstart rate [once|loop]\n");
+    return -1;
+  }
+  if(argc >= 3){
+    if(strcmp(argv[2], "once") == 0) mode = wave_mode_oneshot;
+    else if(strcmp(argv[2], "loop") == 0) mode = wave_mode_loop;
+    else{
+      USH_Print("mode should be once or loop\n");
+      return -1;
+    }
+  }
+  if(pack_len == 0 || !wave_buffer_owned(&image)){
+    USH_Print("no verified image\n");
+    return -1;
+  }
+  if(wavepack_start(rate, mode) == 0){
+    USH_Print("rate should be 1 to %dHz\n", TIMER_SAMPLE_RATE_MAX);
+    return -1;
+  }
+  USH_Print("sample rate: %fHz\n", (float)TIMER_SAMPLE_CLOCK/pack_period);
+  return 0;
+}
+USH_REGISTER(ush_wavepack_start, wavpstart, Play packed wave: wavpstart rate [once|loop]);
+
+static int32_t ush_wavepack_stop(uint32_t argc, char **argv){
+  wavepack_stop();
+  return 0;
+}
+USH_REGISTER(ush_wavepack_stop, wavpstop, Stop packed wave playback);
+
+static int32_t ush_wavepack_stat(uint32_t argc, char **argv){
+  uint32_t late, missed;
+  if(pack_len == 0 || !wave_buffer_owned(&image)){
+    USH_Print("no verified image\n");
+    return 0;
+  }
+  USH_Print("%s, mode %s, image %u bytes, %u samples, position %u\n",
+            wavepack_is_running() ? "running" : "stopped",
+            pack_mode == wave_mode_oneshot ? "once" : "loop",
+            pack_len, pack_samples, unpack.pos);
+  if(pack_period)
+    USH_Print("sample rate: %fHz\n", (float)TIMER_SAMPLE_CLOCK/pack_period);
+  timer_sample_stat(&late, &missed);
+  USH_Print("samples: %u, late: %u, missed: %u\n", pack_count, late, missed);
+  return 0;
+}
+USH_REGISTER(ush_wavepack_stat, wavpstat, Show packed wave status);
+#endif
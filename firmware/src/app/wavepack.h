@@ -0,0 +1,36 @@
+/**
+ * @author Neo Xu (neo.xu1990@gmail.com)
+ * @license The MIT License (MIT)
+ * 
+ * Copyright (c) 2019 Neo Xu
+ * 
+ * @brief packed waveform, decoded on the fly from the shared wave buffer.
+ *
+ * Image is a byte stream of tokens, op(2bit) count-1(6bit) and payload:
+ *   WAVEPACK_OP_HOLD  none,      code stays for count samples.
+ *   WAVEPACK_OP_SET   code(3),   code is output, then held for count samples.
+ *   WAVEPACK_OP_DELTA d(1)*count, signed 8bit step added every sample.
+ *   WAVEPACK_OP_SLOPE d(2),      signed 16bit step added for count samples.
+ * Image must start with SET and code must stay in 20bit.
+*/
+#ifndef _WAVEPACK_H_
+#define _WAVEPACK_H_
+#include "stdint.h"
+#include "voltref_conf.h"
+#include "wave.h"
+
+#define WAVEPACK_SIZE     (WAVE_BUFF_SIZE*4)  //bytes of image.
+
+#define WAVEPACK_OP_HOLD  0
+#define WAVEPACK_OP_SET   1
+#define WAVEPACK_OP_DELTA 2
+#define WAVEPACK_OP_SLOPE 3
+#define WAVEPACK_TOKEN(op, count) (((op)<<6)|((count)-1))
+
+int32_t wavepack_load(uint32_t offset, const uint8_t *pdata, uint32_t len);
+int32_t wavepack_verify(uint32_t len, uint16_t crc);
+uint32_t wavepack_start(uint32_t rate_hz, wave_mode_def mode);
+void wavepack_stop(void);
+int32_t wavepack_is_running(void);
+
+#endif
@@ -7,17 +7,72 @@
  * @brief ad5791 driver.
 */
 #include "ad5791.h"
+#include "timer.h"
+#include "printf.h"
+#include "ush.h"
+#include "string.h"
+#include "cmdarg.h"
 
-#define AD5791_SYNC_L() GPIOA->BRR = GPIO_Pin_5
-#define AD5791_SYNC_H() GPIOA->BSRR = GPIO_Pin_5
+#define LOG_TAG              "ad5791"
+#define LOG_LVL              LOG_LVL_INFO
+#include <ulog.h>
 
-#define AD5791_SCLK_L() GPIOA->BRR = GPIO_Pin_4
-#define AD5791_SCLK_H() GPIOA->BSRR = GPIO_Pin_4
+#if AD5791_TRANSPORT == AD5791_TRANSPORT_SPI_DMA
+/**
+ * SPI1 transport needs the reworked board: SCK-->PA5 MOSI-->PA7 SYNC-->PA4.
+ * SYNC stays a GPIO, it's released from DMA complete interrupt.
+*/
+#define AD5791_SYNC_PIN GPIO_Pin_4
+#else
+#define AD5791_SYNC_PIN GPIO_Pin_5
+#define AD5791_SCLK_PIN GPIO_Pin_4
+#define AD5791_DIN_PIN  GPIO_Pin_3
+
+#define AD5791_SCLK_L() GPIOA->BRR = AD5791_SCLK_PIN
+#define AD5791_SCLK_H() GPIOA->BSRR = AD5791_SCLK_PIN
+
+#define AD5791_DIN_L() GPIOA->BRR = AD5791_DIN_PIN
+#define AD5791_DIN_H() GPIOA->BSRR = AD5791_DIN_PIN
+#endif
+
+/**
+ * SDO for readback. Bit-bang reads it on PA0, SPI1 uses MISO on PA6.
+*/
+#if AD5791_USE_SDO
+#if AD5791_TRANSPORT == AD5791_TRANSPORT_SPI_DMA
+#define AD5791_SDO_PIN  GPIO_Pin_6
+#else
+#define AD5791_SDO_PIN  GPIO_Pin_0
+#endif
+#if AD5791_DAISY_CHAIN && AD5791_DEV_NUM > 1
+#error "SDO readback is not supported in daisy chain, SDO feeds the next device."
+#endif
+#endif
+
+#define AD5791_SYNC_L(pin) GPIOA->BRR = (pin)
+#define AD5791_SYNC_H(pin) GPIOA->BSRR = (pin)
+
+/**
+ * SYNC pin of each device, all on GPIOA. Daisy chain only uses the first one.
+ * Separate SYNC lines are given at build time, e.g. for two devices:
+ * -DAD5791_DEV_NUM=2 -DAD5791_SYNC_PINS="{GPIO_Pin_5,GPIO_Pin_0}"
+*/
+#ifndef AD5791_SYNC_PINS
+#define AD5791_SYNC_PINS {AD5791_SYNC_PIN}
+#endif
+static const uint16_t sync_pins[] = AD5791_SYNC_PINS;
+typedef char ad5791_sync_pins_check[(AD5791_DAISY_CHAIN ||
+  sizeof(sync_pins)/sizeof(sync_pins[0]) >= AD5791_DEV_NUM) ? 1 : -1];
 
-#define AD5791_DIN_L() GPIOA->BRR = GPIO_Pin_3
-#define AD5791_DIN_H() GPIOA->BSRR = GPIO_Pin_3
+#if AD5791_USE_LDAC
+#define AD5791_LDAC_PIN GPIO_Pin_1
+#define AD5791_LDAC_L() GPIOA->BRR = AD5791_LDAC_PIN
+#define AD5791_LDAC_H() GPIOA->BSRR = AD5791_LDAC_PIN
+static const uint16_t ldac_pin_mask = AD5791_LDAC_PIN; /* DMA writes it to BRR. */
+#endif
 
-#define AD5791_CMD(addr, data) (((uint32_t)(addr&0xf)<<20)|(data&0xfffff))
+#define AD5791_CMD(addr, data) (((uint32_t)((addr)&0xf)<<20)|((data)&0xfffff))
+#define AD5791_CMD_READ(addr)   ((1ul<<23)|AD5791_CMD(addr, 0))
 
 #define AD5791REG_NOP     0   //no operation
 #define AD5791REG_WDATA   1   //data register
@@ -25,27 +80,7 @@
 #define AD5791REG_CLRCODE 3   //clear code register
 #define AD5791REG_SCTRL   4   //software control register
 
-//bit1
-#define AD5791CTRL_A1_ON  (0<<1)  /*0: turn on internal A1 amplifier */  
-#define AD5791CTRL_A1_OFF (1<<1)  /*1: turn off internal A1 amplifier */  
-//bit2
-#define AD5791CTRL_OPGND_NORMAL (0<<2)  /* 0: DAC operates in normal mode */ 
-#define AD5791CTRL_OPGND_TOGND  (1<<2)  /* 1: DAC output is clamped to ground */ 
-//bit3
-#define AD5791CTRL_OUT_NORMAL   (0<<3)  /* 0: DAC output is in normal mode */
-#define AD5791CTRL_OUT_TRISTATE (1<<3)  /* 1: DAC output is in tristate */
-//bit4
-#define AD5791CTRL_CODE_2SC     (0<<4)  /* 0: two's complement coding */     
-#define AD5791CTRL_CODE_BIN     (1<<4)  /* 1: offset binary code */     
-//bit5
-#define AD5791CTRL_SDO_EN       (0<<5)  /* 0: SDO pin is enabled */
-#define AD5791CTRL_SDO_DIS      (1<<5)  /* 1: SDO pin is disabled */
-//bit6-9
-#define AD5791CTRL_COMP10V      (0<<6)  /* 0: Line compensation input reference up to 10V  */
-#define AD5791CTRL_COMP10V_12V  (9<<6)  /* 9: Line compensation 10V to 12V reference  */
-#define AD5791CTRL_COMP12V_16V  (10<<6) /* 10: Line compensation 12V to 16V reference  */
-#define AD5791CTRL_COMP16V_19V  (11<<6) /* 11: Line compensation 16V to 19V reference  */
-#define AD5791CTRL_COMP19V_20V  (12<<6) /* 12: Line compensation 19V to 20V reference  */
+#define AD5791CTRL_MASK         (0x1ff<<1) /* bits that read back */
 
 //AD5791 software control set
 #define AD5791SCTRL_RST         (1<<2)  /* Perform software reset */
@@ -53,58 +88,690 @@
 #define AD5791SCTRL_LDAC        (1<<0)  /* Perform LDAC operation */
 
 /**
- * used to track current dac code.
+ * SDO of each device drives the next one in chain, so it must stay on. Single
+ * device keeps it on for readback, separate SYNC lines share SDO and enable it
+ * only while reading.
+*/
+#if AD5791_DAISY_CHAIN || (AD5791_USE_SDO && AD5791_DEV_NUM == 1)
+#define AD5791CTRL_SDO  AD5791CTRL_SDO_EN
+#else
+#define AD5791CTRL_SDO  AD5791CTRL_SDO_DIS
+#endif
+
+#define AD5791_VREF_DEFAULT_NV  10091741325ull /* 10V by default. */
+
+/**
+ * Device context, tracks current settings of every channel.
+*/
+static ad5791_dev_def dev_list[AD5791_DEV_NUM];
+static ad5791_callback done_callback = 0; /* called when a frame is out. */
+/**
+ * Safe state. Shadow registers keep normal settings while it's on, in clear
+ * mode writes only go to shadow so one frame restores the setpoint.
+*/
+static volatile ad5791_safe_def safe_mode = ad5791_safe_off;
+static ad5791_frame_stat_def frame_stat;
+static uint32_t ctrl_batch = 0;   /* nesting of ad5791_ctrl_begin */
+static uint32_t ctrl_dirty = 0;   /* devices whose control shadow isn't sent, bit per channel */
+static uint32_t min_interval_us = AD5791_MIN_INTERVAL_US;
+static uint32_t min_interval;     /* min_interval_us in core cycles, set by ad5791_init */
+
+/**
+ * Readback check counters of each device.
+*/
+typedef struct{
+  uint32_t checks;    /* registers compared */
+  uint32_t mismatch;  /* times any register differed from shadow */
+  uint32_t rewrites;  /* times shadow was written again */
+  uint32_t code;      /* registers read on last mismatch */
+  uint32_t ctrl;
+  uint32_t clrcode;
+}ad5791_check_def;
+#if AD5791_USE_SDO
+static ad5791_check_def check_stat[AD5791_DEV_NUM];
+static uint8_t check_enable = 1;
+static volatile uint8_t check_now = 0;
+#endif
+
+/**
+ * AD5791 write timing minimums in ns, from datasheet timing characteristics.
+*/
+#define AD5791_T1   28  /* SCLK cycle time */
+#define AD5791_T2   15  /* SCLK high time */
+#define AD5791_T3   15  /* SCLK low time */
+#define AD5791_T4   5   /* SYNC falling edge to SCLK falling edge setup time */
+#define AD5791_T5   2   /* SCLK falling edge to SYNC rising edge hold time */
+#define AD5791_T6   48  /* minimum SYNC high time */
+#define AD5791_T7   8   /* SYNC rising edge to next SCLK falling edge ignore */
+#define AD5791_T8   9   /* data setup time */
+#define AD5791_T9   12  /* data hold time */
+#define AD5791_T10  13  /* LDAC pulse width low */
+#define AD5791_T11  20  /* SYNC rising edge to LDAC falling edge */
+#define AD5791_T12  13  /* CLR pulse width low */
+#define AD5791_T13  13  /* RESET pulse width low */
+#define AD5791_T14  36  /* SCLK rising edge to SDO valid */
+#define AD5791_T1_RD 92 /* SCLK cycle time in readback and daisy chain mode */
+
+#define AD5791_MAX(a, b)  ((a)>(b)?(a):(b))
+
+/**
+ * The delay table is derived at compile time, AD5791_CORE_CLOCK must not be
+ * below SystemCoreClock, otherwise waits are too short (checked at init and by
+ * dactiming command).
+*/
+#define AD5791_CORE_CLOCK 64000000
+#define AD5791_NS2CYCLE(ns) (((ns)*(AD5791_CORE_CLOCK/1000000)+999)/1000)
+/**
+ * Each GPIO access is a STR through AHB that takes at least 2 cycles, so it
+ * already covers part of the timing.
+*/
+#define AD5791_IO_CYCLE     2
+#define AD5791_WAIT(ns)     (AD5791_NS2CYCLE(ns) > AD5791_IO_CYCLE ? AD5791_NS2CYCLE(ns) - AD5791_IO_CYCLE : 0)
+
+#define AD5791_SPIN_CYCLE   5   /* NOP + SUBS + taken branch */
+/**
+ * @brief busy wait at least the cycles given.
+ * @return none.
+*/
+static void _ad5791_spin(uint32_t cycles){
+  cycles = (cycles + AD5791_SPIN_CYCLE - 1)/AD5791_SPIN_CYCLE;
+  while(cycles--)
+    __NOP();
+}
+/* cycles is a constant, so zero wait is removed by compiler. */
+#define ad5791_delay(cycles) do{if(cycles) _ad5791_spin(cycles);}while(0)
+
+#if AD5791_TRANSPORT == AD5791_TRANSPORT_SPI_DMA
+static volatile uint8_t spi_busy = 0;
+static uint16_t spi_sync_pin;  /* SYNC of the frame on the way. */
+static uint8_t spi_txbuff[3*AD5791_DEV_NUM];
+static uint8_t spi_rxbuff[3*AD5791_DEV_NUM]; /* dummy, RX DMA is only used to know when the last bit is out. */
+/**
+ * @brief Init SPI1 and DMA channel2(RX)/channel3(TX) for AD5791.
+ * @return none.
+*/
+static void _ad5791_spi_init(void){
+  GPIO_InitTypeDef gpio_init;
+  SPI_InitTypeDef spi_init;
+  DMA_InitTypeDef dma_init;
+  NVIC_InitTypeDef nvic;
+  RCC_APB2PeriphClockCmd(RCC_APB2Periph_SPI1, ENABLE);
+  RCC_AHBPeriphClockCmd(RCC_AHBPeriph_DMA1, ENABLE);
+
+  GPIO_PinAFConfig(GPIOA, GPIO_PinSource5, GPIO_AF_0);
+  GPIO_PinAFConfig(GPIOA, GPIO_PinSource7, GPIO_AF_0);
+  gpio_init.GPIO_Mode = GPIO_Mode_AF;
+  gpio_init.GPIO_OType = GPIO_OType_PP;
+  gpio_init.GPIO_Pin = GPIO_Pin_5|GPIO_Pin_7;
+  gpio_init.GPIO_PuPd = GPIO_PuPd_UP;
+  gpio_init.GPIO_Speed = GPIO_Speed_50MHz;
+  GPIO_Init(GPIOA, &gpio_init);
+#if AD5791_USE_SDO
+  GPIO_PinAFConfig(GPIOA, GPIO_PinSource6, GPIO_AF_0);
+  gpio_init.GPIO_Pin = AD5791_SDO_PIN;
+  GPIO_Init(GPIOA, &gpio_init);
+#endif
+
+  spi_init.SPI_Direction = SPI_Direction_2Lines_FullDuplex;
+  spi_init.SPI_Mode = SPI_Mode_Master;
+  spi_init.SPI_DataSize = SPI_DataSize_8b;
+  spi_init.SPI_CPOL = SPI_CPOL_High;  /* SCLK idles high, same as bit-bang. */
+  spi_init.SPI_CPHA = SPI_CPHA_1Edge; /* AD5791 latches SDIN on falling edge. */
+  spi_init.SPI_NSS = SPI_NSS_Soft;
+#if AD5791_DAISY_CHAIN
+  spi_init.SPI_BaudRatePrescaler = SPI_BaudRatePrescaler_4; /* PCLK 32MHz/4, chain needs t1 >= 92ns */
+#else
+  spi_init.SPI_BaudRatePrescaler = SPI_BaudRatePrescaler_2; /* PCLK 32MHz/2, t1 >= 28ns */
+#endif
+  spi_init.SPI_FirstBit = SPI_FirstBit_MSB;
+  spi_init.SPI_CRCPolynomial = 7;
+  SPI_Init(SPI1, &spi_init);
+  SPI_NSSInternalSoftwareConfig(SPI1, SPI_NSSInternalSoft_Set);
+  SPI_RxFIFOThresholdConfig(SPI1, SPI_RxFIFOThreshold_QF); /* RXNE on every byte. */
+
+  dma_init.DMA_PeripheralBaseAddr = (uint32_t)&SPI1->DR;
+  dma_init.DMA_BufferSize = 3;
+  dma_init.DMA_PeripheralInc = DMA_PeripheralInc_Disable;
+  dma_init.DMA_MemoryInc = DMA_MemoryInc_Enable;
+  dma_init.DMA_PeripheralDataSize = DMA_PeripheralDataSize_Byte;
+  dma_init.DMA_MemoryDataSize = DMA_MemoryDataSize_Byte;
+  dma_init.DMA_Mode = DMA_Mode_Normal;
+  dma_init.DMA_Priority = DMA_Priority_VeryHigh;
+  dma_init.DMA_M2M = DMA_M2M_Disable;
+  dma_init.DMA_MemoryBaseAddr = (uint32_t)spi_txbuff;
+  dma_init.DMA_DIR = DMA_DIR_PeripheralDST;
+  DMA_Init(DMA1_Channel3, &dma_init);
+  dma_init.DMA_MemoryBaseAddr = (uint32_t)spi_rxbuff;
+  dma_init.DMA_DIR = DMA_DIR_PeripheralSRC;
+  DMA_Init(DMA1_Channel2, &dma_init);
+  /**
+   * RX transfer completes only after the last bit is clocked out, so it's
+   * the right moment to rise SYNC.
+  */
+  DMA_ITConfig(DMA1_Channel2, DMA_IT_TC, ENABLE);
+  SPI_I2S_DMACmd(SPI1, SPI_I2S_DMAReq_Rx|SPI_I2S_DMAReq_Tx, ENABLE);
+  SPI_Cmd(SPI1, ENABLE);
+
+  nvic.NVIC_IRQChannel = DMA1_Channel2_3_IRQn;
+  nvic.NVIC_IRQChannelCmd = ENABLE;
+  nvic.NVIC_IRQChannelPriority = 0;
+  NVIC_Init(&nvic);
+}
+
+/**
+ * @brief frame is out, release SYNC and tell user.
+ * @return none.
 */
-static uint32_t dac_code20b = 0;
-static double vref_volt = 10.091741325f; /* 10V by default. */
+static void _ad5791_spi_done(void){
+  DMA1_Channel2->CCR &= ~DMA_CCR_EN;
+  DMA1_Channel3->CCR &= ~DMA_CCR_EN;
+  DMA1->IFCR = DMA_IFCR_CGIF2|DMA_IFCR_CGIF3;
+  AD5791_SYNC_H(spi_sync_pin);
+  spi_busy = 0;
+  if(done_callback)
+    done_callback();
+}
+
 /**
- * @brief A simple delay function used to meet AD5791 timing.
+ * @brief wait for last frame. DMA flag is polled directly so it's safe to call
+ * it from interrupt which has same or higher priority than DMA interrupt.
  * @return none.
 */
-static void _ad5791_delay(void){
-  volatile uint32_t i = 10;
-  while(i--);
+static void _ad5791_spi_wait(void){
+  while(spi_busy){
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    if(spi_busy && (DMA1->ISR & DMA_ISR_TCIF2))
+      _ad5791_spi_done();
+    __set_PRIMASK(primask);
+  }
 }
 
-#define ad5791_delay() _ad5791_delay()
 /**
- * @brief send out 24bits though serial port
+ * @brief send out n 24bit words in one SYNC frame though SPI1 with DMA, return
+ * without waiting.
  * @return none.
 */
-static void ad5791_send24b(uint32_t data){
-  uint8_t count = 0;
-  uint32_t mask = 1<<23;  /* start from MSB */
-  AD5791_SYNC_L();
-  for(;count<24;count++){
-    AD5791_SCLK_H();
-    if(mask&data)
-      AD5791_DIN_H();
-    else 
-      AD5791_DIN_L();
-    AD5791_SCLK_L();
-    ad5791_delay();
-    mask>>=1;
+static void ad5791_send(uint16_t sync_pin, const uint32_t *frame, uint32_t n){
+  uint32_t primask;
+  for(;;){  /* one frame at a time, interrupt may have started a new one. */
+    _ad5791_spi_wait();
+    primask = __get_PRIMASK();
+    __disable_irq();
+    if(!spi_busy) break;
+    __set_PRIMASK(primask);
   }
-  AD5791_SCLK_H();
-  AD5791_SYNC_H();
-  ad5791_delay(); //delay for signal SYNC
+  for(uint32_t i=0; i<n; i++){
+    spi_txbuff[i*3] = (uint8_t)(frame[i]>>16);
+    spi_txbuff[i*3+1] = (uint8_t)(frame[i]>>8);
+    spi_txbuff[i*3+2] = (uint8_t)frame[i];
+  }
+  spi_busy = 1;
+  spi_sync_pin = sync_pin;
+  AD5791_SYNC_L(sync_pin);
+  DMA1_Channel2->CNDTR = n*3;
+  DMA1_Channel3->CNDTR = n*3;
+  DMA1_Channel2->CCR |= DMA_CCR_EN;
+  DMA1_Channel3->CCR |= DMA_CCR_EN; /* TX request starts the clock. */
+  __set_PRIMASK(primask);
+}
+
+void DMA1_Channel2_3_IRQHandler(void){
+  if(DMA1->ISR & DMA_ISR_TCIF2)
+    _ad5791_spi_done();
 }
 
+#if AD5791_USE_SDO
 /**
- * @brief Write 24bit data to AD5791
+ * @brief slow SCLK down for readback, PCLK 32MHz/8 meets t1 >= 92ns.
+ * Must be called with interrupt disabled and no frame on the way.
  * @return none.
 */
-static void ad5791_write_data(uint32_t data){
-  ad5791_send24b(AD5791_CMD(AD5791REG_WDATA, data));
-  dac_code20b = data;
+static void _ad5791_slow_begin(void){
+  SPI1->CR1 &= ~SPI_CR1_SPE;
+  SPI1->CR1 = (SPI1->CR1 & ~SPI_CR1_BR) | SPI_BaudRatePrescaler_8;
+  SPI1->CR1 |= SPI_CR1_SPE;
 }
 
 /**
- * @brief ad5791 control registers setting.
+ * @brief restore SCLK after readback.
  * @return none.
 */
-static void ad5791_ctrl(uint32_t ctrl_set){
-  ad5791_send24b(AD5791_CMD(AD5791REG_CTRL, ctrl_set));
+static void _ad5791_slow_end(void){
+  SPI1->CR1 &= ~SPI_CR1_SPE;
+  SPI1->CR1 = (SPI1->CR1 & ~SPI_CR1_BR) |
+              (AD5791_DAISY_CHAIN ? SPI_BaudRatePrescaler_4 : SPI_BaudRatePrescaler_2);
+  SPI1->CR1 |= SPI_CR1_SPE;
+}
+
+/**
+ * @brief one 24bit frame by polling SPI1, DMA channels are idle so their
+ * requests are ignored.
+ * @return 24bits clocked in from SDO.
+*/
+static uint32_t _ad5791_xfer_slow(uint16_t sync_pin, uint32_t data){
+  uint32_t in = 0;
+  while(SPI1->SR & SPI_SR_RXNE)  /* drop anything left */
+    (void)*(__IO uint8_t *)&SPI1->DR;
+  AD5791_SYNC_L(sync_pin);
+  for(int32_t i=16; i>=0; i-=8){
+    *(__IO uint8_t *)&SPI1->DR = (uint8_t)(data>>i);
+    while(!(SPI1->SR & SPI_SR_RXNE));
+    in = (in<<8)|*(__IO uint8_t *)&SPI1->DR;
+  }
+  while(SPI1->SR & SPI_SR_BSY);
+  AD5791_SYNC_H(sync_pin);
+  ad5791_delay(AD5791_WAIT(AD5791_T6));
+  return in;
+}
+#endif
+
+#else
+/**
+ * Cycles to insert after each edge of the frame.
+*/
+#define AD5791_WAIT_SYNC_SETUP  AD5791_WAIT(AD5791_T4)
+#if AD5791_DAISY_CHAIN
+/* next device samples what SDO shifts out on rising edge. */
+#define AD5791_WAIT_SCLK_HIGH   AD5791_WAIT(AD5791_MAX(AD5791_T14+AD5791_T8, AD5791_T1_RD/2))
+#define AD5791_WAIT_SCLK_LOW    AD5791_WAIT(AD5791_MAX(AD5791_T9, AD5791_T1_RD/2))
+#else
+#define AD5791_WAIT_SCLK_HIGH   AD5791_WAIT(AD5791_MAX(AD5791_T2, AD5791_T8))
+#define AD5791_WAIT_SCLK_LOW    AD5791_WAIT(AD5791_MAX(AD5791_MAX(AD5791_T3, AD5791_T9), AD5791_T1-AD5791_T2))
+#endif
+#define AD5791_WAIT_SYNC_HIGH   AD5791_WAIT(AD5791_T6)
+
+/**
+ * BSRR word for bit n: SCLK goes high and DIN is set or reset in one write.
+*/
+#define AD5791_BIT_WORD(data, n) \
+  (AD5791_SCLK_PIN|((uint32_t)AD5791_DIN_PIN<<(((((data)>>(n))&1)^1)<<4)))
+/**
+ * Rising edge with data, then falling edge which AD5791 samples SDIN on.
+*/
+#define AD5791_CLOCK_BIT(n) do{\
+  GPIOA->BSRR = word[n];\
+  ad5791_delay(AD5791_WAIT_SCLK_HIGH);\
+  GPIOA->BRR = AD5791_SCLK_PIN;\
+  ad5791_delay(AD5791_WAIT_SCLK_LOW);\
+}while(0)
+
+/**
+ * @brief send out n 24bit words in one SYNC frame though serial port, MSB first.
+ * @return none.
+*/
+static void ad5791_send(uint16_t sync_pin, const uint32_t *frame, uint32_t n){
+  uint32_t word[24];
+  uint32_t primask;
+  for(uint32_t i=0; i<24; i++)
+    word[i] = AD5791_BIT_WORD(frame[0], i);
+  /* frame could be written from interrupt too, don't let them interleave. */
+  primask = __get_PRIMASK();
+  __disable_irq();
+  AD5791_SYNC_L(sync_pin);
+  ad5791_delay(AD5791_WAIT_SYNC_SETUP);
+  for(;;){
+    AD5791_CLOCK_BIT(23); AD5791_CLOCK_BIT(22); AD5791_CLOCK_BIT(21); AD5791_CLOCK_BIT(20);
+    AD5791_CLOCK_BIT(19); AD5791_CLOCK_BIT(18); AD5791_CLOCK_BIT(17); AD5791_CLOCK_BIT(16);
+    AD5791_CLOCK_BIT(15); AD5791_CLOCK_BIT(14); AD5791_CLOCK_BIT(13); AD5791_CLOCK_BIT(12);
+    AD5791_CLOCK_BIT(11); AD5791_CLOCK_BIT(10); AD5791_CLOCK_BIT(9);  AD5791_CLOCK_BIT(8);
+    AD5791_CLOCK_BIT(7);  AD5791_CLOCK_BIT(6);  AD5791_CLOCK_BIT(5);  AD5791_CLOCK_BIT(4);
+    AD5791_CLOCK_BIT(3);  AD5791_CLOCK_BIT(2);  AD5791_CLOCK_BIT(1);  AD5791_CLOCK_BIT(0);
+    if(--n == 0) break;
+    frame++;  /* chained word, SCLK just stays low a bit longer. */
+    for(uint32_t i=0; i<24; i++)
+      word[i] = AD5791_BIT_WORD(frame[0], i);
+  }
+  GPIOA->BSRR = AD5791_SCLK_PIN|sync_pin; /* SCLK back to idle and SYNC high */
+  ad5791_delay(AD5791_WAIT_SYNC_HIGH);
+  __set_PRIMASK(primask);
+  if(done_callback)
+    done_callback();
+}
+
+#if AD5791_USE_SDO
+/**
+ * Readback clock, SDO is valid t14 after rising edge and sampled right before
+ * the falling edge.
+*/
+#define AD5791_WAIT_RD_HIGH     AD5791_WAIT(AD5791_MAX(AD5791_T14, AD5791_T1_RD/2))
+#define AD5791_WAIT_RD_LOW      AD5791_WAIT(AD5791_T1_RD/2)
+
+#define _ad5791_slow_begin()
+#define _ad5791_slow_end()
+
+/**
+ * @brief one 24bit frame with readback clock, not performance critical so
+ * it's a plain loop. Must be called with interrupt disabled.
+ * @return 24bits clocked in from SDO.
+*/
+static uint32_t _ad5791_xfer_slow(uint16_t sync_pin, uint32_t data){
+  uint32_t in = 0;
+  AD5791_SYNC_L(sync_pin);
+  ad5791_delay(AD5791_WAIT_SYNC_SETUP);
+  for(int32_t n=23; n>=0; n--){
+    GPIOA->BSRR = AD5791_BIT_WORD(data, n);
+    ad5791_delay(AD5791_WAIT_RD_HIGH);
+    in = (in<<1)|((GPIOA->IDR & AD5791_SDO_PIN) != 0);
+    GPIOA->BRR = AD5791_SCLK_PIN;
+    ad5791_delay(AD5791_WAIT_RD_LOW);
+  }
+  GPIOA->BSRR = AD5791_SCLK_PIN|sync_pin;
+  ad5791_delay(AD5791_WAIT_SYNC_HIGH);
+  return in;
+}
+#endif
+#endif
+
+/**
+ * @brief write one register of a device. In daisy chain the others get a NOP,
+ * the first word shifted out ends up in the farthest device.
+ * @return none.
+*/
+static void ad5791_dev_cmd(ad5791_dev_def *dev, uint32_t cmd){
+#if AD5791_DAISY_CHAIN
+  uint32_t frame[AD5791_DEV_NUM];
+  for(uint32_t i=0; i<AD5791_DEV_NUM; i++)
+    frame[i] = AD5791_CMD(AD5791REG_NOP, 0);
+  frame[AD5791_DEV_NUM-1-dev->ch] = cmd;
+  ad5791_send(dev->sync_pin, frame, AD5791_DEV_NUM);
+#else
+  ad5791_send(dev->sync_pin, &cmd, 1);
+#endif
+  frame_stat.issued++;
+}
+
+/**
+ * @brief write cmd[ch] to every channel, in one frame if they are chained.
+ * @return none.
+*/
+static void ad5791_cmd_all(const uint32_t *cmd){
+#if AD5791_DAISY_CHAIN
+  uint32_t frame[AD5791_DEV_NUM];
+  for(uint32_t i=0; i<AD5791_DEV_NUM; i++)
+    frame[AD5791_DEV_NUM-1-i] = cmd[i];
+  ad5791_send(dev_list[0].sync_pin, frame, AD5791_DEV_NUM);
+  frame_stat.issued++;
+#else
+  for(uint32_t i=0; i<AD5791_DEV_NUM; i++)
+    ad5791_send(dev_list[i].sync_pin, &cmd[i], 1);
+  frame_stat.issued += AD5791_DEV_NUM;
+#endif
+}
+
+/**
+ * @brief write the same register value to every channel.
+ * @return none.
+*/
+static void ad5791_cmd_same(uint32_t addr, uint32_t data){
+  uint32_t cmd[AD5791_DEV_NUM];
+  for(uint32_t i=0; i<AD5791_DEV_NUM; i++)
+    cmd[i] = AD5791_CMD(addr, data);
+  ad5791_cmd_all(cmd);
+}
+
+/**
+ * @brief get device context of channel ch.
+ * @return the device, or 0 if there isn't such channel.
+*/
+ad5791_dev_def *ad5791_get_dev(uint32_t ch){
+  if(ch >= AD5791_DEV_NUM) return 0;
+  return &dev_list[ch];
+}
+
+/**
+ * @brief Write 20bit code to DAC register of one device. No float math here, so
+ * it's also used by sample engines from timer interrupt.
+ * @return none.
+*/
+void ad5791_dev_write_data(ad5791_dev_def *dev, uint32_t data){
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq();  /* keep shadow code in step with the frame */
+  if(safe_mode != ad5791_safe_clear)
+    ad5791_dev_cmd(dev, AD5791_CMD(AD5791REG_WDATA, data));
+  dev->code = data&0xfffff;
+  dev->pending = 0; /* a direct write wins over a coalesced setpoint */
+  __set_PRIMASK(primask);
+}
+
+/**
+ * @brief setpoint write. It's dropped if DAC has the code already. If last
+ * setpoint frame was sent less than min interval ago it's kept pending and
+ * ad5791_poll writes the latest one when interval is over, so a burst of
+ * changes(like spinning encoder) costs one frame per interval.
+ * The cycle counter wraps every 262ms, an old last_write may look recent and
+ * delay a setpoint by one interval at most.
+ * @return none.
+*/
+void ad5791_dev_update(ad5791_dev_def *dev, uint32_t code){
+  uint32_t primask = __get_PRIMASK();
+  code &= 0xfffff;
+  __disable_irq();
+  if(code == dev->code){
+    if(dev->pending)
+      frame_stat.coalesced++;
+    dev->pending = 0;
+    frame_stat.skipped++;
+  }
+  else if(min_interval && timer_cycle_elapsed(dev->last_write) < min_interval){
+    if(dev->pending)
+      frame_stat.coalesced++;
+    dev->pending = code|AD5791_PENDING;
+  }
+  else{
+    ad5791_dev_write_data(dev, code);
+    dev->last_write = timer_cycle_get();
+  }
+  __set_PRIMASK(primask);
+}
+
+/**
+ * @brief latest setpoint, it's in DAC already or pending.
+ * @return 20bit code.
+*/
+uint32_t ad5791_dev_setpoint(const ad5791_dev_def *dev){
+  uint32_t pending = dev->pending;
+  return pending ? pending&0xfffff : dev->code;
+}
+
+/**
+ * @brief write pending setpoints whose interval is over.
+ * @return none.
+*/
+static void ad5791_update_poll(void){
+  ad5791_dev_def *dev;
+  uint32_t primask;
+  for(uint32_t i=0; i<AD5791_DEV_NUM; i++){
+    dev = &dev_list[i];
+    if(dev->pending == 0 || timer_cycle_elapsed(dev->last_write) < min_interval)
+      continue;
+    primask = __get_PRIMASK();
+    __disable_irq();
+    if(dev->pending){ /* an engine may have written it meanwhile */
+      ad5791_dev_write_data(dev, dev->pending);
+      dev->last_write = timer_cycle_get();
+    }
+    __set_PRIMASK(primask);
+  }
+}
+
+/**
+ * @brief set min interval between setpoint frames of one device.
+ * @param us: 0 to 262000, 0 turns coalescing off.
+ * @return none.
+*/
+void ad5791_set_min_interval(uint32_t us){
+  uint64_t cycles = (uint64_t)us*SystemCoreClock/1000000;
+  min_interval = cycles > 0xffffff ? 0xffffff : (uint32_t)cycles;
+  min_interval_us = (uint32_t)((uint64_t)min_interval*1000000/SystemCoreClock);
+}
+
+/**
+ * @brief get frame counters.
+ * @param clear: clear counters after reading.
+ * @return none.
+*/
+void ad5791_frame_stat(ad5791_frame_stat_def *stat, uint32_t clear){
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq();
+  *stat = frame_stat;
+  if(clear)
+    memset(&frame_stat, 0, sizeof(frame_stat));
+  __set_PRIMASK(primask);
+}
+
+/**
+ * @brief Write 20bit code to AD5791 DAC register of channel 0.
+ * @return none.
+*/
+void ad5791_write_data(uint32_t data){
+  ad5791_dev_write_data(&dev_list[0], data);
+}
+
+/**
+ * @brief send cmd[ch] to every channel so that all outputs update together.
+ * @return 0 if ok, -1 if channels had to be updated one by one(no LDAC).
+*/
+static int32_t ad5791_cmd_sync(const uint32_t *cmd){
+#if AD5791_DAISY_CHAIN || AD5791_DEV_NUM == 1
+  ad5791_cmd_all(cmd);
+  return 0;
+#elif AD5791_USE_LDAC
+  if(GPIOA->ODR & AD5791_LDAC_PIN)
+    ad5791_cmd_all(cmd);
+  else{
+    AD5791_LDAC_H();
+    ad5791_cmd_all(cmd);
+    ad5791_flush();
+    ad5791_delay(AD5791_WAIT(AD5791_T11));
+    AD5791_LDAC_L();  /* stays low, every write updates output again. */
+  }
+  return 0;
+#else
+  ad5791_cmd_all(cmd);
+  return -1;
+#endif
+}
+
+/**
+ * @brief update all channels at the same moment, code[ch] for each channel.
+ * Daisy chain gets all codes in one frame and updates on SYNC rising edge.
+ * With separate SYNC lines, codes are preloaded with LDAC high then one LDAC
+ * pulse updates them together. If LDAC is held already(latch mode), codes are
+ * only preloaded and wait for the latch.
+ * @return 0 if ok, -1 if channels had to be updated one by one(no LDAC).
+*/
+int32_t ad5791_write_all(const uint32_t *code){
+  uint32_t cmd[AD5791_DEV_NUM];
+  int32_t ret = 0;
+  uint32_t primask;
+  for(uint32_t i=0; i<AD5791_DEV_NUM; i++)
+    cmd[i] = AD5791_CMD(AD5791REG_WDATA, code[i]);
+  primask = __get_PRIMASK();
+  __disable_irq();
+  if(safe_mode != ad5791_safe_clear)
+    ret = ad5791_cmd_sync(cmd);
+  for(uint32_t i=0; i<AD5791_DEV_NUM; i++){
+    dev_list[i].code = code[i]&0xfffff;
+    dev_list[i].pending = 0;
+  }
+  __set_PRIMASK(primask);
+  return ret;
+}
+
+/**
+ * @brief control word to send, shadow plus the bits of safe state.
+ * @return 20bit control register content.
+*/
+static uint32_t ad5791_ctrl_word(const ad5791_dev_def *dev){
+  if(safe_mode == ad5791_safe_ground)
+    return dev->ctrl|AD5791CTRL_OPGND_TOGND;
+  if(safe_mode == ad5791_safe_tristate)
+    return dev->ctrl|AD5791CTRL_OUT_TRISTATE;
+  return dev->ctrl;
+}
+
+/**
+ * @brief send control register of devices whose shadow changed. Chained
+ * devices get it in one frame, NOP for the others.
+ * @return none.
+*/
+static void ad5791_ctrl_send(void){
+#if AD5791_DAISY_CHAIN
+  uint32_t cmd[AD5791_DEV_NUM];
+#endif
+  if(ctrl_dirty == 0) return;
+#if AD5791_DAISY_CHAIN
+  for(uint32_t i=0; i<AD5791_DEV_NUM; i++){
+    if(ctrl_dirty & (1<<i))
+      cmd[i] = AD5791_CMD(AD5791REG_CTRL, ad5791_ctrl_word(&dev_list[i]));
+    else
+      cmd[i] = AD5791_CMD(AD5791REG_NOP, 0);
+  }
+  ad5791_cmd_all(cmd);
+#else
+  for(uint32_t i=0; i<AD5791_DEV_NUM; i++){
+    if(ctrl_dirty & (1<<i))
+      ad5791_dev_cmd(&dev_list[i], AD5791_CMD(AD5791REG_CTRL, ad5791_ctrl_word(&dev_list[i])));
+  }
+#endif
+  ctrl_dirty = 0;
+}
+
+/**
+ * @brief read-modify-write fields of control register shadow, bits in mask
+ * are taken from value. Frame is only sent if shadow changed, and it's held
+ * until ad5791_ctrl_commit inside a begin/commit pair.
+ * @return none.
+*/
+void ad5791_dev_ctrl_modify(ad5791_dev_def *dev, uint32_t mask, uint32_t value){
+  uint32_t ctrl;
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq();
+  ctrl = (dev->ctrl & ~mask)|(value & mask);
+  if(ctrl != dev->ctrl){
+    dev->ctrl = ctrl;
+    ctrl_dirty |= 1<<dev->ch;
+  }
+  if(ctrl_batch == 0)
+    ad5791_ctrl_send();
+  __set_PRIMASK(primask);
+}
+
+/**
+ * @brief start a batch of control register changes, they can be nested.
+ * @return none.
+*/
+void ad5791_ctrl_begin(void){
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq();
+  ctrl_batch++;
+  __set_PRIMASK(primask);
+}
+
+/**
+ * @brief end a batch, changed control registers are sent when the outermost
+ * batch ends, one frame per device at most.
+ * @return none.
+*/
+void ad5791_ctrl_commit(void){
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq();
+  if(ctrl_batch && --ctrl_batch == 0)
+    ad5791_ctrl_send();
+  __set_PRIMASK(primask);
+}
+
+/**
+ * @brief line compensation band for reference span.
+ * @return COMP field of control register.
+*/
+static uint32_t ad5791_comp_band(uint64_t vref_nv){
+  if(vref_nv <= 10000000000ull) return AD5791CTRL_COMP10V;
+  if(vref_nv <= 12000000000ull) return AD5791CTRL_COMP10V_12V;
+  if(vref_nv <= 16000000000ull) return AD5791CTRL_COMP12V_16V;
+  if(vref_nv <= 19000000000ull) return AD5791CTRL_COMP16V_19V;
+  return AD5791CTRL_COMP19V_20V;
 }
 
 /**
@@ -112,7 +779,78 @@ static void ad5791_ctrl(uint32_t ctrl_set){
  * @return none.
 */
 static void ad5791_set_clrcode(uint32_t data){
-  ad5791_send24b(AD5791_CMD(AD5791REG_CLRCODE, data));
+  for(uint32_t i=0; i<AD5791_DEV_NUM; i++)
+    dev_list[i].clrcode = data&0xfffff;
+  ad5791_cmd_same(AD5791REG_CLRCODE, data);
+}
+
+/**
+ * @brief set clear code of one device, it's output in clear safe state.
+ * @return none.
+*/
+void ad5791_dev_set_clrcode(ad5791_dev_def *dev, uint32_t code){
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq();
+  dev->clrcode = code&0xfffff;
+  ad5791_dev_cmd(dev, AD5791_CMD(AD5791REG_CLRCODE, code));
+  __set_PRIMASK(primask);
+}
+
+/**
+ * @brief put every channel into safe state, it's safe to call from interrupt.
+ * Time is bounded: the frame on the wire is finished, then one frame per
+ * SYNC line(one frame in total if chained) with interrupts off. Nothing is
+ * done if it's in safe state already.
+ * @return none.
+*/
+void ad5791_safe_enter(ad5791_safe_def mode){
+  uint32_t cmd[AD5791_DEV_NUM];
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq();
+  if(mode == ad5791_safe_off || safe_mode != ad5791_safe_off){
+    __set_PRIMASK(primask);
+    return;
+  }
+  ad5791_flush();
+  for(uint32_t i=0; i<AD5791_DEV_NUM; i++){
+    if(mode == ad5791_safe_clear)
+      cmd[i] = AD5791_CMD(AD5791REG_SCTRL, AD5791SCTRL_CLR);
+    else
+      cmd[i] = AD5791_CMD(AD5791REG_CTRL, dev_list[i].ctrl|
+               (mode == ad5791_safe_ground ? AD5791CTRL_OPGND_TOGND : AD5791CTRL_OUT_TRISTATE));
+  }
+  ad5791_cmd_all(cmd);
+  ad5791_flush();
+  safe_mode = mode;
+  __set_PRIMASK(primask);
+}
+
+/**
+ * @brief back to normal output from shadow registers, one frame per SYNC line.
+ * Clear mode writes the setpoint, clamp and tristate write control register.
+ * @return none.
+*/
+void ad5791_safe_exit(void){
+  uint32_t cmd[AD5791_DEV_NUM];
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq();
+  if(safe_mode == ad5791_safe_off){
+    __set_PRIMASK(primask);
+    return;
+  }
+  for(uint32_t i=0; i<AD5791_DEV_NUM; i++){
+    if(safe_mode == ad5791_safe_clear)
+      cmd[i] = AD5791_CMD(AD5791REG_WDATA, dev_list[i].code);
+    else
+      cmd[i] = AD5791_CMD(AD5791REG_CTRL, dev_list[i].ctrl);
+  }
+  ad5791_cmd_sync(cmd);
+  safe_mode = ad5791_safe_off;
+  __set_PRIMASK(primask);
+}
+
+ad5791_safe_def ad5791_safe_state(void){
+  return safe_mode;
 }
 
 /**
@@ -120,48 +858,235 @@ static void ad5791_set_clrcode(uint32_t data){
  * @return none.
 */
 static void ad5791_sctrl(uint32_t ctrl_set){
-  ad5791_send24b(AD5791_CMD(AD5791REG_SCTRL, ctrl_set));
+  ad5791_cmd_same(AD5791REG_SCTRL, ctrl_set);
+}
+
+#if AD5791_USE_SDO
+/**
+ * @brief read one register, a read command then a NOP frame that clocks data out.
+ * @return the 20bit register content.
+*/
+static uint32_t ad5791_dev_read(ad5791_dev_def *dev, uint32_t addr){
+  _ad5791_xfer_slow(dev->sync_pin, AD5791_CMD_READ(addr));
+  return _ad5791_xfer_slow(dev->sync_pin, AD5791_CMD(AD5791REG_NOP, 0))&0xfffff;
+}
+
+/**
+ * @brief timer callback, start a background check in next poll.
+ * @return none.
+*/
+static void ad5791_check_timer(void){
+  check_now = 1;
+}
+#endif
+
+/**
+ * @brief read DAC, control and clear code registers back over SDO. If SDO is
+ * disabled on this device it's enabled just for the reading.
+ * @return 0 if ok, -1 if SDO is not wired on this board.
+*/
+int32_t ad5791_dev_readback(ad5791_dev_def *dev, uint32_t *code, uint32_t *ctrl, uint32_t *clrcode){
+#if AD5791_USE_SDO
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq();
+  ad5791_flush();
+  _ad5791_slow_begin();
+  if(dev->ctrl & AD5791CTRL_SDO_DIS)
+    _ad5791_xfer_slow(dev->sync_pin, AD5791_CMD(AD5791REG_CTRL, ad5791_ctrl_word(dev) & ~AD5791CTRL_SDO_DIS));
+  *code = ad5791_dev_read(dev, AD5791REG_WDATA);
+  *ctrl = ad5791_dev_read(dev, AD5791REG_CTRL);
+  *clrcode = ad5791_dev_read(dev, AD5791REG_CLRCODE);
+  if(dev->ctrl & AD5791CTRL_SDO_DIS){
+    _ad5791_xfer_slow(dev->sync_pin, AD5791_CMD(AD5791REG_CTRL, ad5791_ctrl_word(dev)));
+    *ctrl |= AD5791CTRL_SDO_DIS;  /* report it as it normally is */
+  }
+  _ad5791_slow_end();
+  __set_PRIMASK(primask);
+  return 0;
+#else
+  return -1;
+#endif
+}
+
+/**
+ * @brief compare registers with shadow copies, write all of them again from
+ * shadow if any differs.
+ * @return 0 if they match, 1 if mismatch was fixed, -1 if SDO is not wired.
+*/
+int32_t ad5791_dev_verify(ad5791_dev_def *dev){
+#if AD5791_USE_SDO
+  uint32_t code, ctrl, clrcode;
+  ad5791_check_def *stat = &check_stat[dev->ch];
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq();  /* shadow must not change before compare */
+  ad5791_dev_readback(dev, &code, &ctrl, &clrcode);
+  stat->checks++;
+  if(code == dev->code && ((ctrl^dev->ctrl)&AD5791CTRL_MASK) == 0 && clrcode == dev->clrcode){
+    __set_PRIMASK(primask);
+    return 0;
+  }
+  stat->mismatch++;
+  stat->code = code;
+  stat->ctrl = ctrl;
+  stat->clrcode = clrcode;
+  ad5791_dev_cmd(dev, AD5791_CMD(AD5791REG_CTRL, ad5791_ctrl_word(dev)));
+  ad5791_dev_cmd(dev, AD5791_CMD(AD5791REG_CLRCODE, dev->clrcode));
+  ad5791_dev_cmd(dev, AD5791_CMD(AD5791REG_WDATA, dev->code));
+  stat->rewrites++;
+  __set_PRIMASK(primask);
+  return 1;
+#else
+  return -1;
+#endif
+}
+
+/**
+ * @brief background readback check, one device each period. Skipped while a
+ * sample engine owns the DAC since it would hold off the sample interrupt, and
+ * in safe state where registers differ from shadow on purpose.
+ * @return none.
+*/
+void ad5791_poll(void){
+#if AD5791_USE_SDO
+  static uint32_t ch = 0;
+#endif
+  ad5791_update_poll();
+#if AD5791_USE_SDO
+  if(check_now == 0) return;
+  check_now = 0;
+  if(!check_enable || timer_sample_owner() != 0 || safe_mode != ad5791_safe_off) return;
+  if(ad5791_dev_verify(&dev_list[ch]) > 0)
+    LOG_W("DAC%d registers lost, rewritten", ch);
+  if(++ch >= AD5791_DEV_NUM) ch = 0;
+#endif
 }
 
 /**
  * @brief Init AD5791 related GPIO peripheral etc.
  * @return none.
- * SYNC-->PA4, SCLK-->PA5 DIN-->PA3
+ * SYNC-->PA5, SCLK-->PA4 DIN-->PA3, other SYNC lines from AD5791_SYNC_PINS.
 */
 void ad5791_init(void){
   GPIO_InitTypeDef gpio_init;
+  uint16_t sync_mask = 0;
+  ad5791_ctrl_begin();  /* control words are sent after reset */
+#if AD5791_TRANSPORT == AD5791_TRANSPORT_BITBANG
+  if(SystemCoreClock > AD5791_CORE_CLOCK)
+    LOG_W("timing table is for %uHz, core runs at %uHz", AD5791_CORE_CLOCK, SystemCoreClock);
+#endif
+  ad5791_set_min_interval(min_interval_us);
+  for(uint32_t i=0; i<AD5791_DEV_NUM; i++){
+    dev_list[i].ch = i;
+    dev_list[i].sync_pin = sync_pins[AD5791_DAISY_CHAIN ? 0 : i];
+    dev_list[i].ctrl = AD5791CTRL_A1_OFF|AD5791CTRL_CODE_BIN|AD5791CTRL_OPGND_NORMAL|\
+                       AD5791CTRL_OUT_NORMAL|AD5791CTRL_SDO;
+    /* keep the value already calibrated, compensation band is set from it */
+    ad5791_dev_set_vref_nv(&dev_list[i], dev_list[i].vref_nv ? dev_list[i].vref_nv : AD5791_VREF_DEFAULT_NV);
+    sync_mask |= dev_list[i].sync_pin;
+  }
   RCC_AHBPeriphClockCmd(RCC_AHBPeriph_GPIOA, ENABLE);
   gpio_init.GPIO_Mode = GPIO_Mode_OUT;
   gpio_init.GPIO_OType = GPIO_OType_PP;
-  gpio_init.GPIO_Pin = GPIO_Pin_3|GPIO_Pin_4|GPIO_Pin_5;
   gpio_init.GPIO_PuPd = GPIO_PuPd_UP;
   gpio_init.GPIO_Speed = GPIO_Speed_50MHz;
+#if AD5791_TRANSPORT == AD5791_TRANSPORT_SPI_DMA
+  gpio_init.GPIO_Pin = sync_mask;
   GPIO_Init(GPIOA, &gpio_init);
-  AD5791_SYNC_H();
+  AD5791_SYNC_H(sync_mask);
+  _ad5791_spi_init();
+#else
+  gpio_init.GPIO_Pin = AD5791_SCLK_PIN|AD5791_DIN_PIN|sync_mask;
+  GPIO_Init(GPIOA, &gpio_init);
+  AD5791_SYNC_H(sync_mask);
   AD5791_SCLK_H();
   AD5791_DIN_L();
+#endif
+
+#if AD5791_USE_LDAC
+  gpio_init.GPIO_Pin = AD5791_LDAC_PIN;
+  GPIO_Init(GPIOA, &gpio_init);
+  AD5791_LDAC_L();  /* output follows every write until a latch mode is used. */
+#endif
+
+#if AD5791_USE_SDO && AD5791_TRANSPORT == AD5791_TRANSPORT_BITBANG
+  gpio_init.GPIO_Mode = GPIO_Mode_IN;
+  gpio_init.GPIO_Pin = AD5791_SDO_PIN;
+  GPIO_Init(GPIOA, &gpio_init);
+#endif
 
   ad5791_sctrl(AD5791SCTRL_RST|AD5791SCTRL_LDAC);
-  ad5791_ctrl(AD5791CTRL_A1_OFF|AD5791CTRL_CODE_BIN|AD5791CTRL_COMP10V|AD5791CTRL_OPGND_NORMAL|\
-                AD5791CTRL_OUT_NORMAL|AD5791CTRL_SDO_DIS);
-  ad5791_ctrl(AD5791CTRL_A1_OFF|AD5791CTRL_CODE_BIN|AD5791CTRL_COMP10V|AD5791CTRL_OPGND_NORMAL|\
-                AD5791CTRL_OUT_NORMAL|AD5791CTRL_SDO_DIS);
+  ctrl_dirty = (1<<AD5791_DEV_NUM) - 1;
+  ad5791_ctrl_commit();
   ad5791_set_clrcode(0);
-  ad5791_write_data(0x00000);
+  ad5791_cmd_same(AD5791REG_WDATA, 0x00000);
+  for(uint32_t i=0; i<AD5791_DEV_NUM; i++)
+    dev_list[i].code = 0;
+#if AD5791_USE_SDO
+  timer_register(ad5791_check_timer, AD5791_CHECK_PERIOD);
+#endif
+}
+
+/**
+ * @brief set reference voltage of one device, conversion scales are derived here.
+ * @return none.
+*/
+void ad5791_dev_set_vref_nv(ad5791_dev_def *dev, uint64_t nv){
+  ad5791_dev_set_scale(dev, nv);
+  ad5791_dev_ctrl_modify(dev, AD5791CTRL_COMP_MASK, ad5791_comp_band(dev->vref_nv));
+}
+
+/**
+ * @brief set the volatage of one device. unit is nV
+ * @return the real voltage in nV.
+*/
+uint64_t ad5791_dev_set_nv(ad5791_dev_def *dev, uint64_t nv){
+  uint32_t code = ad5791_dev_nv2code(dev, nv);
+  ad5791_dev_update(dev, code);
+  return ad5791_dev_code2nv(dev, code);
+}
+
+/**
+ * @brief set the volatage of one device. unit is uV
+ * @return the real voltage in uV.
+*/
+uint32_t ad5791_dev_set_uv(ad5791_dev_def *dev, uint32_t uv){
+  return (uint32_t)((ad5791_dev_set_nv(dev, (uint64_t)uv*1000) + 500)/1000);
 }
 
 /**
- * @brief set the volatage. unit is V
+ * @brief get output voltage of one device from its code.
+ * @return voltage in nV.
+*/
+uint64_t ad5791_dev_get_nv(const ad5791_dev_def *dev){
+  return ad5791_dev_code2nv(dev, dev->code);
+}
+
+/**
+ * @brief set the volatage of one device. unit is V, resolved to 1nV.
  * @param volt: the desired voltage in V
  * @return the real voltage in V.
 */
-float ad5791_set_volt(float volt){
-  uint32_t code;
-  code = (uint32_t)(volt/vref_volt*0xfffff + 0.5f);
-  if(code > 0xfffff) code = 0xfffff;
-  ad5791_write_data(code);
-  code &= 0xfffff;
-  return code*vref_volt/0xfffff;
+double ad5791_dev_set_volt(ad5791_dev_def *dev, double volt){
+  return ad5791_dev_set_nv(dev, ad5791_volt2nv(volt))*1e-9;
+}
+
+/**
+ * @brief set output code of one device directly. Code isn't corrected, but
+ * returned voltage includes INL of that code.
+ * @return the real voltage in V.
+*/
+float ad5791_dev_set_code(ad5791_dev_def *dev, uint32_t code){
+  ad5791_dev_update(dev, code);
+  return ad5791_dev_code2nv(dev, code)*1e-9f;
+}
+
+/**
+ * @brief set the volatage of channel 0. unit is V
+ * @param volt: the desired voltage in V
+ * @return the real voltage in V.
+*/
+double ad5791_set_volt(double volt){
+  return ad5791_dev_set_volt(&dev_list[0], volt);
 }
 
 /**
@@ -170,29 +1095,372 @@ float ad5791_set_volt(float volt){
 */
 float ad5791_set_code(uint32_t code)
 {
-  ad5791_write_data(code&0xfffff);
-  return code*vref_volt/0xfffff;
+  return ad5791_dev_set_code(&dev_list[0], code);
 }
 
 /**
  * @brief get ad5791 output code directly. This doesn't include calibration correction.
- * @return none.
+ * @return latest setpoint, it may be pending.
 */
 int32_t ad5791_get_code(void)
 {
-  return dac_code20b;
+  return ad5791_dev_setpoint(&dev_list[0]);
 }
 
 /**
  * Return reference voltage
 */
 double ad5791_get_vref(void){
-  return vref_volt;
+  return dev_list[0].vref_nv*1e-9;
 }
 
 /**
  * Set the ad5791 reference voltage value
 */
 void ad5791_set_vref(double volt){
-  vref_volt = volt;
+  ad5791_dev_set_vref_nv(&dev_list[0], volt > 0 ? (uint64_t)(volt*1e9 + 0.5) : 0);
+}
+
+/**
+ * @brief set the function called after every frame is out.
+ * With SPI+DMA transport it's called from DMA interrupt.
+ * @return none.
+*/
+void ad5791_set_callback(ad5791_callback callback){
+  done_callback = callback;
+}
+
+/**
+ * @brief block until the last frame is out.
+ * @return none.
+*/
+void ad5791_flush(void){
+#if AD5791_TRANSPORT == AD5791_TRANSPORT_SPI_DMA
+  _ad5791_spi_wait();
+#endif
+}
+
+/**
+ * @brief hold LDAC high so written codes are only preloaded, or release it so
+ * every write updates output.
+ * @return 0 if ok, -1 if LDAC is not wired on this board.
+*/
+int32_t ad5791_ldac_hold(uint32_t hold){
+#if AD5791_USE_LDAC
+  if(hold)
+    AD5791_LDAC_H();
+  else
+    AD5791_LDAC_L();
+  return 0;
+#else
+  return -1;
+#endif
+}
+
+/**
+ * @brief check if LDAC is held high, written codes wait for a latch then.
+ * @return 1 if held.
+*/
+int32_t ad5791_ldac_held(void){
+#if AD5791_USE_LDAC
+  return (GPIOA->ODR & AD5791_LDAC_PIN) != 0;
+#else
+  return 0;
+#endif
+}
+
+/**
+ * @brief pulse LDAC low, preloaded codes go to output on the falling edge.
+ * LDAC is left high for next preload.
+ * @return none.
+*/
+void ad5791_ldac_pulse(void){
+#if AD5791_USE_LDAC
+  ad5791_flush();
+  AD5791_LDAC_L();
+  ad5791_delay(AD5791_WAIT(AD5791_T10));
+  AD5791_LDAC_H();
+#endif
+}
+
+/**
+ * @brief put LDAC back to high after DMA pulled it low, ready for next latch.
+ * @return none.
+*/
+void ad5791_ldac_rearm(void){
+#if AD5791_USE_LDAC
+  AD5791_LDAC_H();
+#endif
+}
+
+/**
+ * @brief let DMA1 channel1(TIM17_UP request) pull LDAC low on every sample
+ * clock update event, so latch time doesn't depend on interrupt latency.
+ * @return none.
+*/
+void ad5791_ldac_dma(uint32_t enable){
+#if AD5791_USE_LDAC
+  DMA_InitTypeDef dma_init;
+  DMA_Cmd(DMA1_Channel1, DISABLE);
+  if(!enable) return;
+  RCC_AHBPeriphClockCmd(RCC_AHBPeriph_DMA1, ENABLE);
+  dma_init.DMA_PeripheralBaseAddr = (uint32_t)&GPIOA->BRR;
+  dma_init.DMA_MemoryBaseAddr = (uint32_t)&ldac_pin_mask;
+  dma_init.DMA_DIR = DMA_DIR_PeripheralDST;
+  dma_init.DMA_BufferSize = 1;
+  dma_init.DMA_PeripheralInc = DMA_PeripheralInc_Disable;
+  dma_init.DMA_MemoryInc = DMA_MemoryInc_Disable;
+  dma_init.DMA_PeripheralDataSize = DMA_PeripheralDataSize_HalfWord;
+  dma_init.DMA_MemoryDataSize = DMA_MemoryDataSize_HalfWord;
+  dma_init.DMA_Mode = DMA_Mode_Circular;
+  dma_init.DMA_Priority = DMA_Priority_VeryHigh;
+  dma_init.DMA_M2M = DMA_M2M_Disable;
+  DMA_Init(DMA1_Channel1, &dma_init);
+  DMA_Cmd(DMA1_Channel1, ENABLE);
+#endif
+}
+
+/**
+ * @brief software LDAC: output the preloaded code now, on all channels.
+ * @return none.
+*/
+void ad5791_latch(void){
+  ad5791_sctrl(AD5791SCTRL_LDAC);
+  ad5791_flush();
+}
+
+/**
+ * @brief measure the DAC update rate of transport in use.
+ * Current code is re-written so output doesn't change.
+*/
+static int32_t ush_dac_bench(uint32_t argc, char **argv){
+  uint32_t count = 1000;
+  uint32_t cycles = 0, start;
+  uint32_t code = dev_list[0].code;
+  ush_num_def numtype;
+  if(argc >= 2){
+    if(ush_str2num(argv[1], strlen(argv[1]), &numtype, &count) != ush_error_ok ||
+       numtype == ush_num_float || count == 0 || count > 100000){
+      USH_Print("count should be 1 to 100000\n");
+      return -1;
+    }
+  }
+  for(uint32_t i=0; i<count; i++){
+    start = timer_cycle_get();
+    ad5791_write_data(code);
+    cycles += timer_cycle_elapsed(start);
+  }
+  start = timer_cycle_get();
+  ad5791_flush();
+  cycles += timer_cycle_elapsed(start);
+#if AD5791_TRANSPORT == AD5791_TRANSPORT_SPI_DMA
+  USH_Print("transport: spi+dma\n");
+#else
+  USH_Print("transport: bit-bang\n");
+#endif
+  USH_Print("frames: %u, cycles: %u at %uHz\n", count, cycles, SystemCoreClock);
+  USH_Print("%u ns per update, %u updates/s\n", timer_cycle2ns(cycles/count),
+            (uint32_t)((uint64_t)count*SystemCoreClock/cycles));
+  return 0;
+}
+USH_REGISTER(ush_dac_bench, dacbench, Measure DAC update rate: dacbench [count]);
+
+/**
+ * @brief report the frame time achieved and how it's derived.
+*/
+static int32_t ush_dac_timing(uint32_t argc, char **argv){
+  uint32_t code = dev_list[0].code;
+  uint32_t min = 0xffffffff, max = 0, sum = 0, start, cycles;
+  for(uint32_t i=0; i<100; i++){
+    start = timer_cycle_get();
+    ad5791_write_data(code);
+    ad5791_flush();
+    cycles = timer_cycle_elapsed(start);
+    sum += cycles;
+    if(cycles < min) min = cycles;
+    if(cycles > max) max = cycles;
+  }
+#if AD5791_TRANSPORT == AD5791_TRANSPORT_BITBANG
+  USH_Print("wait cycles: sync setup %d, sclk high %d, sclk low %d, sync high %d\n",
+            AD5791_WAIT_SYNC_SETUP, AD5791_WAIT_SCLK_HIGH, AD5791_WAIT_SCLK_LOW, AD5791_WAIT_SYNC_HIGH);
+  USH_Print("table clock %uHz, core clock %uHz%s\n", AD5791_CORE_CLOCK, SystemCoreClock,
+            SystemCoreClock > AD5791_CORE_CLOCK ? ", waits too short" : "");
+#endif
+  USH_Print("frame time(ns): min %u, avg %u, max %u\n",
+            (uint32_t)((uint64_t)min*1000000000/SystemCoreClock),
+            (uint32_t)((uint64_t)sum*10000000/SystemCoreClock),
+            (uint32_t)((uint64_t)max*1000000000/SystemCoreClock));
+  return 0;
+}
+USH_REGISTER(ush_dac_timing, dactiming, Measure AD5791 frame time);
+
+/**
+ * @brief read registers back and compare with shadow, or turn background check on/off.
+*/
+static int32_t ush_dac_verify(uint32_t argc, char **argv){
+#if AD5791_USE_SDO
+  ad5791_dev_def *dev;
+  uint32_t code, ctrl, clrcode;
+  if(argc >= 2){
+    if(strcmp(argv[1], "on") == 0 || strcmp(argv[1], "off") == 0){
+      check_enable = strcmp(argv[1], "on") == 0;
+      return 0;
+    }
+    USH_Print("usage: dacverify [on|off]\n");
+    return -1;
+  }
+  for(uint32_t i=0; (dev = ad5791_get_dev(i)) != 0; i++){
+    ad5791_dev_readback(dev, &code, &ctrl, &clrcode);
+    USH_Print("DAC%d: code 0x%05x/0x%05x, ctrl 0x%05x/0x%05x, clrcode 0x%05x/0x%05x\n",
+              i, code, dev->code, ctrl, dev->ctrl, clrcode, dev->clrcode);
+    if(ad5791_dev_verify(dev) > 0)
+      USH_Print("DAC%d: mismatch, rewritten\n", i);
+    USH_Print("DAC%d: checks %u, mismatch %u, rewrites %u\n", i,
+              check_stat[i].checks, check_stat[i].mismatch, check_stat[i].rewrites);
+    if(check_stat[i].mismatch)
+      USH_Print("DAC%d: last mismatch read code 0x%05x, ctrl 0x%05x, clrcode 0x%05x\n", i,
+                check_stat[i].code, check_stat[i].ctrl, check_stat[i].clrcode);
+  }
+  USH_Print("background check: %s, every %dms\n", check_enable ? "on" : "off", AD5791_CHECK_PERIOD);
+  return 0;
+#else
+  USH_Print("SDO is not wired on this board\n");
+  return -1;
+#endif
+}
+USH_REGISTER(ush_dac_verify, dacverify, Read back DAC registers over SDO: dacverify [on|off]);
+
+/**
+ * @brief dacstat [clr], frames sent and saved by setpoint update layer.
+*/
+static int32_t ush_dac_stat(uint32_t argc, char **argv){
+  ad5791_frame_stat_def stat;
+  uint32_t saved;
+  ad5791_frame_stat(&stat, argc >= 2 && strcmp(argv[1], "clr") == 0);
+  saved = stat.skipped + stat.coalesced;
+  USH_Print("frames issued: %u, setpoints skipped: %u, coalesced: %u\n", stat.issued,
+            stat.skipped, stat.coalesced);
+  if(stat.issued + saved)
+    USH_Print("saved %u%% of frames, min interval %uus\n",
+              (uint32_t)((uint64_t)saved*100/(stat.issued + saved)), min_interval_us);
+  return 0;
+}
+USH_REGISTER(ush_dac_stat, dacstat, Show DAC frame counters: dacstat [clr]);
+
+/**
+ * @brief dacgap us, min interval between setpoint frames.
+*/
+static int32_t ush_dac_gap(uint32_t argc, char **argv){
+  uint32_t us;
+  if(argc < 2 || cmdarg_uint(argv[1], &us) != 0 || us > 262000){
+    USH_Print("usage: dacgap us(0 to 262000, 0 is off)\n");
+    return -1;
+  }
+  ad5791_set_min_interval(us);
+  return 0;
+}
+USH_REGISTER(ush_dac_gap, dacgap, Set min interval of setpoint frames: dacgap us);
+
+/**
+ * @brief dacctrl [a1 on|off [ch]], show control registers or switch A1 buffer.
+*/
+static int32_t ush_dac_ctrl(uint32_t argc, char **argv){
+  const uint8_t comp_volt[] = {10, 0, 0, 0, 0, 0, 0, 0, 0, 12, 16, 19, 20, 0, 0, 0};
+  uint32_t ch = 0;
+  ad5791_dev_def *dev;
+  if(argc >= 3){
+    if(strcmp(argv[1], "a1") != 0 || (strcmp(argv[2], "on") != 0 && strcmp(argv[2], "off") != 0) ||
+       (argc > 3 && (cmdarg_uint(argv[3], &ch) != 0 || ch >= AD5791_DEV_NUM))){
+      USH_Print("usage: dacctrl [a1 on|off [ch]]\n");
+      return -1;
+    }
+    ad5791_dev_ctrl_modify(&dev_list[ch], AD5791CTRL_A1_OFF,
+                           strcmp(argv[2], "on") == 0 ? AD5791CTRL_A1_ON : AD5791CTRL_A1_OFF);
+  }
+  for(uint32_t i=0; (dev = ad5791_get_dev(i)) != 0; i++){
+    USH_Print("DAC%d: ctrl 0x%05x, A1 %s, SDO %s, compensation up to %dV for vref %fV\n", i, dev->ctrl,
+              dev->ctrl & AD5791CTRL_A1_OFF ? "off" : "on", dev->ctrl & AD5791CTRL_SDO_DIS ? "off" : "on",
+              comp_volt[(dev->ctrl & AD5791CTRL_COMP_MASK)>>6], dev->vref_nv*1e-9f);
+  }
+  return 0;
+}
+USH_REGISTER(ush_dac_ctrl, dacctrl, Show control registers or switch A1: dacctrl [a1 on|off [ch]]);
+
+#if AD5791_USE_BENCH
+/**
+ * @brief the float path used before, kept as reference for convcheck and convbench.
+ * @return code.
+*/
+static uint32_t _ad5791_volt2code_float(double vref, float volt){
+  uint32_t code;
+  code = (uint32_t)(volt/vref*0xfffff + 0.5f);
+  if(code > 0xfffff) code = 0xfffff;
+  return code;
+}
+
+/**
+ * @brief check the integer conversion against the float one over all codes.
+ * For every code, float voltage from old path must give the same code on both
+ * paths, and code->nV->code must round trip.
+*/
+static int32_t ush_conv_check(uint32_t argc, char **argv){
+  ad5791_dev_def *dev = &dev_list[0];
+  double vref = dev->vref_nv*1e-9;
+  uint32_t step = 1, checked = 0, fail = 0;
+  if(argc >= 2 && (cmdarg_uint(argv[1], &step) != 0 || step == 0)){
+    USH_Print("usage: convcheck [step]\n");
+    return -1;
+  }
+  for(uint32_t code=0; code<=0xfffff; code+=step){
+    float volt = code*vref/0xfffff;
+    uint32_t code_float = _ad5791_volt2code_float(vref, volt);
+    uint32_t code_fixed = ad5791_nv2code(dev, ad5791_volt2nv(volt));
+    uint32_t code_trip = ad5791_nv2code(dev, ad5791_code2nv(dev, code));
+    checked++;
+    if(code_float != code_fixed || code_trip != code){
+      if(fail++ < 8)
+        USH_Print("code 0x%05x: float 0x%05x, fixed 0x%05x, round trip 0x%05x\n",
+                  code, code_float, code_fixed, code_trip);
+    }
+  }
+  USH_Print("checked %u codes, %u mismatch\n", checked, fail);
+  return fail ? -1 : 0;
+}
+USH_REGISTER(ush_conv_check, convcheck, Check integer vs float code conversion: convcheck [step]);
+
+/**
+ * @brief compare cycles of float and integer conversion, without DAC write.
+*/
+static int32_t ush_conv_bench(uint32_t argc, char **argv){
+  ad5791_dev_def *dev = &dev_list[0];
+  double vref = dev->vref_nv*1e-9;
+  volatile uint32_t code = 0;
+  volatile float vout;
+  uint32_t start, c_float, c_fixed, c_back_float, c_back_fixed;
+  const uint32_t count = 256;
+  float volt = 1.234567f;
+
+  start = timer_cycle_get();
+  for(uint32_t i=0; i<count; i++)
+    code = _ad5791_volt2code_float(vref, volt);
+  c_float = timer_cycle_elapsed(start);
+  start = timer_cycle_get();
+  for(uint32_t i=0; i<count; i++)
+    code = ad5791_nv2code(dev, ad5791_volt2nv(volt));
+  c_fixed = timer_cycle_elapsed(start);
+  start = timer_cycle_get();
+  for(uint32_t i=0; i<count; i++)
+    vout = code*vref/0xfffff;
+  c_back_float = timer_cycle_elapsed(start);
+  start = timer_cycle_get();
+  for(uint32_t i=0; i<count; i++)
+    vout = ad5791_code2nv(dev, code)*1e-9f;
+  c_back_fixed = timer_cycle_elapsed(start);
+  (void)vout;
+  USH_Print("cycles per conversion\n");
+  USH_Print("volt->code: float %u, integer %u\n", c_float/count, c_fixed/count);
+  USH_Print("code->volt: float %u, integer %u\n", c_back_float/count, c_back_fixed/count);
+  return 0;
 }
+USH_REGISTER(ush_conv_bench, convbench, Benchmark float vs integer code conversion);
+#endif
@@ -1,11 +1,186 @@
 #ifndef _AD5791_H_
 #define _AD5791_H_
 #include "stm32f0xx.h"
+
+/**
+ * Transport used to shift frames into AD5791, chosen at build time.
+ * BITBANG: GPIO on PA3(DIN)/PA4(SCLK)/PA5(SYNC), works on the original board.
+ * SPI_DMA: SPI1+DMA, frames are sent without CPU. Needs SCK-->PA5 MOSI-->PA7 SYNC-->PA4.
+*/
+#define AD5791_TRANSPORT_BITBANG  0
+#define AD5791_TRANSPORT_SPI_DMA  1
+#ifndef AD5791_TRANSPORT
+#define AD5791_TRANSPORT AD5791_TRANSPORT_BITBANG
+#endif
+
+/**
+ * LDAC pin. 0: LDAC is tied low(original board), every write updates output at once.
+ * 1: LDAC is wired to PA1, codes can be preloaded and latched later.
+*/
+#ifndef AD5791_USE_LDAC
+#define AD5791_USE_LDAC 0
+#endif
+
+/**
+ * Number of AD5791 on board and how they are wired.
+ * AD5791_DAISY_CHAIN 0: every device has its own SYNC, SCLK/DIN are shared.
+ * 1: SDO of each device drives SDIN of the next one and all share one SYNC,
+ * channel 0 is the one connected to MCU.
+*/
+#ifndef AD5791_DEV_NUM
+#define AD5791_DEV_NUM 1
+#endif
+#ifndef AD5791_DAISY_CHAIN
+#define AD5791_DAISY_CHAIN 0
+#endif
+
+/**
+ * SDO readback. 0: SDO is not wired(original board).
+ * 1: SDO is wired to PA0(bit-bang) or PA6(SPI1 MISO), registers are read back
+ * every AD5791_CHECK_PERIOD ms and compared with shadow copies.
+*/
+#ifndef AD5791_USE_SDO
+#define AD5791_USE_SDO 0
+#endif
+#ifndef AD5791_CHECK_PERIOD
+#define AD5791_CHECK_PERIOD 1000
+#endif
+
+/**
+ * On-target conversion check and benchmark commands(convcheck, convbench).
+ * They are left out by default to save flash, dacbench is always built.
+*/
+#ifndef AD5791_USE_BENCH
+#define AD5791_USE_BENCH 0
+#endif
+
+/**
+ * Setpoint writes closer than this are coalesced, only the latest code is
+ * written when the interval is over. 0 writes every setpoint at once.
+*/
+#ifndef AD5791_MIN_INTERVAL_US
+#define AD5791_MIN_INTERVAL_US 5000
+#endif
+
+/**
+ * Linearity correction table: error at AD5791_INL_POINTS breakpoints equally
+ * spaced by 1<<AD5791_INL_SHIFT codes, in 1/256 LSB.
+*/
+#define AD5791_INL_SHIFT  15
+#define AD5791_INL_POINTS ((0x100000>>AD5791_INL_SHIFT)+1)
+
+/**
+ * Control register fields, for ad5791_dev_ctrl_modify.
+*/
+//bit1
+#define AD5791CTRL_A1_ON  (0<<1)  /*0: turn on internal A1 amplifier */  
+#define AD5791CTRL_A1_OFF (1<<1)  /*1: turn off internal A1 amplifier */  
+//bit2
+#define AD5791CTRL_OPGND_NORMAL (0<<2)  /* 0: DAC operates in normal mode */ 
+#define AD5791CTRL_OPGND_TOGND  (1<<2)  /* 1: DAC output is clamped to ground */ 
+//bit3
+#define AD5791CTRL_OUT_NORMAL   (0<<3)  /* 0: DAC output is in normal mode */
+#define AD5791CTRL_OUT_TRISTATE (1<<3)  /* 1: DAC output is in tristate */
+//bit4
+#define AD5791CTRL_CODE_2SC     (0<<4)  /* 0: two's complement coding */     
+#define AD5791CTRL_CODE_BIN     (1<<4)  /* 1: offset binary code */     
+//bit5
+#define AD5791CTRL_SDO_EN       (0<<5)  /* 0: SDO pin is enabled */
+#define AD5791CTRL_SDO_DIS      (1<<5)  /* 1: SDO pin is disabled */
+//bit6-9, selected from vref by driver
+#define AD5791CTRL_COMP10V      (0<<6)  /* 0: Line compensation input reference up to 10V  */
+#define AD5791CTRL_COMP10V_12V  (9<<6)  /* 9: Line compensation 10V to 12V reference  */
+#define AD5791CTRL_COMP12V_16V  (10<<6) /* 10: Line compensation 12V to 16V reference  */
+#define AD5791CTRL_COMP16V_19V  (11<<6) /* 11: Line compensation 16V to 19V reference  */
+#define AD5791CTRL_COMP19V_20V  (12<<6) /* 12: Line compensation 19V to 20V reference  */
+#define AD5791CTRL_COMP_MASK    (0xf<<6)
+
+typedef void (*ad5791_callback)(void);
+
+/**
+ * Safe state of output.
+*/
+typedef enum{
+  ad5791_safe_off = 0,  /**< normal output. */
+  ad5791_safe_clear,    /**< DAC register is loaded with clear code. */
+  ad5791_safe_ground,   /**< output is clamped to ground. */
+  ad5791_safe_tristate, /**< output is in tristate. */
+}ad5791_safe_def;
+
+/**
+ * Context of one AD5791.
+*/
+typedef struct{
+  uint8_t ch;         /**< channel number, position in chain from MCU side. */
+  uint16_t sync_pin;  /**< SYNC pin on GPIOA. */
+  uint32_t code;      /**< shadow of DAC register. */
+  uint32_t ctrl;      /**< shadow of control register. */
+  uint32_t clrcode;   /**< shadow of clear code register. */
+  uint64_t vref_nv;   /**< calibrated reference voltage in nV. */
+  uint64_t code_q40;  /**< codes per nV in Q40, derived from vref_nv. */
+  uint64_t lsb_q29;   /**< nV per code in Q29, derived from vref_nv. */
+  const int16_t *inl; /**< linearity correction table, 0 if not calibrated. */
+  uint32_t pending;   /**< setpoint waiting for min interval, valid if AD5791_PENDING is set. */
+  uint32_t last_write;/**< cycle count of last setpoint frame. */
+}ad5791_dev_def;
+
+#define AD5791_PENDING  (1u<<31)
+
+/**
+ * Frame counters of setpoint update layer.
+*/
+typedef struct{
+  uint32_t issued;    /**< frames sent, setpoints and everything else. */
+  uint32_t skipped;   /**< setpoints equal to code in DAC, not sent. */
+  uint32_t coalesced; /**< setpoints replaced by a later one before they were sent. */
+}ad5791_frame_stat_def;
+
 void ad5791_init(void);
+ad5791_dev_def *ad5791_get_dev(uint32_t ch);
+void ad5791_dev_write_data(ad5791_dev_def *dev, uint32_t data);
+void ad5791_dev_update(ad5791_dev_def *dev, uint32_t code);
+uint32_t ad5791_dev_setpoint(const ad5791_dev_def *dev);
+void ad5791_set_min_interval(uint32_t us);
+void ad5791_frame_stat(ad5791_frame_stat_def *stat, uint32_t clear);
+float ad5791_dev_set_code(ad5791_dev_def *dev, uint32_t code);
+double ad5791_dev_set_volt(ad5791_dev_def *dev, double volt);
+void ad5791_dev_set_vref_nv(ad5791_dev_def *dev, uint64_t nv);
+uint64_t ad5791_dev_set_nv(ad5791_dev_def *dev, uint64_t nv);
+uint32_t ad5791_dev_set_uv(ad5791_dev_def *dev, uint32_t uv);
+uint64_t ad5791_dev_get_nv(const ad5791_dev_def *dev);
+void ad5791_dev_set_scale(ad5791_dev_def *dev, uint64_t nv);
+uint32_t ad5791_nv2code(const ad5791_dev_def *dev, uint64_t nv);
+uint64_t ad5791_code2nv(const ad5791_dev_def *dev, uint32_t code);
+uint32_t ad5791_dev_nv2code(const ad5791_dev_def *dev, uint64_t nv);
+uint64_t ad5791_dev_code2nv(const ad5791_dev_def *dev, uint32_t code);
+uint64_t ad5791_dev_nv2code_q16(const ad5791_dev_def *dev, uint64_t nv);
+uint64_t ad5791_volt2nv(double volt);
+void ad5791_dev_set_inl(ad5791_dev_def *dev, const int16_t *table);
+int32_t ad5791_dev_inl_q8(const ad5791_dev_def *dev, uint32_t code);
+int32_t ad5791_write_all(const uint32_t *code);
+void ad5791_dev_ctrl_modify(ad5791_dev_def *dev, uint32_t mask, uint32_t value);
+void ad5791_ctrl_begin(void);
+void ad5791_ctrl_commit(void);
+void ad5791_dev_set_clrcode(ad5791_dev_def *dev, uint32_t code);
+void ad5791_safe_enter(ad5791_safe_def mode);
+void ad5791_safe_exit(void);
+ad5791_safe_def ad5791_safe_state(void);
+int32_t ad5791_dev_readback(ad5791_dev_def *dev, uint32_t *code, uint32_t *ctrl, uint32_t *clrcode);
+int32_t ad5791_dev_verify(ad5791_dev_def *dev);
+void ad5791_poll(void);
+void ad5791_write_data(uint32_t data);
 float ad5791_set_code(uint32_t code);
-float ad5791_set_volt(float volt);
+double ad5791_set_volt(double volt);
 int32_t ad5791_get_code(void);
 void ad5791_set_vref(double volt);
 double ad5791_get_vref(void);
+void ad5791_set_callback(ad5791_callback callback);
+void ad5791_flush(void);
+int32_t ad5791_ldac_hold(uint32_t hold);
+int32_t ad5791_ldac_held(void);
+void ad5791_ldac_rearm(void);
+void ad5791_ldac_pulse(void);
+void ad5791_ldac_dma(uint32_t enable);
+void ad5791_latch(void);
 
 #endif
@@ -0,0 +1,156 @@
+/**
+ * @author Neo Xu (neo.xu1990@gmail.com)
+ * @license The MIT License (MIT)
+ * 
+ * Copyright (c) 2019 Neo Xu
+ * 
+ * @brief ad5791 code and voltage conversion, 64bit integer math only.
+ * Nothing here touches hardware, so test/convcheck.c builds it on host.
+*/
+#include "ad5791.h"
+
+#define AD5791_VREF_MAX_NV      20000000000ull /* keeps Q29 LSB scale in 64bit */
+
+/**
+ * @brief set reference voltage of one device in context and derive the
+ * conversion scales, DAC isn't written.
+ * @return none.
+*/
+void ad5791_dev_set_scale(ad5791_dev_def *dev, uint64_t nv){
+  if(nv < 0xfffff) nv = 0xfffff;  /* keep it meaningful, 1nV/LSB */
+  if(nv > AD5791_VREF_MAX_NV) nv = AD5791_VREF_MAX_NV;
+  dev->vref_nv = nv;
+  dev->code_q40 = (((uint64_t)0xfffff<<40) + nv/2)/nv;
+  dev->lsb_q29 = ((nv<<29) + 0xfffff/2)/0xfffff;
+}
+
+/**
+ * @brief convert voltage in nV to code, exactly round(nv*0xfffff/vref).
+ * The Q40 scale gives a code within 1 of it, the last bit is fixed by
+ * comparing against the half code boundaries, all with 64bit integer math.
+ * @return 20bit code, clamped to 0xfffff.
+*/
+uint32_t ad5791_nv2code(const ad5791_dev_def *dev, uint64_t nv){
+  uint64_t q, t;
+  if(nv >= dev->vref_nv) return 0xfffff;
+  q = (nv*dev->code_q40 + (1ull<<39))>>40;
+  t = 2*nv*0xfffff;
+  if(t >= (2*q+1)*dev->vref_nv)
+    q++;
+  else if(q && t < (2*q-1)*dev->vref_nv)
+    q--;
+  return q > 0xfffff ? 0xfffff : (uint32_t)q;
+}
+
+/**
+ * @brief convert code to voltage in nV, exactly round(code*vref/0xfffff).
+ * @return voltage in nV.
+*/
+uint64_t ad5791_code2nv(const ad5791_dev_def *dev, uint32_t code){
+  uint64_t nv, t;
+  code &= 0xfffff;
+  nv = (code*dev->lsb_q29 + (1ull<<28))>>29;
+  t = 2*(uint64_t)code*dev->vref_nv;
+  if(t >= (2*nv+1)*0xfffff)
+    nv++;
+  else if(nv && t < (2*nv-1)*0xfffff)
+    nv--;
+  return nv;
+}
+
+/**
+ * @brief INL at code from correction table, linear between breakpoints.
+ * @return error in 1/256 LSB, 0 if there is no table.
+*/
+int32_t ad5791_dev_inl_q8(const ad5791_dev_def *dev, uint32_t code){
+  const int16_t *t;
+  int32_t frac;
+  if(dev->inl == 0) return 0;
+  code &= 0xfffff;
+  t = dev->inl + (code>>AD5791_INL_SHIFT);
+  frac = code&((1<<AD5791_INL_SHIFT)-1);
+  /* diff of two int16 takes 17bits, times 15bit frac it's done in 64bits */
+  return t[0] + (int32_t)(((int64_t)(t[1]-t[0])*frac)>>AD5791_INL_SHIFT);
+}
+
+/**
+ * @brief code that gives nv on real output. The target is taken in 1/256 code
+ * so the correction isn't rounded twice, then INL at that point is removed.
+ * @return 20bit code.
+*/
+uint32_t ad5791_dev_nv2code(const ad5791_dev_def *dev, uint64_t nv){
+  int64_t c8;
+  if(dev->inl == 0) return ad5791_nv2code(dev, nv);
+  if(nv >= dev->vref_nv)
+    c8 = 0xfffff<<8;
+  else
+    c8 = (int64_t)((nv*dev->code_q40 + (1ull<<31))>>32);
+  c8 -= ad5791_dev_inl_q8(dev, (uint32_t)(c8>>8));
+  c8 = (c8 + 128)>>8;
+  if(c8 < 0) return 0;
+  return c8 > 0xfffff ? 0xfffff : (uint32_t)c8;
+}
+
+/**
+ * @brief real output of code, ideal voltage plus INL at that code.
+ * @return voltage in nV.
+*/
+uint64_t ad5791_dev_code2nv(const ad5791_dev_def *dev, uint32_t code){
+  uint64_t nv = ad5791_code2nv(dev, code);
+  int64_t err;
+  if(dev->inl == 0) return nv;
+  err = ((int64_t)ad5791_dev_inl_q8(dev, code)*(int64_t)dev->lsb_q29)>>(29+8);
+  if(err < 0 && (uint64_t)-err > nv) return 0;
+  return nv + err;
+}
+
+/**
+ * @brief use a linearity correction table, or 0 to turn it off. Table must hold
+ * AD5791_INL_POINTS entries and stay valid, it's not copied.
+ * @return none.
+*/
+void ad5791_dev_set_inl(ad5791_dev_def *dev, const int16_t *table){
+  dev->inl = table;
+}
+
+/**
+ * @brief code with 16bit fraction that gives nv on real output, for engines
+ * that dither between codes.
+ * @return code in Q16, clamped to 0xfffff.
+*/
+uint64_t ad5791_dev_nv2code_q16(const ad5791_dev_def *dev, uint64_t nv){
+  int64_t c16;
+  if(nv >= dev->vref_nv)
+    c16 = (int64_t)0xfffff<<16;
+  else
+    c16 = (int64_t)((nv*dev->code_q40 + (1ull<<23))>>24);
+  c16 -= (int64_t)ad5791_dev_inl_q8(dev, (uint32_t)(c16>>16))<<8;
+  if(c16 < 0) return 0;
+  return c16 > ((int64_t)0xfffff<<16) ? (uint64_t)0xfffff<<16 : (uint64_t)c16;
+}
+
+/**
+ * @brief convert double voltage to nV from its bits, so float setpoints take
+ * the integer path without soft-float calls. Rounded to nearest nV.
+ * Mantissa*1e9 needs 83bits, it's kept as two halves.
+ * @return voltage in nV, 0 if negative.
+*/
+uint64_t ad5791_volt2nv(double volt){
+  union{double f; uint64_t u;} v;
+  uint64_t m, hi, lo;
+  int32_t e;
+  v.f = volt;
+  if(v.u>>63) return 0;
+  e = (int32_t)((v.u>>52)&0x7ff);
+  if(e == 0) return 0;
+  if(e == 0x7ff) return ~0ull;
+  m = (v.u&0xfffffffffffffull)|(1ull<<52);
+  e = 1075 - e;                   /* volt = mantissa/2^e */
+  if(e <= 32) return ~0ull;       /* millions of volts */
+  hi = (m>>32)*1000000000ull;     /* < 2^51 */
+  lo = (m&0xffffffff)*1000000000ull;
+  hi += lo>>32;                   /* mantissa*1e9 = hi*2^32 + low 32bits of lo */
+  e -= 32;
+  if(e > 63) return 0;
+  return (hi + (1ull<<(e-1)))>>e;
+}
@@ -13,6 +13,7 @@ static uint32_t buff_index = 0;
 static float latest_temp;
 static int16_t b_tmp_ready = 0;
 static int16_t b_read_tmp_now = 0;
+static void (*read_callback)(float t) = 0;
 
 //static uint8_t adt7420_readid(void){
 //	uint8_t data;
@@ -45,6 +46,8 @@ static float _adt7420_read_temp(void){
 		sum += temp_buff[i];
   latest_temp = sum*0.0078f/MOVING_AVG_SIZE;
 	b_tmp_ready = 1;
+  if(read_callback)
+    read_callback(latest_temp);
 	return latest_temp;
 }
 
@@ -100,3 +103,19 @@ int32_t adt7420_get_tmp(float *t){
 	}
 	return 0;
 }
+
+/**
+ * @brief get the latest averaged temperature, it doesn't clear ready flag of
+ * adt7420_get_tmp.
+*/
+float adt7420_get_latest(void){
+  return latest_temp;
+}
+
+/**
+ * @brief callback is called with the averaged temperature on every reading.
+ * @return none.
+*/
+void adt7420_set_callback(void (*callback)(float t)){
+  read_callback = callback;
+}
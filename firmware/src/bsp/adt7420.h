@@ -6,5 +6,7 @@
 void adt7420_init(void);
 void adt7420_poll(void);
 int32_t adt7420_get_tmp(float *t);
+float adt7420_get_latest(void);
+void adt7420_set_callback(void (*callback)(float t));
 
 #endif
@@ -0,0 +1,75 @@
+/**
+ * @author Neo Xu (neo.xu1990@gmail.com)
+ * @license The MIT License (MIT)
+ * 
+ * Copyright (c) 2019 Neo Xu
+ * 
+ * @brief external interrupt on PA0 and PA1.
+ * They are the only free pins and share EXTI0_1 interrupt, line 1 is served
+ * first. Callbacks run at top priority.
+*/
+#include "stm32f0xx.h"
+#include "exti.h"
+#include "timer.h"
+
+#define EXTI_LINE_NUM 2
+
+static exti_callback exti_func[EXTI_LINE_NUM];
+static uint32_t entry_cycle;
+
+/**
+ * @brief enable interrupt on PA0(line 0) or PA1(line 1).
+ * @param rising: 1 for rising edge, 0 for falling edge.
+ * @return none.
+*/
+void exti_enable(uint32_t line, uint32_t rising, exti_callback callback){
+  GPIO_InitTypeDef gpio_init;
+  EXTI_InitTypeDef exti_init;
+  NVIC_InitTypeDef nvic;
+  if(line >= EXTI_LINE_NUM || callback == 0) return;
+  RCC_AHBPeriphClockCmd(RCC_AHBPeriph_GPIOA, ENABLE);
+  RCC_APB2PeriphClockCmd(RCC_APB2Periph_SYSCFG, ENABLE);
+  gpio_init.GPIO_Mode = GPIO_Mode_IN;
+  gpio_init.GPIO_OType = GPIO_OType_PP;
+  gpio_init.GPIO_Pin = 1<<line;
+  gpio_init.GPIO_PuPd = rising ? GPIO_PuPd_DOWN : GPIO_PuPd_UP;
+  gpio_init.GPIO_Speed = GPIO_Speed_50MHz;
+  GPIO_Init(GPIOA, &gpio_init);
+  SYSCFG_EXTILineConfig(EXTI_PortSourceGPIOA, line);
+  exti_func[line] = callback;
+  exti_init.EXTI_Line = 1<<line;
+  exti_init.EXTI_Mode = EXTI_Mode_Interrupt;
+  exti_init.EXTI_Trigger = rising ? EXTI_Trigger_Rising : EXTI_Trigger_Falling;
+  exti_init.EXTI_LineCmd = ENABLE;
+  EXTI->PR = 1<<line;
+  EXTI_Init(&exti_init);
+  nvic.NVIC_IRQChannel = EXTI0_1_IRQn;
+  nvic.NVIC_IRQChannelPriority = 0;
+  nvic.NVIC_IRQChannelCmd = ENABLE;
+  NVIC_Init(&nvic);
+}
+
+void exti_disable(uint32_t line){
+  if(line >= EXTI_LINE_NUM) return;
+  EXTI->IMR &= ~(1<<line);
+  EXTI->PR = 1<<line;
+}
+
+/**
+ * @brief cycle count(timer_cycle_get) when the current interrupt was entered,
+ * for callbacks to measure their latency.
+*/
+uint32_t exti_entry_cycle(void){
+  return entry_cycle;
+}
+
+void EXTI0_1_IRQHandler(void){
+  uint32_t pending;
+  entry_cycle = timer_cycle_get();
+  pending = EXTI->PR & EXTI->IMR;
+  EXTI->PR = pending;
+  if(pending & EXTI_Line1)
+    exti_func[1]();
+  if(pending & EXTI_Line0)
+    exti_func[0]();
+}
@@ -0,0 +1,19 @@
+/**
+ * @author Neo Xu (neo.xu1990@gmail.com)
+ * @license The MIT License (MIT)
+ * 
+ * Copyright (c) 2019 Neo Xu
+ * 
+ * @brief external interrupt on PA0 and PA1.
+*/
+#ifndef _EXTI_H_
+#define _EXTI_H_
+#include "stdint.h"
+
+typedef void (*exti_callback)(void);
+
+void exti_enable(uint32_t line, uint32_t rising, exti_callback callback);
+void exti_disable(uint32_t line);
+uint32_t exti_entry_cycle(void);
+
+#endif
@@ -4,7 +4,8 @@ static volatile uint8_t IIC_InitFlag =0 ;
 
 void IIC_Delay(uint8_t time)
 {
-  while(time--);
+  volatile uint8_t n = time;  /* not removed by optimizer */
+  while(n--);
 }
 
 void IIC_Init(void)
@@ -17,10 +17,16 @@
                                    ((uint32_t)(sw&0xff)<<8)|\
                                    ((uint32_t)(0&0xff))\
                                    )
+/**
+ * Host link byte of hw_info: baudrate index+1 in uart table, 0 is default.
+*/
+#define HW_INFO_BAUD_MASK   0x7f
+#define HW_INFO_AUTOBAUD    0x80  //measure baudrate on first character after reset.
+
 struct _parameter{
   uint32_t signature;
   float refer_voltage;    //reference voltage
-  uint32_t hw_info; //MSB<--8bit contrast, 8bit hw version, 8bit software version, 8bit reserved.-->LSB
+  uint32_t hw_info; //MSB<--8bit contrast, 8bit hw version, 8bit software version, 8bit host link.-->LSB
   uint32_t power_up_count;
 };
 
@@ -19,9 +19,44 @@ static uint32_t list_len = 0;
 static uint32_t curr_tick = 0;
 static uint32_t time_per_tick = 0;  //time in ms per tick.
 
+/**
+ * SysTick is not used as a tick here, let it free run as a 24bit down counter
+ * clocked by HCLK, so we have a cycle counter for short time measurement.
+*/
+#define CYCLE_COUNTER_MASK 0xffffff
+static void timer_cycle_init(void){
+  SysTick->LOAD = CYCLE_COUNTER_MASK;
+  SysTick->VAL = 0;
+  SysTick->CTRL = SysTick_CTRL_CLKSOURCE_Msk|SysTick_CTRL_ENABLE_Msk;
+}
+
+/**
+ * @brief get current cycle count. It wraps every 2^24 cycles(262ms@64MHz).
+*/
+uint32_t timer_cycle_get(void){
+  return CYCLE_COUNTER_MASK - SysTick->VAL;
+}
+
+/**
+ * @brief get cycles elapsed since start, start is from timer_cycle_get().
+*/
+uint32_t timer_cycle_elapsed(uint32_t start){
+  return (timer_cycle_get() - start)&CYCLE_COUNTER_MASK;
+}
+
+/**
+ * @brief convert cycles of the cycle counter to ns, with the core clock
+ * SystemCoreClockUpdate() found at startup.
+*/
+uint32_t timer_cycle2ns(uint32_t cycles){
+  return (uint32_t)((uint64_t)cycles*1000000000/SystemCoreClock);
+}
+
 void timer_init(uint32_t period_ms){
   uint32_t timer_value = CORE_CLOCK_FREQ*period_ms/1000;
 
+  timer_cycle_init();
+
   RCC_APB2PeriphClockCmd(RCC_APB2Periph_TIM16, ENABLE);
   /* Time base configuration */
   TIM_TimeBaseInitTypeDef  TIM_TimeBaseStructure;
@@ -43,6 +78,37 @@ void timer_init(uint32_t period_ms){
   LOG_I("time_per_tick: %d", time_per_tick);
 }
 
+/**
+ * @brief get tick count since power up, it's increased in TIM16 interrupt.
+*/
+uint32_t timer_tick_get(void){
+  return curr_tick;
+}
+
+/**
+ * @brief get tick period in ms.
+*/
+uint32_t timer_tick_ms(void){
+  return time_per_tick;
+}
+
+/**
+ * @brief get time since power up in ms, tick plus TIM16 counter(1kHz). It's
+ * safe in interrupt, an update not served yet is counted.
+ * It wraps every 49 days.
+*/
+uint32_t timer_ms_get(void){
+  uint32_t tick, cnt;
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq();
+  tick = curr_tick;
+  cnt = TIM16->CNT;
+  if((TIM16->SR & TIM_IT_Update) && cnt < (TIM16->ARR + 1)/2)
+    tick++;
+  __set_PRIMASK(primask);
+  return tick*time_per_tick + cnt;
+}
+
 void timer_register(void (*call_back)(void), uint32_t period_ms){
   if(call_back == 0) return;
 
@@ -80,6 +146,142 @@ void timer_unlink(void (*call_back)){
   }
 }
 
+/**
+ * Sample clock on TIM17, shared by the engines that update DAC at fixed rate.
+ * Only one engine owns it at a time, starting another one replaces the callback.
+*/
+static timer_sample_func sample_callback = 0;
+static uint32_t sample_late = 0;    //samples that started later than 1/4 period.
+static uint32_t sample_missed = 0;  //samples that were due before last one was done.
+static timer_sample_func sample_latch = 0;  //called first in interrupt to latch last sample.
+static timer_hold_func sample_hold = 0;     //holds output while sample clock runs.
+static uint32_t latch_min, latch_max;       //update event to latch done, in timer clocks.
+
+/**
+ * @brief start sample clock, callback is called from timer interrupt every sample.
+ * @param rate_hz: sample rate in Hz.
+ * @param callback: function to output one sample.
+ * @return the real sample period in 64MHz clocks, 0 if rate is not supported.
+*/
+uint32_t timer_sample_start(uint32_t rate_hz, timer_sample_func callback){
+  uint32_t period, psc, arr;
+  if(callback == 0) return 0;
+  if(rate_hz == 0 || rate_hz > TIMER_SAMPLE_RATE_MAX) return 0;
+  period = (TIMER_SAMPLE_CLOCK + rate_hz/2)/rate_hz;
+  psc = period/65536 + 1;
+  arr = (period + psc/2)/psc;
+
+  TIM_Cmd(TIM17, DISABLE);
+  if(sample_callback == 0){
+    RCC_APB2PeriphClockCmd(RCC_APB2Periph_TIM17, ENABLE);
+    NVIC_InitTypeDef nvic;
+    nvic.NVIC_IRQChannel = TIM17_IRQn;
+    nvic.NVIC_IRQChannelCmd = ENABLE;
+    nvic.NVIC_IRQChannelPriority = sample_latch ? 0 : 1;
+    NVIC_Init(&nvic);
+  }
+  TIM_TimeBaseInitTypeDef  TIM_TimeBaseStructure;
+  TIM_TimeBaseStructure.TIM_Prescaler = psc-1;
+  TIM_TimeBaseStructure.TIM_Period = arr-1;
+  TIM_TimeBaseStructure.TIM_ClockDivision = 0;
+  TIM_TimeBaseStructure.TIM_CounterMode = TIM_CounterMode_Up;
+  TIM_TimeBaseStructure.TIM_RepetitionCounter = 0;
+  TIM_TimeBaseInit(TIM17, &TIM_TimeBaseStructure);
+  TIM17->SR = ~TIM_FLAG_Update; //TimeBaseInit generates an update event.
+  if(sample_hold)
+    sample_hold(1);
+  sample_callback = callback;
+  sample_late = 0;
+  sample_missed = 0;
+  latch_min = 0xffffffff;
+  latch_max = 0;
+  TIM_ITConfig(TIM17, TIM_IT_Update, ENABLE);
+  TIM_Cmd(TIM17, ENABLE);
+  LOG_I("sample clock: psc %d, arr %d", psc, arr);
+  return psc*arr;
+}
+
+/**
+ * @brief stop sample clock, output is released if it's held for latch.
+ * @return none.
+*/
+void timer_sample_stop(void){
+  TIM_Cmd(TIM17, DISABLE);
+  TIM_ITConfig(TIM17, TIM_IT_Update, DISABLE);
+  TIM17->SR = ~TIM_FLAG_Update;
+  if(sample_callback && sample_hold)
+    sample_hold(0);
+  sample_callback = 0;
+}
+
+/**
+ * @brief latch samples on timer update event instead of when they are written.
+ * Interrupt is raised to the highest priority so latch time only varies with
+ * interrupt entry.
+ * @param latch: function called first in interrupt, 0 to disable latch.
+ * @param hold: called with 1 when sample clock starts and 0 when it stops, so
+ * output only waits for latch while an engine owns sample clock.
+ * @param dma: also fire DMA1 channel1 on update event(TIM17_UP).
+ * @return none.
+*/
+void timer_sample_set_latch(timer_sample_func latch, timer_hold_func hold, uint32_t dma){
+  RCC_APB2PeriphClockCmd(RCC_APB2Periph_TIM17, ENABLE);
+  TIM_DMACmd(TIM17, TIM_DMA_Update, dma ? ENABLE : DISABLE);
+  NVIC_SetPriority(TIM17_IRQn, latch ? 0 : 1);
+  sample_latch = latch;
+  sample_hold = hold;
+  latch_min = 0xffffffff;
+  latch_max = 0;
+}
+
+/**
+ * @brief get the range of time from update event to latch done.
+ * @return timer clocks(prescaler included) per count, 0 if nothing measured.
+*/
+uint32_t timer_sample_latch_stat(uint32_t *min, uint32_t *max){
+  if(latch_max == 0) return 0;
+  if(min) *min = latch_min;
+  if(max) *max = latch_max;
+  return TIM17->PSC + 1;
+}
+
+/**
+ * @brief check who owns sample clock.
+ * @return the callback in use, 0 if sample clock is stopped.
+*/
+timer_sample_func timer_sample_owner(void){
+  return sample_callback;
+}
+
+/**
+ * @brief get late/missed sample counters since sample clock started.
+*/
+void timer_sample_stat(uint32_t *late, uint32_t *missed){
+  if(late) *late = sample_late;
+  if(missed) *missed = sample_missed;
+}
+
+void TIM17_IRQHandler(void)
+{
+  if(TIM17->SR & TIM_IT_Update){
+    if(TIM17->CNT > TIM17->ARR/4)
+      sample_late ++;
+    TIM17->SR = ~TIM_FLAG_Update;
+    if(sample_latch){
+      uint32_t cnt;
+      sample_latch();
+      cnt = TIM17->CNT;
+      if(cnt < latch_min) latch_min = cnt;
+      if(cnt > latch_max) latch_max = cnt;
+    }
+    if(sample_callback)
+      sample_callback();
+    /* next sample is already due, we'll come back at once but it's missed on time. */
+    if(TIM17->SR & TIM_IT_Update)
+      sample_missed ++;
+  }
+}
+
 void TIM16_IRQHandler(void)//2ms
 {
 	if(TIM16->SR & TIM_IT_Update)	
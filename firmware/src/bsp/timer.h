@@ -2,8 +2,26 @@
 #define _TIMER_H_
 #include "stdint.h"
 
+#define TIMER_SAMPLE_CLOCK    64000000  //TIM17 clock, APB is HCLK/2 so timer runs at 64MHz.
+#define TIMER_SAMPLE_RATE_MAX 100000  //highest sample clock, a bit-bang frame takes ~3us.
+
+typedef void (*timer_sample_func)(void);
+typedef void (*timer_hold_func)(uint32_t hold);
+
 void timer_init(uint32_t period_ms);
 void timer_register(void (*call_back)(void), uint32_t period_ms);
 void timer_unlink(void (*call_back));
+uint32_t timer_tick_get(void);
+uint32_t timer_tick_ms(void);
+uint32_t timer_ms_get(void);
+uint32_t timer_cycle_get(void);
+uint32_t timer_cycle_elapsed(uint32_t start);
+uint32_t timer_cycle2ns(uint32_t cycles);
+uint32_t timer_sample_start(uint32_t rate_hz, timer_sample_func callback);
+void timer_sample_stop(void);
+timer_sample_func timer_sample_owner(void);
+void timer_sample_set_latch(timer_sample_func latch, timer_hold_func hold, uint32_t dma);
+uint32_t timer_sample_latch_stat(uint32_t *min, uint32_t *max);
+void timer_sample_stat(uint32_t *late, uint32_t *missed);
 
 #endif
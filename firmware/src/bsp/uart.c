@@ -1,14 +1,74 @@
 #include "uart.h"
+#include "printf.h"
+#include "ush.h"
+#include "string.h"
 
-static void (*uart_callback)(uint8_t);
+#define UART_TX_MARKER "~\n"  //line end of a truncated line.
 
-void uart_init(uint32_t baudrate, void(*pfunc)(uint8_t))
+/**
+ * Receive ring, DMA1 channel5 fills it in circular mode. Interrupts only move
+ * rx_wr forward, at half, full and when line goes idle.
+*/
+static uint8_t rx_ring[UART_RX_RING_SIZE];
+static volatile uint32_t rx_wr = 0;   //free running, bytes received.
+static uint32_t rx_rd = 0;            //free running, bytes consumed, main loop only.
+static uint32_t rx_dma_pos = 0;       //DMA position when rx_wr was updated.
+static uart_rx_stat_def rx_stat;
+
+/**
+ * Rates host link can be set to, 2Mbaud is PCLK/16.
+*/
+static const uint32_t baud_table[] = {
+	9600, 19200, 38400, 57600, 115200, 230400, 460800, 921600, 1000000, 2000000,
+};
+static volatile uint8_t abr_armed = 0;  //waiting for first character.
+static volatile uint32_t abr_baud = 0;  //detected by autobaud, taken by poll.
+
+/**
+ * Transmit ring, drained by TXE interrupt.
+*/
+static uint8_t tx_ring[UART_TX_RING_SIZE];
+static volatile uint32_t tx_rd = 0, tx_wr = 0;  //free running, index is masked.
+static uart_tx_policy_def tx_policy = uart_tx_block;
+static uint8_t tx_truncating = 0;               //rest of line is being dropped.
+static uart_tx_stat_def tx_stat;
+
+/**
+ * @brief DMA1 channel5 writes received bytes to ring forever. Channel3 is
+ * used by SPI transport, so USART1 RX request is remapped.
+ * @return none.
+*/
+static void uart_rx_dma_init(void){
+	DMA_InitTypeDef dma_init;
+	RCC_AHBPeriphClockCmd(RCC_AHBPeriph_DMA1, ENABLE);
+	RCC_APB2PeriphClockCmd(RCC_APB2Periph_SYSCFG, ENABLE);
+	SYSCFG_DMAChannelRemapConfig(SYSCFG_DMARemap_USART1Rx, ENABLE);
+	DMA_Cmd(DMA1_Channel5, DISABLE);
+	dma_init.DMA_PeripheralBaseAddr = (uint32_t)&USART1->RDR;
+	dma_init.DMA_MemoryBaseAddr = (uint32_t)rx_ring;
+	dma_init.DMA_DIR = DMA_DIR_PeripheralSRC;
+	dma_init.DMA_BufferSize = UART_RX_RING_SIZE;
+	dma_init.DMA_PeripheralInc = DMA_PeripheralInc_Disable;
+	dma_init.DMA_MemoryInc = DMA_MemoryInc_Enable;
+	dma_init.DMA_PeripheralDataSize = DMA_PeripheralDataSize_Byte;
+	dma_init.DMA_MemoryDataSize = DMA_MemoryDataSize_Byte;
+	dma_init.DMA_Mode = DMA_Mode_Circular;
+	dma_init.DMA_Priority = DMA_Priority_Medium;
+	dma_init.DMA_M2M = DMA_M2M_Disable;
+	DMA_Init(DMA1_Channel5, &dma_init);
+	DMA_ITConfig(DMA1_Channel5, DMA_IT_HT|DMA_IT_TC, ENABLE);
+	rx_wr = 0;
+	rx_rd = 0;
+	rx_dma_pos = 0;
+	DMA_Cmd(DMA1_Channel5, ENABLE);
+}
+
+void uart_init(uint32_t baudrate)
 {
 	GPIO_InitTypeDef GPIO_InitStructure;
 	USART_InitTypeDef USART_InitStructure;
 	NVIC_InitTypeDef NVIC_InitStructure;
 	
-	uart_callback = pfunc;
 	RCC_APB2PeriphClockCmd(RCC_APB2Periph_USART1, ENABLE);
 	RCC_AHBPeriphClockCmd(RCC_AHBPeriph_GPIOA,ENABLE);
 	
@@ -30,38 +90,372 @@ void uart_init(uint32_t baudrate, void(*pfunc)(uint8_t))
 	USART_InitStructure.USART_StopBits = USART_StopBits_1;
 	USART_InitStructure.USART_WordLength = USART_WordLength_8b;
 	USART_Init(USART1,&USART_InitStructure);
-	USART_ITConfig(USART1,USART_IT_RXNE,ENABLE);
+	uart_set_baud(baudrate);
+	uart_rx_dma_init();
+	USART_DMACmd(USART1, USART_DMAReq_Rx, ENABLE);
+	USART_ITConfig(USART1,USART_IT_IDLE,ENABLE);
 	
 	//USART_SWAPPinCmd(USART1,ENABLE);
 	USART_Cmd(USART1,ENABLE);
 	//interrupt configure
 	NVIC_InitStructure.NVIC_IRQChannel = USART1_IRQn;
 	NVIC_InitStructure.NVIC_IRQChannelCmd = ENABLE;
-	NVIC_InitStructure.NVIC_IRQChannelPriority = 0;
+	NVIC_InitStructure.NVIC_IRQChannelPriority = 1;	//sample clock latch needs the top priority.
 	NVIC_Init(&NVIC_InitStructure);//	USART_String("at\r\n");
+	NVIC_InitStructure.NVIC_IRQChannel = DMA1_Channel4_5_IRQn;
+	NVIC_Init(&NVIC_InitStructure);
+}
+
+static uint32_t uart_clock(void){
+	RCC_ClocksTypeDef clocks;
+	RCC_GetClocksFreq(&clocks);
+	return clocks.USART1CLK_Frequency;
+}
+
+/**
+ * @brief change baudrate, what's in tx ring is sent at the old one first.
+ * @return 0 if ok, -1 if rate can't be made from USART clock.
+*/
+int32_t uart_set_baud(uint32_t baud){
+	uint32_t brr;
+	if(baud == 0) return -1;
+	brr = (uart_clock() + baud/2)/baud;
+	if(brr < 16 || brr > 0xffff) return -1;
+	uart_flush();
+	USART1->CR1 &= ~USART_CR1_UE;
+	USART1->BRR = brr;
+	USART1->CR1 |= USART_CR1_UE;
+	return 0;
+}
+
+/**
+ * @brief get baudrate from BRR, it may be written by autobaud.
+ * @return baudrate.
+*/
+uint32_t uart_get_baud(void){
+	return uart_clock()/USART1->BRR;
+}
+
+/**
+ * @brief index of a supported baudrate, used to store it.
+ * @return index, -1 if it isn't supported.
+*/
+int32_t uart_baud_index(uint32_t baud){
+	for(uint32_t i=0; i<sizeof(baud_table)/sizeof(baud_table[0]); i++){
+		if(baud_table[i] == baud) return i;
+	}
+	return -1;
 }
 
+/**
+ * @return baudrate of index, 0 if index is wrong.
+*/
+uint32_t uart_baud_rate(uint32_t index){
+	if(index >= sizeof(baud_table)/sizeof(baud_table[0])) return 0;
+	return baud_table[index];
+}
+
+/**
+ * @brief measure baudrate on the next start bit. Host should send a
+ * character with bit0 set first, like '\r' or '}'.
+ * @return none.
+*/
+void uart_autobaud(uint32_t enable){
+	uart_flush();
+	USART1->CR1 &= ~USART_CR1_UE;
+	USART1->CR2 &= ~(USART_CR2_ABREN|USART_CR2_ABRMODE);  //mode 0, start bit.
+	if(enable)
+		USART1->CR2 |= USART_CR2_ABREN;
+	abr_armed = enable != 0;
+	abr_baud = 0;
+	USART1->CR1 |= USART_CR1_UE;
+}
+
+int32_t uart_autobaud_enabled(void){
+	return (USART1->CR2 & USART_CR2_ABREN) != 0;
+}
+
+/**
+ * @brief get measured baudrate, snapped to a supported one if it's within 3%.
+ * BRR keeps the measured value, it's what host really uses.
+ * @return baudrate once after autobaud succeeded, else 0.
+*/
+uint32_t uart_autobaud_poll(void){
+	uint32_t baud = abr_baud;
+	if(baud == 0) return 0;
+	abr_baud = 0;
+	for(uint32_t i=0; i<sizeof(baud_table)/sizeof(baud_table[0]); i++){
+		uint32_t diff = baud > baud_table[i] ? baud - baud_table[i] : baud_table[i] - baud;
+		if(diff*100 < baud_table[i]*3)
+			return baud_table[i];
+	}
+	return baud;
+}
+
+/**
+ * @brief catch up with DMA, called from interrupts of the same priority only.
+ * A half transfer interrupt comes at least every half ring, so distance to
+ * last position is never ambiguous.
+ * @return none.
+*/
+static void uart_rx_update(void){
+	uint32_t pos = (UART_RX_RING_SIZE - DMA1_Channel5->CNDTR)%UART_RX_RING_SIZE;
+	uint32_t level;
+	rx_wr += (pos - rx_dma_pos)%UART_RX_RING_SIZE;
+	rx_dma_pos = pos;
+	level = rx_wr - rx_rd;
+	if(level > rx_stat.high_water)
+		rx_stat.high_water = level;
+}
+
+/**
+ * @brief get received bytes that are contiguous in ring, call
+ * uart_rx_consume when they are used. If ring overran, what's in it is
+ * dropped and counted.
+ * @param pdata: pointer to first byte.
+ * @return number of bytes at pdata, 0 if nothing is received.
+*/
+uint32_t uart_rx_span(const uint8_t **pdata){
+	uint32_t wr = rx_wr, level = wr - rx_rd, index;
+	if(level > UART_RX_RING_SIZE){
+		rx_stat.overrun += level;
+		rx_rd = wr;
+		return 0;
+	}
+	index = rx_rd%UART_RX_RING_SIZE;
+	if(level > UART_RX_RING_SIZE - index)
+		level = UART_RX_RING_SIZE - index;
+	*pdata = &rx_ring[index];
+	return level;
+}
+
+void uart_rx_consume(uint32_t len){
+	rx_rd += len;
+}
+
+/**
+ * @brief get rx counters, level is the bytes waiting now.
+ * @return none.
+*/
+void uart_rx_stat(uart_rx_stat_def *stat, uint32_t clear){
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+	*stat = rx_stat;
+	stat->received = rx_wr;
+	stat->level = rx_wr - rx_rd;
+	if(clear){
+		rx_stat.overrun = 0;
+		rx_stat.ore = 0;
+		rx_stat.high_water = stat->level;
+	}
+	__set_PRIMASK(primask);
+}
+
+/**
+ * @brief move one byte from ring to USART if it's ready. Waiting callers use
+ * it, so a full ring drains even from interrupts of higher priority.
+ * @return none.
+*/
+static void uart_tx_kick(void){
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+	if(tx_rd != tx_wr && (USART1->ISR & USART_FLAG_TXE)){
+		USART1->TDR = tx_ring[tx_rd%UART_TX_RING_SIZE];
+		tx_rd++;
+		tx_stat.sent++;
+	}
+	__set_PRIMASK(primask);
+}
+
+/**
+ * @brief put one byte in ring, caller has checked there is room.
+ * @return none.
+*/
+static void uart_tx_put(uint8_t data){
+	uint32_t primask = __get_PRIMASK();
+	uint32_t level;
+	__disable_irq();
+	tx_ring[tx_wr%UART_TX_RING_SIZE] = data;
+	tx_wr++;
+	level = tx_wr - tx_rd;
+	if(level > tx_stat.high_water)
+		tx_stat.high_water = level;
+	USART1->CR1 |= USART_CR1_TXEIE;
+	__set_PRIMASK(primask);
+}
+
+/**
+ * @brief wait until ring has room for len bytes.
+ * @return none.
+*/
+static void uart_tx_wait(uint32_t len){
+	if(UART_TX_RING_SIZE - (tx_wr - tx_rd) >= len) return;
+	tx_stat.blocked++;
+	while(UART_TX_RING_SIZE - (tx_wr - tx_rd) < len)
+		uart_tx_kick();
+}
+
+/**
+ * @brief send one byte of a binary frame. It always waits for room, a frame
+ * with a byte missing is worse than a late one.
+ * @return none.
+*/
 void uart_char(uint8_t data)
 {
-	USART_SendData(USART1, (unsigned char) data);
-	while (!(USART1->ISR & USART_FLAG_TC));
+	uart_tx_wait(1);
+	uart_tx_put(data);
 }
 
 /**
- * output function from printf.c
+ * output function from printf.c, text follows tx policy when ring is full.
+ * Truncate keeps room for the marker, which replaces the end of the line.
 */
 void _putchar(char data){
-	USART_SendData(USART1, (unsigned char) data);
-	while (!(USART1->ISR & USART_FLAG_TC));
+	uint32_t room;
+	if(tx_policy == uart_tx_block){
+		uart_char(data);
+		return;
+	}
+	room = UART_TX_RING_SIZE - (tx_wr - tx_rd);
+	if(tx_policy == uart_tx_drop){
+		if(room == 0){
+			tx_stat.dropped++;
+			return;
+		}
+		uart_tx_put(data);
+		return;
+	}
+	if(!tx_truncating && room > sizeof(UART_TX_MARKER)-1){
+		uart_tx_put(data);
+		return;
+	}
+	if(!tx_truncating){
+		tx_truncating = 1;
+		tx_stat.truncated++;
+	}
+	if(data != '\n'){
+		tx_stat.dropped++;
+		return;
+	}
+	tx_truncating = 0;
+	uart_tx_wait(sizeof(UART_TX_MARKER)-1);  //only if a frame took the reserve.
+	for(const char *p = UART_TX_MARKER; *p; p++)
+		uart_tx_put(*p);
+}
+
+/**
+ * @brief set what text output does when ring is full.
+ * @return none.
+*/
+void uart_tx_set_policy(uart_tx_policy_def policy){
+	tx_policy = policy;
+	tx_truncating = 0;
+}
+
+uart_tx_policy_def uart_tx_get_policy(void){
+	return tx_policy;
+}
+
+/**
+ * @brief wait until everything in ring is out of the pin, before reset or
+ * baudrate change.
+ * @return none.
+*/
+void uart_flush(void){
+	while(tx_rd != tx_wr)
+		uart_tx_kick();
+	while(!(USART1->ISR & USART_FLAG_TC));
 }
 
+/**
+ * @brief get tx counters, level is the bytes in ring now.
+ * @return none.
+*/
+void uart_tx_stat(uart_tx_stat_def *stat, uint32_t clear){
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+	*stat = tx_stat;
+	stat->level = tx_wr - tx_rd;
+	if(clear){
+		memset(&tx_stat, 0, sizeof(tx_stat));
+		tx_stat.high_water = stat->level;
+	}
+	__set_PRIMASK(primask);
+}
 
 void USART1_IRQHandler(void)
 {
-	if(USART_GetITStatus(USART1, USART_IT_RXNE) != RESET)
+	uint32_t isr = USART1->ISR;
+	if(isr & (USART_ISR_IDLE|USART_ISR_ORE))
 	{
-		if(uart_callback)
-			uart_callback((uint8_t)(USART1->RDR));
+		if(isr & USART_ISR_ORE)
+			rx_stat.ore++;  //DMA was late, a byte is lost.
+		USART1->ICR = USART_ICR_IDLECF|USART_ICR_ORECF;
+		uart_rx_update();
+		if(abr_armed){
+			if(isr & USART_ISR_ABRE)
+				USART1->RQR = USART_RQR_ABRRQ;  //bad first character, measure next one.
+			else if(isr & USART_ISR_ABRF){
+				abr_armed = 0;
+				abr_baud = uart_get_baud();
+			}
+		}
+	}
+	if((USART1->CR1 & USART_CR1_TXEIE) && (USART1->ISR & USART_FLAG_TXE))
+	{
+		if(tx_rd != tx_wr){
+			USART1->TDR = tx_ring[tx_rd%UART_TX_RING_SIZE];
+			tx_rd++;
+			tx_stat.sent++;
+		}
+		else
+			USART1->CR1 &= ~USART_CR1_TXEIE;
+	}
+}
+
+void DMA1_Channel4_5_IRQHandler(void)
+{
+	if(DMA1->ISR & (DMA1_FLAG_HT5|DMA1_FLAG_TC5))
+	{
+		DMA1->IFCR = DMA1_FLAG_GL5;
+		uart_rx_update();
+	}
+}
+
+/**
+ * @brief uartstat [clear]
+*/
+static int32_t ush_uart_stat(uint32_t argc, char **argv){
+	const char *policy_name[] = {"block", "drop", "trunc"};
+	uart_tx_stat_def stat;
+	uart_rx_stat_def rx;
+	uint32_t clear = argc > 1 && strcmp(argv[1], "clear") == 0;
+	uart_tx_stat(&stat, clear);
+	uart_rx_stat(&rx, clear);
+	//counters are taken before this line is queued.
+	USH_Print("tx policy: %s, ring: %u/%d, high water: %u\n", policy_name[tx_policy],
+	          stat.level, UART_TX_RING_SIZE, stat.high_water);
+	USH_Print("sent: %u, blocked: %u, dropped: %u, truncated lines: %u\n",
+	          stat.sent, stat.blocked, stat.dropped, stat.truncated);
+	USH_Print("rx ring: %u/%d, high water: %u\n", rx.level, UART_RX_RING_SIZE, rx.high_water);
+	USH_Print("received: %u, ring overrun: %u, uart overrun: %u\n", rx.received, rx.overrun, rx.ore);
+	return 0;
+}
+USH_REGISTER(ush_uart_stat, uartstat, Show UART1 tx and rx statistics: uartstat [clear]);
+
+/**
+ * @brief uarttx block|drop|trunc
+*/
+static int32_t ush_uart_tx(uint32_t argc, char **argv){
+	if(argc < 2) return 0;
+	if(strcmp(argv[1], "block") == 0) uart_tx_set_policy(uart_tx_block);
+	else if(strcmp(argv[1], "drop") == 0) uart_tx_set_policy(uart_tx_drop);
+	else if(strcmp(argv[1], "trunc") == 0) uart_tx_set_policy(uart_tx_truncate);
+	else{
+		USH_Print("policy should be block, drop or trunc\n");
+		return -1;
 	}
+	return 0;
 }
+USH_REGISTER(ush_uart_tx, uarttx, Set text output policy when tx ring is full: uarttx block|drop|trunc);
 
@@ -2,8 +2,51 @@
 #define _USART_H_
 #include "stm32f0xx.h"
 
-void uart_init(uint32_t baudrate, void(*pfunc)(uint8_t));
+#define UART_TX_RING_SIZE 256   //power of 2, free running index wraps cleanly.
+#define UART_RX_RING_SIZE 256   //power of 2, holds a protocol frame and a shell line.
+
+/**
+ * What text output does when tx ring is full. Binary frames always wait.
+*/
+typedef enum{
+	uart_tx_block = 0,  /**< wait until there is room. */
+	uart_tx_drop,       /**< drop the byte. */
+	uart_tx_truncate,   /**< drop rest of the line and end it with a marker. */
+}uart_tx_policy_def;
+
+typedef struct{
+	uint32_t level;       /**< bytes in ring. */
+	uint32_t high_water;  /**< max bytes in ring. */
+	uint32_t sent;        /**< bytes out. */
+	uint32_t blocked;     /**< times a writer waited for room. */
+	uint32_t dropped;     /**< bytes dropped by policy. */
+	uint32_t truncated;   /**< lines truncated. */
+}uart_tx_stat_def;
+
+typedef struct{
+	uint32_t received;    /**< bytes received since init. */
+	uint32_t level;       /**< bytes waiting in ring. */
+	uint32_t high_water;  /**< max bytes waiting in ring. */
+	uint32_t overrun;     /**< bytes dropped because ring was overwritten. */
+	uint32_t ore;         /**< USART overrun errors, DMA missed a byte. */
+}uart_rx_stat_def;
+
+void uart_init(uint32_t baudrate);
+int32_t uart_set_baud(uint32_t baud);
+uint32_t uart_get_baud(void);
+int32_t uart_baud_index(uint32_t baud);
+uint32_t uart_baud_rate(uint32_t index);
+void uart_autobaud(uint32_t enable);
+int32_t uart_autobaud_enabled(void);
+uint32_t uart_autobaud_poll(void);
+uint32_t uart_rx_span(const uint8_t **pdata);
+void uart_rx_consume(uint32_t len);
+void uart_rx_stat(uart_rx_stat_def *stat, uint32_t clear);
 void uart_char(uint8_t data);
+void uart_tx_set_policy(uart_tx_policy_def policy);
+uart_tx_policy_def uart_tx_get_policy(void);
+void uart_tx_stat(uart_tx_stat_def *stat, uint32_t clear);
+void uart_flush(void);
 
 void usart_for_led(void);
 void usart_for_ush(void);
@@ -2,6 +2,7 @@
 #include "hmi.h"
 #include "timer.h"
 #include "adt7420.h"
+#include "uart.h"
 
 #define LOG_TAG              "main"
 #define LOG_LVL              LOG_LVL_DBG
@@ -14,7 +15,8 @@ int ulog_console_backend_init(void);
 
 int main(void)
 {
-  {int i=1000000;while(i--);}
+  {volatile int i=1000000;while(i--);}
+  SystemCoreClockUpdate();  /* SystemInit leaves the 48MHz default in SystemCoreClock */
 #ifdef RT_USING_ULOG
   ulog_console_backend_init();
   ulog_init();
@@ -38,6 +40,7 @@ int main(void)
  * @brief set the volatage.
 */
 static int32_t sytem_reboot(uint32_t argc, char **argv){
+  uart_flush();
   NVIC_SystemReset();
   return 0;
 }
@@ -0,0 +1,98 @@
+/**
+ * @author Neo Xu (neo.xu1990@gmail.com)
+ * @license The MIT License (MIT)
+ *
+ * Copyright (c) 2019 Neo Xu
+ *
+ * @brief host exhaustive check of ad5791 integer conversion, all 2^20 codes
+ * for a few references. For every code:
+ *  - float voltage from the old path gives the same code on old and new path,
+ *  - code->nV and nV->code are exactly rounded, checked with 128bit math,
+ *  - nV->code is exact right around the half code boundary above it,
+ *  - code->nV->code round trips.
+ * Build and run in firmware/test:
+ *   gcc -O2 -Wall -DSTM32F030 -I../src/bsp -I../stm32f0xxlib/CMSIS/Device/ST/STM32F0xx/Include -I../stm32f0xxlib/CMSIS/Include convcheck.c ../src/bsp/ad5791_conv.c -o convcheck
+ *   ./convcheck
+*/
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include "ad5791.h"
+
+static const uint64_t vref_list[] = {
+  10091741325ull,   //firmware default.
+  10000000000ull,
+  5000000000ull,
+  2500000000ull,
+  20000000000ull,   //largest scale.
+};
+
+/**
+ * @brief the float path used before, same as convcheck on target.
+*/
+static uint32_t volt2code_float(double vref, float volt){
+  uint32_t code;
+  code = (uint32_t)(volt/vref*0xfffff + 0.5f);
+  if(code > 0xfffff) code = 0xfffff;
+  return code;
+}
+
+static uint64_t round_div(unsigned __int128 n, uint64_t d){
+  return (uint64_t)((n + d/2)/d);
+}
+
+/**
+ * @brief nV->code next to the boundary between code and code+1.
+ * @return number of wrong codes.
+*/
+static uint32_t check_boundary(const ad5791_dev_def *dev, uint32_t code){
+  uint64_t b = (uint64_t)(((unsigned __int128)(2*code+1)*dev->vref_nv)/(2*0xfffff));
+  uint32_t fail = 0;
+  for(uint64_t nv=b-1; nv<=b+2; nv++){
+    uint64_t exact = round_div((unsigned __int128)nv*0xfffff, dev->vref_nv);
+    if(exact > 0xfffff) exact = 0xfffff;
+    if(ad5791_nv2code(dev, nv) != exact){
+      if(fail++ < 2)
+        printf("vref %llunV nv %llu: 0x%05x, exact 0x%05x\n", (unsigned long long)dev->vref_nv,
+               (unsigned long long)nv, ad5791_nv2code(dev, nv), (uint32_t)exact);
+    }
+  }
+  return fail;
+}
+
+static uint32_t check_vref(uint64_t vref_nv){
+  ad5791_dev_def dev;
+  double vref;
+  uint32_t fail = 0;
+  memset(&dev, 0, sizeof(dev));
+  ad5791_dev_set_scale(&dev, vref_nv);
+  vref = dev.vref_nv*1e-9;
+  for(uint32_t code=0; code<=0xfffff; code++){
+    float volt = code*vref/0xfffff;
+    uint32_t code_float = volt2code_float(vref, volt);
+    uint32_t code_fixed = ad5791_nv2code(&dev, ad5791_volt2nv(volt));
+    uint64_t nv = ad5791_code2nv(&dev, code);
+    uint64_t nv_exact = round_div((unsigned __int128)code*dev.vref_nv, 0xfffff);
+    uint32_t code_trip = ad5791_nv2code(&dev, nv);
+    uint32_t code_exact = (uint32_t)round_div((unsigned __int128)nv*0xfffff, dev.vref_nv);
+    uint32_t code_dev = ad5791_dev_nv2code(&dev, nv);
+    if(code_float != code_fixed || nv != nv_exact || code_trip != code ||
+       code_trip != code_exact || code_dev != code || (code < 0xfffff && check_boundary(&dev, code))){
+      if(fail++ < 8)
+        printf("vref %lluuV code 0x%05x: float 0x%05x, fixed 0x%05x, nv %llu(%llu), "
+               "round trip 0x%05x, dev 0x%05x\n", (unsigned long long)vref_nv/1000, code,
+               code_float, code_fixed, (unsigned long long)nv, (unsigned long long)nv_exact,
+               code_trip, code_dev);
+    }
+  }
+  printf("vref %llunV: %u codes, %u mismatch\n", (unsigned long long)dev.vref_nv, 0x100000, fail);
+  return fail;
+}
+
+int main(void){
+  uint32_t fail = 0;
+  for(uint32_t i=0; i<sizeof(vref_list)/sizeof(vref_list[0]); i++)
+    fail += check_vref(vref_list[i]);
+  printf("%s\n", fail ? "FAIL" : "PASS");
+  return fail ? 1 : 0;
+}
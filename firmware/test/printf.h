@@ -0,0 +1,9 @@
+/**
+ * @brief host stand-in for the printf submodule, so ush_conf.h builds with libc.
+*/
+#ifndef _PRINTF_H_
+#define _PRINTF_H_
+
+#include <stdio.h>
+
+#endif
@@ -0,0 +1,93 @@
+/**
+ * @author Neo Xu (neo.xu1990@gmail.com)
+ * @license The MIT License (MIT)
+ *
+ * Copyright (c) 2019 Neo Xu
+ *
+ * @brief host benchmark of the shell input path, in bytes/s.
+ * A command script is fed to ush one byte per call, as voltref_loop() used to,
+ * a line per call, as voltref_input() does, and a whole receive span per call.
+ * Shell output goes to stdout, results to stderr.
+ * Build in firmware/test with the ush submodule checked out:
+ *   gcc -O2 -I. -I../src/3rdparty -I../src/3rdparty/ush rxbench.c ../src/3rdparty/ush/ush.c -o rxbench
+ *   ./rxbench > /dev/null
+*/
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include "ush.h"
+
+#define RXBENCH_BYTES   (4*1024*1024)   //script bytes fed per method.
+#define RXBENCH_SPAN    64              //bytes per receive span, like a DMA half ring.
+#define RXBENCH_ROUNDS  5               //best round is reported.
+
+static const char *script[] = {
+  "setvolt 1.25\n",
+  "setnv 0 -2500000000\n",
+  "dacstat\n",
+  "ramp 100000 linear\n",
+  "setcode 1 0x80000\n",
+  "*IDN?\n",
+};
+
+static ush_def ush;
+static char line_buff[128];
+static char input[RXBENCH_BYTES];
+
+static double now(void){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+static void feed_byte(const char *pdata, uint32_t len){
+  for(uint32_t i=0; i<len; i++)
+    ush_process_input(&ush, (char*)&pdata[i], 1);
+}
+
+static void feed_line(const char *pdata, uint32_t len){
+  uint32_t start = 0;
+  for(uint32_t i=0; i<len; i++){
+    if(pdata[i] == '\n' || pdata[i] == '\r'){
+      ush_process_input(&ush, (char*)&pdata[start], i + 1 - start);
+      start = i + 1;
+    }
+  }
+  if(len > start)
+    ush_process_input(&ush, (char*)&pdata[start], len - start);
+}
+
+static void feed_span(const char *pdata, uint32_t len){
+  ush_process_input(&ush, (char*)pdata, len);
+}
+
+static void run(const char *name, void (*feed)(const char *pdata, uint32_t len), uint32_t len){
+  double t, best = 0;
+  for(uint32_t r=0; r<RXBENCH_ROUNDS; r++){
+    ush_init(&ush, line_buff, sizeof(line_buff));
+    t = now();
+    for(uint32_t i=0; i<len; i+=RXBENCH_SPAN)
+      feed(&input[i], len - i < RXBENCH_SPAN ? len - i : RXBENCH_SPAN);
+    t = now() - t;
+    if(best == 0 || t < best)
+      best = t;
+  }
+  fprintf(stderr, "%-5s %10.0f bytes/s\n", name, len/best);
+}
+
+int main(void){
+  uint32_t len = 0, n = 0;
+  while(1){
+    uint32_t sz = strlen(script[n]);
+    if(len + sz > sizeof(input))
+      break;
+    memcpy(&input[len], script[n], sz);
+    len += sz;
+    n = (n + 1)%(sizeof(script)/sizeof(script[0]));
+  }
+  run("byte", feed_byte, len);
+  run("line", feed_line, len);
+  run("span", feed_span, len);
+  return 0;
+}